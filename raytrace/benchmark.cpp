@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpu_raytracer.hpp"
+#include "entities.hpp"
+#include "mesh.hpp"
+#include "uniform_grid.hpp"
+#include "wide_bvh.hpp"
+
+using namespace std;
+
+inline float GetRandom() {
+    return static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+}
+
+static double Measure(const std::function<void()>& fn) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Usage: raytrace_benchmark [spheres] [max threads] [obj file]
+int main(int argc, char** argv) {
+    int spheresNumber = argc > 1 ? stoi(argv[1]) : 1000000;
+    int maxThreads = argc > 2 ? stoi(argv[2]) : max(1u, thread::hardware_concurrency());
+
+    // same distribution as the main.cpp scene, with the box grown to keep the density
+    float side = 4.0f * cbrt(spheresNumber / 50.0f);
+    vector<BVHPrimitive> primitives(spheresNumber);
+    for (auto& primitive: primitives) {
+        primitive.Center = Vector3(GetRandom() * side - side / 2, GetRandom() * side - side / 2, GetRandom() * side - side / 2);
+        float radius = 0.3f + GetRandom() * 0.6f;
+        primitive.Extent = Vector3(radius, radius, radius);
+    }
+
+    cout << "spheres: " << spheresNumber << "\n";
+
+    BVH bvh;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double sah = Measure([&]() { bvh.Build(primitives, BVH::BuildMode::BinnedSAH, threads); });
+        size_t sahNodes = bvh.Nodes.size();
+        double lbvh = Measure([&]() { bvh.Build(primitives, BVH::BuildMode::LBVH, threads); });
+        size_t lbvhNodes = bvh.Nodes.size();
+
+        cout << "threads: " << threads
+             << "  binned SAH: " << sah << " ms (" << sahNodes << " nodes)"
+             << "  LBVH: " << lbvh << " ms (" << lbvhNodes << " nodes)\n";
+        if (threads < maxThreads && threads * 2 > maxThreads) {
+            threads = maxThreads / 2;
+        }
+    }
+
+    UniformGrid grid;
+    double gridBuild = Measure([&]() { grid.Build(primitives); });
+    cout << "uniform grid: " << gridBuild << " ms (" << grid.Dims[0] << "x" << grid.Dims[1] << "x" << grid.Dims[2]
+         << " cells, " << grid.Indices.size() / (float)spheresNumber << " references per sphere)\n";
+
+    // node memory of the binary and quantized wide layouts
+    bvh.Build(primitives, BVH::BuildMode::BinnedSAH, maxThreads);
+    cout << "binary nodes: " << bvh.Nodes.size() * sizeof(BVHNode) / (float)spheresNumber << " bytes per sphere\n";
+    for (int width: {4, 8}) {
+        WideBVH wide;
+        wide.Build(bvh, width);
+        cout << width << "-wide nodes: " << wide.Data.size() * sizeof(float) / (float)spheresNumber << " bytes per sphere\n";
+    }
+
+    // a small frame of the same spheres through the CPU backend, once per tree layout and once with the grid
+    const int width = 320;
+    const int height = 256;
+    entt::registry registry;
+    {
+        auto entity = registry.create();
+        Transform& transform = registry.assign<Transform>(entity);
+        transform.Position = Vector3(0.0f, -2.0f, -side);
+        registry.assign<Camera>(entity);
+    }
+    {
+        auto entity = registry.create();
+        Transform& transform = registry.assign<Transform>(entity);
+        transform.Position = Vector3(23.0f, 30.0f, -80.0f);
+        LightSource& light = registry.assign<LightSource>(entity);
+        light.Power = 0.9f;
+    }
+    for (const auto& primitive: primitives) {
+        auto entity = registry.create();
+        Transform& transform = registry.assign<Transform>(entity);
+        transform.Position = primitive.Center;
+        SphereRenderer& sphere = registry.assign<SphereRenderer>(entity);
+        sphere.Radius = primitive.Extent.X;
+        Material& material = registry.assign<Material>(entity);
+        material.Color = Color(GetRandom(), GetRandom(), GetRandom());
+        material.DiffuseCF = 0.1f + GetRandom() * 0.8f;
+        material.AlbedoCF = Vector3(20.0f, 1.4f, GetRandom() * 0.4f);
+        material.RefractCF = Vector2(GetRandom() * 0.2f, 0.0f);
+    }
+    for (int treeWidth: {2, 4, 8, SceneEncoder::GRID}) {
+        CPURaytracer raytracer(registry, width, height, treeWidth, maxThreads);
+        raytracer.Update();
+        double frame = Measure([&]() { raytracer.Update(); });
+        cout << "CPU frame " << width << "x" << height << ", "
+             << (treeWidth == SceneEncoder::GRID ? string("uniform grid") : "tree width " + to_string(treeWidth))
+             << ": " << frame << " ms\n";
+    }
+    {
+        CPURaytracer raytracer(registry, width, height, 4, maxThreads);
+        raytracer.SetLightSampling(CPURaytracer::LightSampling::Reservoirs);
+        raytracer.Update();
+        double frame = Measure([&]() { raytracer.Update(); });
+        cout << "CPU frame " << width << "x" << height << ", reservoir light sampling: " << frame << " ms\n";
+    }
+
+    // the same camera looking at a single instance of the mesh
+    if (argc > 3) {
+        shared_ptr<Mesh> mesh;
+        double load = Measure([&]() { mesh = LoadOBJ(argv[3]); });
+        cout << "mesh: " << mesh->Indices.size() / 3 << " triangles, loaded and built in " << load << " ms\n";
+
+        entt::registry meshRegistry;
+        for (auto entity: registry.view<Camera>()) {
+            auto copy = meshRegistry.create();
+            meshRegistry.assign<Transform>(copy, registry.get<Transform>(entity));
+            meshRegistry.assign<Camera>(copy);
+        }
+        for (auto entity: registry.view<LightSource>()) {
+            auto copy = meshRegistry.create();
+            meshRegistry.assign<Transform>(copy, registry.get<Transform>(entity));
+            meshRegistry.assign<LightSource>(copy, registry.get<LightSource>(entity));
+        }
+        auto entity = meshRegistry.create();
+        Transform& transform = meshRegistry.assign<Transform>(entity);
+        transform.Position = Vector3(0.0f, -2.0f, 0.0f);
+        meshRegistry.assign<MeshRenderer>(entity).Mesh = mesh;
+        Material& material = meshRegistry.assign<Material>(entity);
+        material.Color = Color(0.8f, 0.8f, 0.8f);
+        material.DiffuseCF = 0.5f;
+        material.AlbedoCF = Vector3(20.0f, 1.4f, 0.0f);
+
+        CPURaytracer raytracer(meshRegistry, width, height, 4, maxThreads);
+        raytracer.Update();
+        double frame = Measure([&]() { raytracer.Update(); });
+        cout << "CPU frame " << width << "x" << height << ", mesh: " << frame << " ms\n";
+    }
+
+    return 0;
+}
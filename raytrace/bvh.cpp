@@ -0,0 +1,411 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <utility>
+
+const int SAH_BINS = 16;
+const int PARALLEL_THRESHOLD = 1 << 16;    // smaller ranges are not worth a thread
+
+struct Bounds {
+    float Min[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+    float Max[3] = {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+
+    void Grow(const float point[3], const float extent[3]) {
+        for (int i = 0; i < 3; ++i) {
+            Min[i] = std::min(Min[i], point[i] - extent[i]);
+            Max[i] = std::max(Max[i], point[i] + extent[i]);
+        }
+    }
+    void Grow(const float point[3]) {
+        for (int i = 0; i < 3; ++i) {
+            Min[i] = std::min(Min[i], point[i]);
+            Max[i] = std::max(Max[i], point[i]);
+        }
+    }
+    void Grow(const Bounds& other) {
+        for (int i = 0; i < 3; ++i) {
+            Min[i] = std::min(Min[i], other.Min[i]);
+            Max[i] = std::max(Max[i], other.Max[i]);
+        }
+    }
+    float Area() const {
+        float dx = Max[0] - Min[0];
+        float dy = Max[1] - Min[1];
+        float dz = Max[2] - Min[2];
+        if (dx < 0) {
+            return 0.0f;
+        }
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+static void GetCenter(const BVHPrimitive& primitive, float center[3]) {
+    center[0] = primitive.Center.X;
+    center[1] = primitive.Center.Y;
+    center[2] = primitive.Center.Z;
+}
+
+static void GetExtent(const BVHPrimitive& primitive, float extent[3]) {
+    extent[0] = primitive.Extent.X;
+    extent[1] = primitive.Extent.Y;
+    extent[2] = primitive.Extent.Z;
+}
+
+// Calls fn(begin, end, chunk) for `chunks` equal parts of [0, count), each part on its own thread
+static void ParallelFor(int count, int chunks, const std::function<void(int, int, int)>& fn) {
+    if (chunks <= 1 || count < PARALLEL_THRESHOLD) {
+        fn(0, count, 0);
+        return;
+    }
+    std::vector<std::thread> workers;
+    int chunkSize = (count + chunks - 1) / chunks;
+    for (int i = 1; i < chunks; ++i) {
+        int begin = std::min(count, i * chunkSize);
+        int end = std::min(count, begin + chunkSize);
+        workers.emplace_back(fn, begin, end, i);
+    }
+    fn(0, std::min(count, chunkSize), 0);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+// Measures primitive bounds and center bounds of Indices[first, first + count)
+static void MeasureRange(const std::vector<BVHPrimitive>& primitives, const std::vector<int>& indices,
+                         int first, int count, int threads, Bounds& bounds, Bounds& centers)
+{
+    // part 0 accumulates straight into the result, so single-threaded calls don't allocate
+    std::vector<Bounds> partBounds(threads - 1);
+    std::vector<Bounds> partCenters(threads - 1);
+    ParallelFor(count, threads, [&](int begin, int end, int part) {
+        Bounds& targetBounds = part == 0 ? bounds : partBounds[part - 1];
+        Bounds& targetCenters = part == 0 ? centers : partCenters[part - 1];
+        float center[3];
+        float extent[3];
+        for (int i = first + begin; i < first + end; ++i) {
+            GetCenter(primitives[indices[i]], center);
+            GetExtent(primitives[indices[i]], extent);
+            targetBounds.Grow(center, extent);
+            targetCenters.Grow(center);
+        }
+    });
+    for (int i = 0; i < threads - 1; ++i) {
+        bounds.Grow(partBounds[i]);
+        centers.Grow(partCenters[i]);
+    }
+}
+
+static void SetBounds(BVHNode& node, const Bounds& bounds) {
+    for (int i = 0; i < 3; ++i) {
+        node.Min[i] = bounds.Min[i];
+        node.Max[i] = bounds.Max[i];
+    }
+}
+
+void BVH::Build(const std::vector<BVHPrimitive>& primitives, BuildMode mode, int threads) {
+    Clear();
+    if (primitives.empty()) {
+        return;
+    }
+
+    Threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    SpawnDepth = 0;
+    while ((1 << SpawnDepth) < Threads) {
+        ++SpawnDepth;
+    }
+
+    Indices.resize(primitives.size());
+    ParallelFor(primitives.size(), Threads, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            Indices[i] = i;
+        }
+    });
+
+    // a tree with leaves of at least one primitive never has more than 2N - 1 nodes,
+    // so the storage is allocated up front and children are claimed with an atomic counter
+    Nodes.resize(2 * primitives.size());
+    NodesUsed = 1;
+    Nodes[0].LeftOrFirst = 0;
+    Nodes[0].Count = primitives.size();
+
+    if (mode == BuildMode::LBVH) {
+        SortMortonCodes(primitives);
+        BuildLBVH(primitives, 0, 0, primitives.size(), 0);
+        MortonCodes.clear();
+    } else {
+        BuildSAH(primitives, 0, 0);
+    }
+
+    Nodes.resize(NodesUsed);
+}
+
+void BVH::Clear() {
+    Nodes.clear();
+    Indices.clear();
+    NodesUsed = 0;
+}
+
+int BVH::GetDepth(const std::vector<BVHNode>& nodes) {
+    if (nodes.empty()) {
+        return 0;
+    }
+    int depth = 0;
+    std::vector<std::pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        const BVHNode& node = nodes[entry.first];
+        if (node.Count > 0) {
+            depth = std::max(depth, entry.second);
+            continue;
+        }
+        stack.push_back({node.LeftOrFirst, entry.second + 1});
+        stack.push_back({node.LeftOrFirst + 1, entry.second + 1});
+    }
+    return depth;
+}
+
+int BVH::AllocatePair() {
+    return NodesUsed.fetch_add(2);
+}
+
+void BVH::BuildSAH(const std::vector<BVHPrimitive>& primitives, int nodeIdx, int depth) {
+    BVHNode& node = Nodes[nodeIdx];
+    int first = node.LeftOrFirst;
+    int count = node.Count;
+    int threads = depth < SpawnDepth ? std::max(1, Threads >> depth) : 1;
+
+    Bounds bounds;
+    Bounds centers;
+    MeasureRange(primitives, Indices, first, count, threads, bounds, centers);
+    SetBounds(node, bounds);
+
+    if (count <= MAX_LEAF_SIZE) {
+        return;
+    }
+
+    // bin the centers along every axis and sweep the bin boundaries for the cheapest split
+    struct Bin {
+        Bounds Box;
+        int Count = 0;
+    };
+    Bin bins[3 * SAH_BINS];
+    std::vector<Bin> partBins((threads - 1) * 3 * SAH_BINS);
+    float binScale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centers.Max[axis] - centers.Min[axis];
+        binScale[axis] = extent > 0.0f ? SAH_BINS / extent : 0.0f;
+    }
+
+    ParallelFor(count, threads, [&](int begin, int end, int part) {
+        Bin* targetBins = part == 0 ? bins : &partBins[(part - 1) * 3 * SAH_BINS];
+        float center[3];
+        float extent[3];
+        for (int i = first + begin; i < first + end; ++i) {
+            const BVHPrimitive& primitive = primitives[Indices[i]];
+            GetCenter(primitive, center);
+            GetExtent(primitive, extent);
+            for (int axis = 0; axis < 3; ++axis) {
+                int b = std::min(SAH_BINS - 1, int((center[axis] - centers.Min[axis]) * binScale[axis]));
+                targetBins[axis * SAH_BINS + b].Count += 1;
+                targetBins[axis * SAH_BINS + b].Box.Grow(center, extent);
+            }
+        }
+    });
+    for (int part = 0; part < threads - 1; ++part) {
+        for (int b = 0; b < 3 * SAH_BINS; ++b) {
+            bins[b].Count += partBins[part * 3 * SAH_BINS + b].Count;
+            bins[b].Box.Grow(partBins[part * 3 * SAH_BINS + b].Box);
+        }
+    }
+
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; ++axis) {
+        if (binScale[axis] == 0.0f) {
+            continue;
+        }
+        const Bin* axisBins = &bins[axis * SAH_BINS];
+        float rightCost[SAH_BINS];
+        Bounds rightBox;
+        int rightCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            rightBox.Grow(axisBins[b].Box);
+            rightCount += axisBins[b].Count;
+            rightCost[b] = rightBox.Area() * rightCount;
+        }
+        Bounds leftBox;
+        int leftCount = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            leftBox.Grow(axisBins[b].Box);
+            leftCount += axisBins[b].Count;
+            float cost = leftBox.Area() * leftCount + rightCost[b + 1];
+            if (leftCount > 0 && leftCount < count && cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b + 1;
+            }
+        }
+    }
+
+    int mid = first + count / 2;
+    if (bestAxis >= 0) {
+        float minCenter = centers.Min[bestAxis];
+        float scale = binScale[bestAxis];
+        auto it = std::partition(Indices.begin() + first, Indices.begin() + first + count, [&](int idx) {
+            float center[3];
+            GetCenter(primitives[idx], center);
+            return std::min(SAH_BINS - 1, int((center[bestAxis] - minCenter) * scale)) < bestSplit;
+        });
+        mid = it - Indices.begin();
+    }
+    // all centers coincide or the split degenerated: fall back to halving the range
+    if (mid == first || mid == first + count) {
+        mid = first + count / 2;
+    }
+
+    int leftIdx = AllocatePair();
+    Nodes[leftIdx].LeftOrFirst = first;
+    Nodes[leftIdx].Count = mid - first;
+    Nodes[leftIdx + 1].LeftOrFirst = mid;
+    Nodes[leftIdx + 1].Count = first + count - mid;
+    node.LeftOrFirst = leftIdx;
+    node.Count = 0;
+
+    if (depth < SpawnDepth && count >= PARALLEL_THRESHOLD) {
+        std::thread left(&BVH::BuildSAH, this, std::cref(primitives), leftIdx, depth + 1);
+        BuildSAH(primitives, leftIdx + 1, depth + 1);
+        left.join();
+    } else {
+        BuildSAH(primitives, leftIdx, depth + 1);
+        BuildSAH(primitives, leftIdx + 1, depth + 1);
+    }
+}
+
+static uint32_t ExpandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void BVH::SortMortonCodes(const std::vector<BVHPrimitive>& primitives) {
+    int count = primitives.size();
+
+    Bounds bounds;
+    Bounds centers;
+    MeasureRange(primitives, Indices, 0, count, Threads, bounds, centers);
+
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centers.Max[axis] - centers.Min[axis];
+        scale[axis] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+    }
+
+    // 30-bit code in the high word, primitive index in the low word
+    std::vector<uint64_t> keys(count);
+    ParallelFor(count, Threads, [&](int begin, int end, int) {
+        float center[3];
+        for (int i = begin; i < end; ++i) {
+            GetCenter(primitives[i], center);
+            uint32_t code = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                uint32_t q = uint32_t((center[axis] - centers.Min[axis]) * scale[axis]);
+                code |= ExpandBits(std::min(q, 1023u)) << (2 - axis);
+            }
+            keys[i] = (uint64_t(code) << 32) | uint32_t(i);
+        }
+    });
+
+    // sort chunks in parallel, then merge neighbouring runs pairwise
+    int chunks = count >= PARALLEL_THRESHOLD ? Threads : 1;
+    int chunkSize = (count + chunks - 1) / chunks;
+    ParallelFor(count, chunks, [&](int begin, int end, int) {
+        for (int from = begin; from < end; from += chunkSize) {
+            std::sort(keys.begin() + from, keys.begin() + std::min(end, from + chunkSize));
+        }
+    });
+    for (int width = chunkSize; width < count; width *= 2) {
+        int merges = (count + 2 * width - 1) / (2 * width);
+        std::vector<std::thread> workers;
+        for (int m = 0; m < merges; ++m) {
+            int begin = m * 2 * width;
+            int mid = std::min(count, begin + width);
+            int end = std::min(count, begin + 2 * width);
+            if (mid < end) {
+                workers.emplace_back([&keys, begin, mid, end]() {
+                    std::inplace_merge(keys.begin() + begin, keys.begin() + mid, keys.begin() + end);
+                });
+            }
+        }
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
+    MortonCodes.resize(count);
+    ParallelFor(count, Threads, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            Indices[i] = int(keys[i] & 0xFFFFFFFFu);
+            MortonCodes[i] = uint32_t(keys[i] >> 32);
+        }
+    });
+}
+
+void BVH::BuildLBVH(const std::vector<BVHPrimitive>& primitives, int nodeIdx, int first, int count, int depth) {
+    BVHNode& node = Nodes[nodeIdx];
+
+    if (count <= MAX_LEAF_SIZE) {
+        Bounds bounds;
+        float center[3];
+        float extent[3];
+        for (int i = first; i < first + count; ++i) {
+            GetCenter(primitives[Indices[i]], center);
+            GetExtent(primitives[Indices[i]], extent);
+            bounds.Grow(center, extent);
+        }
+        SetBounds(node, bounds);
+        node.LeftOrFirst = first;
+        node.Count = count;
+        return;
+    }
+
+    // split where the highest differing bit of the sorted codes flips
+    int last = first + count - 1;
+    uint32_t firstCode = MortonCodes[first];
+    uint32_t lastCode = MortonCodes[last];
+    int mid = first + count / 2;
+    if (firstCode != lastCode) {
+        uint32_t highBit = 31 - __builtin_clz(firstCode ^ lastCode);
+        uint32_t prefixMask = ~((1u << highBit) - 1) & ~(1u << highBit);
+        uint32_t splitCode = (firstCode & prefixMask) | (1u << highBit);
+        mid = std::lower_bound(MortonCodes.begin() + first, MortonCodes.begin() + last + 1, splitCode) - MortonCodes.begin();
+    }
+
+    int leftIdx = AllocatePair();
+    node.LeftOrFirst = leftIdx;
+    node.Count = 0;
+
+    if (depth < SpawnDepth && count >= PARALLEL_THRESHOLD) {
+        std::thread left(&BVH::BuildLBVH, this, std::cref(primitives), leftIdx, first, mid - first, depth + 1);
+        BuildLBVH(primitives, leftIdx + 1, mid, first + count - mid, depth + 1);
+        left.join();
+    } else {
+        BuildLBVH(primitives, leftIdx, first, mid - first, depth + 1);
+        BuildLBVH(primitives, leftIdx + 1, mid, first + count - mid, depth + 1);
+    }
+
+    Bounds bounds;
+    for (int child = leftIdx; child <= leftIdx + 1; ++child) {
+        for (int i = 0; i < 3; ++i) {
+            bounds.Min[i] = std::min(bounds.Min[i], Nodes[child].Min[i]);
+            bounds.Max[i] = std::max(bounds.Max[i], Nodes[child].Max[i]);
+        }
+    }
+    SetBounds(node, bounds);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "linmath.hpp"
+
+// Integer fields of the float buffers read by the kernels are stored bit-cast,
+// floats only hold integers exactly up to 2^24
+inline float PackInt(int value) {
+    float bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline int UnpackInt(const float& bits) {
+    int value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+struct BVHPrimitive {
+    Vector3 Center;
+    Vector3 Extent;     // half size of the primitive box, the radius on every axis for spheres
+};
+
+struct BVHNode {
+    float Min[3];
+    float Max[3];
+    int LeftOrFirst;    // left child for inner nodes (right is LeftOrFirst + 1), first primitive for leaves
+    int Count;          // number of primitives in a leaf, 0 for inner nodes
+};
+
+class BVH {
+public:
+    static const int MAX_LEAF_SIZE = 4;
+
+    enum class BuildMode {
+        BinnedSAH,      // better trees, for geometry that is built once
+        LBVH,           // Morton-sorted, for geometry rebuilt every frame
+    };
+
+    // threads = 0 uses all hardware threads
+    void Build(const std::vector<BVHPrimitive>& primitives, BuildMode mode = BuildMode::BinnedSAH, int threads = 0);
+    void Clear();
+
+    // Inner nodes on the longest path from the root to a leaf
+    static int GetDepth(const std::vector<BVHNode>& nodes);
+public:
+    std::vector<BVHNode> Nodes;
+    std::vector<int> Indices;   // primitives in leaf order
+private:
+    void BuildSAH(const std::vector<BVHPrimitive>& primitives, int nodeIdx, int depth);
+    void BuildLBVH(const std::vector<BVHPrimitive>& primitives, int nodeIdx, int first, int count, int depth);
+    void SortMortonCodes(const std::vector<BVHPrimitive>& primitives);
+    int AllocatePair();
+private:
+    std::atomic<int> NodesUsed{0};
+    std::vector<uint32_t> MortonCodes;
+    int Threads = 1;
+    int SpawnDepth = 0;
+};
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpu_raytracer.hpp"
+#include "denoiser.hpp"
+#include "entities.hpp"
+#include "mesh.hpp"
+
+using namespace std;
+
+// Output checks of the CPU backend, run by ctest one by one: raytrace_checks [check]
+
+const int WIDTH = 160;
+const int HEIGHT = 128;
+
+inline float GetRandom() {
+    return static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
+}
+
+static entt::entity AddCamera(entt::registry& registry, const Vector3& position) {
+    auto entity = registry.create();
+    registry.assign<Transform>(entity).Position = position;
+    registry.assign<Camera>(entity);
+    return entity;
+}
+
+static void AddLight(entt::registry& registry, const Vector3& position, float power) {
+    auto entity = registry.create();
+    registry.assign<Transform>(entity).Position = position;
+    registry.assign<LightSource>(entity).Power = power;
+}
+
+static entt::entity AddSphere(entt::registry& registry, const Vector3& position, float radius, const Color& color) {
+    auto entity = registry.create();
+    registry.assign<Transform>(entity).Position = position;
+    registry.assign<SphereRenderer>(entity).Radius = radius;
+    Material& material = registry.assign<Material>(entity);
+    material.Color = color;
+    material.DiffuseCF = 0.8f;
+    material.AlbedoCF = Vector3(20.0f, 1.4f, 0.1f);
+    material.RefractCF = Vector2(0.0f, 0.0f);
+    return entity;
+}
+
+// A few spheres in front of the camera, the same for every run
+static vector<entt::entity> AddSpheres(entt::registry& registry, int number) {
+    vector<entt::entity> spheres;
+    srand(1);
+    for (int i = 0; i < number; ++i) {
+        Vector3 position(GetRandom() * 8.0f - 4.0f, GetRandom() * 6.0f - 3.0f, GetRandom() * 6.0f - 3.0f);
+        spheres.push_back(AddSphere(registry, position, 0.4f + GetRandom() * 0.6f, Color(GetRandom(), GetRandom(), GetRandom())));
+    }
+    return spheres;
+}
+
+static void AddBoard(entt::registry& registry) {
+    auto entity = registry.create();
+    registry.assign<Transform>(entity).Position = Vector3(0.0f, -3.0f, 0.0f);
+    ChessBoardRenderer& board = registry.assign<ChessBoardRenderer>(entity);
+    board.Size = Vector2(24.0f, 32.0f);
+    board.SecondColor = Color(0.4f, 0.3f, 0.2f);
+    Material& material = registry.assign<Material>(entity);
+    material.Color = Color(1.0f, 1.0f, 0.8f);
+    material.DiffuseCF = 0.9f;
+    material.AlbedoCF = Vector3(20.0f, 2.4f, 0.0f);
+}
+
+// Square of two triangles facing the camera, side long, at z
+static void AddWall(entt::registry& registry, float side, float z) {
+    auto mesh = make_shared<Mesh>();
+    float h = side / 2;
+    mesh->Vertices = {-h, -h, 0.0f, h, -h, 0.0f, h, h, 0.0f, -h, h, 0.0f};
+    mesh->Indices = {0, 1, 2, 0, 2, 3};
+    mesh->Build();
+
+    auto entity = registry.create();
+    registry.assign<Transform>(entity).Position = Vector3(0.0f, 0.0f, z);
+    registry.assign<MeshRenderer>(entity).Mesh = mesh;
+    Material& material = registry.assign<Material>(entity);
+    material.Color = Color(0.8f, 0.8f, 0.8f);
+    material.DiffuseCF = 0.5f;
+    material.AlbedoCF = Vector3(20.0f, 1.4f, 0.0f);
+}
+
+static vector<float> Render(Raytracer& raytracer) {
+    raytracer.Update();
+    const float* data = (const float*)raytracer.RawData();
+    return vector<float>(data, data + WIDTH * HEIGHT * 3);
+}
+
+static vector<float> Render(entt::registry& registry, int treeWidth, int shadowMode = SceneEncoder::SHADOW_CONES) {
+    CPURaytracer raytracer(registry, WIDTH, HEIGHT, treeWidth);
+    raytracer.SetShadowMode(shadowMode);
+    return Render(raytracer);
+}
+
+static float GetRmse(const vector<float>& a, const vector<float>& b) {
+    double sum = 0.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return (float)sqrt(sum / a.size());
+}
+
+static bool Expect(bool condition, const string& message) {
+    if (!condition) {
+        cout << "  failed: " << message << "\n";
+    }
+    return condition;
+}
+
+// Offsets past 2^24 floats only survive the scene buffer when stored bit-cast: the binary
+// tree of a million tiny spheres far behind the camera pushes the moving spheres and the
+// lights past it
+static bool CheckLargeScene() {
+    entt::registry reference;
+    AddCamera(reference, Vector3(0.0f, 0.0f, -20.0f));
+    AddLight(reference, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+    for (auto entity: AddSpheres(reference, 20)) {
+        reference.assign<RigidBody>(entity);
+    }
+
+    entt::registry large;
+    AddCamera(large, Vector3(0.0f, 0.0f, -20.0f));
+    AddLight(large, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+    const int hiddenNumber = 1000000;   // entt caps a registry at 2^20 entities
+    for (int i = 0; i < hiddenNumber; ++i) {
+        Vector3 position(GetRandom() * 10.0f - 5.0f, GetRandom() * 10.0f - 5.0f, -10000.0f - GetRandom() * 10.0f);
+        AddSphere(large, position, 0.001f, Color(1.0f, 0.0f, 0.0f));
+    }
+    for (auto entity: AddSpheres(large, 20)) {
+        large.assign<RigidBody>(entity);
+    }
+
+    float rmse = GetRmse(Render(reference, 2), Render(large, 2));
+    return Expect(rmse < 1e-3f, "rmse to the small scene " + to_string(rmse));
+}
+
+// Every acceleration structure must find the same closest hits and shadows. Cone shadows
+// through the grid only visit the cells along the cone axis, so it is compared with shadow rays.
+static bool CheckTreeWidths() {
+    entt::registry registry;
+    AddCamera(registry, Vector3(0.0f, 0.0f, -20.0f));
+    AddLight(registry, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+    AddLight(registry, Vector3(-3.0f, 5.0f, -10.0f), 0.5f);
+    AddBoard(registry);
+    vector<entt::entity> spheres = AddSpheres(registry, 200);
+    for (size_t i = 0; i < spheres.size(); i += 3) {
+        registry.assign<RigidBody>(spheres[i]);
+    }
+
+    bool passed = true;
+    for (int shadowMode: {SceneEncoder::SHADOW_CONES, SceneEncoder::SHADOW_RAYS}) {
+        vector<float> reference = Render(registry, 2, shadowMode);
+        for (int treeWidth: {4, 8, SceneEncoder::GRID}) {
+            if (treeWidth == SceneEncoder::GRID && shadowMode == SceneEncoder::SHADOW_CONES) {
+                continue;
+            }
+            float rmse = GetRmse(reference, Render(registry, treeWidth, shadowMode));
+            passed = Expect(rmse == 0.0f, "rmse of width " + to_string(treeWidth) + " to the binary tree " + to_string(rmse)) && passed;
+        }
+    }
+    return passed;
+}
+
+// A sphere in front of a mesh must be shaded as the sphere, whatever was traversed first
+static bool CheckSphereOverMesh() {
+    entt::registry reference;
+    entt::registry registry;
+    for (entt::registry* scene: {&reference, &registry}) {
+        AddCamera(*scene, Vector3(0.0f, 0.0f, -20.0f));
+        AddLight(*scene, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+        auto sphere = AddSphere(*scene, Vector3(0.0f, 0.0f, 0.0f), 1.0f, Color(1.0f, 0.0f, 0.0f));
+        scene->get<Material>(sphere).AlbedoCF.Z = 0.0f;
+    }
+    AddWall(registry, 8.0f, 2.0f);
+
+    bool passed = true;
+    for (int treeWidth: {2, 4, 8, SceneEncoder::GRID}) {
+        vector<float> expected = Render(reference, treeWidth);
+        vector<float> image = Render(registry, treeWidth);
+        int wrong = 0;
+        for (int j = HEIGHT / 2 - 6; j < HEIGHT / 2 + 6; ++j) {
+            for (int i = WIDTH / 2 - 6; i < WIDTH / 2 + 6; ++i) {
+                int pos = (j * WIDTH + i) * 3;
+                wrong += !equal(&image[pos], &image[pos + 3], &expected[pos]);
+            }
+        }
+        passed = Expect(wrong == 0, to_string(wrong) + " sphere pixels differ with width " + to_string(treeWidth)) && passed;
+    }
+    return passed;
+}
+
+// The lens blurs the first frame after a camera move as well, only the accumulation restarts
+static bool CheckMovingCameraFocus() {
+    entt::registry registry;
+    auto camera = AddCamera(registry, Vector3(0.0f, 0.0f, -20.0f));
+    AddLight(registry, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+    AddBoard(registry);
+    AddSpheres(registry, 20);
+    Camera& lens = registry.get<Camera>(camera);
+    lens.FocusDistance = 20.0f;
+    lens.Aperture = 0.5f;
+
+    CPURaytracer raytracer(registry, WIDTH, HEIGHT, 2);
+    Render(raytracer);
+    registry.get<Transform>(camera).Position = Vector3(1.0f, 0.5f, -19.0f);
+    vector<float> moved = Render(raytracer);
+
+    lens.Aperture = 0.0f;
+    float rmse = GetRmse(moved, Render(registry, 2));
+    return Expect(rmse > 0.01f, "rmse of the moved lens camera to a pinhole " + to_string(rmse));
+}
+
+// On a still scene the denoised single shadow rays settle close to the full soft shadows
+static bool CheckDenoiserConvergence() {
+    entt::registry registry;
+    AddCamera(registry, Vector3(0.0f, 0.0f, -20.0f));
+    AddLight(registry, Vector3(23.0f, 30.0f, -80.0f), 0.9f);
+    AddLight(registry, Vector3(-3.0f, 5.0f, -10.0f), 0.5f);
+    AddBoard(registry);
+    AddSpheres(registry, 20);
+    vector<float> reference = Render(registry, 4, SceneEncoder::SHADOW_RAYS);
+
+    DenoisedCPURaytracer denoised(registry, WIDTH, HEIGHT);
+    denoised.SetShadowMode(SceneEncoder::SHADOW_RAYS);
+    float first = GetRmse(reference, Render(denoised));
+    float last = first;
+    for (int i = 1; i < 32; ++i) {
+        last = GetRmse(reference, Render(denoised));
+    }
+    return Expect(last < first * 0.5f && last < 0.01f, "rmse to the full shadows from " + to_string(first) + " to " + to_string(last));
+}
+
+int main(int argc, char** argv) {
+    const vector<pair<string, function<bool()>>> checks = {
+        {"large_scene", CheckLargeScene},
+        {"tree_widths", CheckTreeWidths},
+        {"sphere_over_mesh", CheckSphereOverMesh},
+        {"moving_camera_focus", CheckMovingCameraFocus},
+        {"denoiser_convergence", CheckDenoiserConvergence},
+    };
+
+    bool passed = true;
+    int run = 0;
+    for (const auto& check: checks) {
+        if (argc > 1 && check.first != argv[1]) {
+            continue;
+        }
+        cout << check.first << "\n";
+        passed = check.second() && passed;
+        ++run;
+    }
+    if (run == 0) {
+        cout << "unknown check " << argv[1] << "\n";
+    }
+    return passed && run > 0 ? 0 : 1;
+}
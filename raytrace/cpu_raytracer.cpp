@@ -0,0 +1,1718 @@
+#include "cpu_raytracer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <utility>
+
+#include "entities.hpp"
+
+const float PI = 3.14159265f;
+const int SPHERES_SIZE = SceneEncoder::SPHERE_SIZE;
+const int NODE_SIZE = SceneEncoder::NODE_SIZE;
+const int SHAPE_SIZE = SceneEncoder::SHAPE_SIZE;
+const int MESH_SIZE = SceneEncoder::MESH_SIZE;
+const int LIGHT_SIZE = SceneEncoder::LIGHT_SIZE;
+const float TRIANGLE_EPSILON = 1e-7f;
+const float EDGE_EPSILON = 1e-5f;           // rays along a shared edge would otherwise slip between both triangles
+const int BVH_STACK_SIZE = SceneEncoder::STACK_SIZE;
+const int RESERVOIR_CANDIDATES = 8;
+const float TEMPORAL_HISTORY = 20.0f;      // previous reservoirs count for at most this many times the new candidates
+const int SPATIAL_NEIGHBOURS = 3;
+const float SPATIAL_RADIUS = 12.0f;         // pixels
+const int MAX_HISTORY = 32;                 // frames blended by the progressive accumulation
+const int CACHE_MAX_AGE = 8;                // frames the direct light is reused at most
+const float CACHE_MAX_MOTION = 0.05f;       // nor for longer than the fastest mover takes to go this far
+const float CACHE_DEPTH_TOLERANCE = 0.01f;  // of the distance, between a reprojected and a cached hit
+const uint32_t MOVER_ID = 0x80000000u;      // tells entity ids apart from record offsets
+
+typedef float Float4 __attribute__((vector_size(16)));
+typedef int32_t Int4 __attribute__((vector_size(16)));
+typedef uint8_t Byte4 __attribute__((vector_size(4)));
+typedef float Float8 __attribute__((vector_size(32)));
+typedef int32_t Int8 __attribute__((vector_size(32)));
+typedef uint8_t Byte8 __attribute__((vector_size(8)));
+
+namespace {
+
+template<int W>
+struct Lanes;
+
+template<>
+struct Lanes<4> {
+    typedef Float4 Float;
+    typedef Int4 Mask;
+    typedef Byte4 Byte;
+};
+
+// Without AVX 8-wide vectors are not kept in registers and change the ABI of the
+// helpers below (-Wpsabi), the children of an 8-wide node are then tested 4 at a time
+template<>
+struct Lanes<8> {
+#ifdef __AVX__
+    typedef Float8 Float;
+    typedef Int8 Mask;
+    typedef Byte8 Byte;
+#else
+    typedef Float4 Float;
+    typedef Int4 Mask;
+    typedef Byte4 Byte;
+#endif
+};
+
+struct Ray {
+    Vector3 From;
+    Vector3 Dir;
+};
+
+struct Tree {
+    int NodesIdx;
+    int NodesNumber;
+    int SpheresIdx;
+};
+
+struct Scene {
+    const float* Input;
+    Vector3 CameraPos;
+    Vector3 CameraForward;
+    Vector3 CameraRight;        // one pixel long, as CameraUp
+    Vector3 CameraUp;
+    Vector3 LensRight;
+    Vector3 LensUp;
+    float FocusDistance;
+    float Blend;                // weight of this frame in the accumulated output
+    uint32_t Frame;
+    int LightsIdx;
+    int GlobalLightsNumber;
+    int LocalLightsNumber;
+    int LightNodesIdx;
+    int SpheresNumber;
+    int TreeWidth;
+    Tree StaticTree;
+    Tree DynamicTree;
+    int ShapesIdx;
+    int ShapesNumber;
+    int MeshesIdx;
+    int MeshesNumber;
+    int MeshNodesIdx;
+    int ShadowQuality = 2;      // see CPURaytracer::SetShadowQuality()
+};
+
+// Traversal only tracks Distance and Primitive, the offset of the sphere or shape record,
+// or of the triangle lane in a mesh packet together with the Mesh instance record.
+// The rest is filled once the closest primitive is known.
+struct Hit {
+    float Distance = -1.0f;
+    int Primitive = -1;
+    int Mesh = -1;
+    Vector3 Normal;
+    const float* Material = nullptr;
+};
+
+}
+
+template<typename F, typename M>
+static inline F Select(M mask, F a, F b) {
+    return (F)(((M)a & mask) | ((M)b & ~mask));
+}
+
+template<typename F, typename M>
+static inline F Min(F a, F b) {
+    return Select<F, M>(a < b, a, b);
+}
+
+template<typename F, typename M>
+static inline F Max(F a, F b) {
+    return Select<F, M>(a > b, a, b);
+}
+
+// Same as vec3_refract in the kernels
+static Vector3 Refract(const Vector3& base, const Vector3& norm, float cf) {
+    float c = -std::max(-1.0f, std::min(1.0f, norm.Dot(norm)));
+    float firstCF = 1.0f;
+    float secondCF = cf;
+    if (c < 0) {
+        c = -c;
+        std::swap(firstCF, secondCF);
+    }
+    cf = firstCF / secondCF;
+    float k = 1 - firstCF * firstCF * (1 - c * c);
+    if (k < 0) {
+        return Vector3();
+    }
+    return base * cf + norm * (cf * c - sqrtf(k));
+}
+
+static float IntersectSphere(const Scene& scene, int sphereIdx, const Ray& ray) {
+    const float* sphere = scene.Input + sphereIdx;
+    Vector3 spherePos(sphere[0], sphere[1], sphere[2]);
+    float sphereRadius = sphere[3];
+
+    Vector3 k = ray.From - spherePos;
+    float b = k.Dot(ray.Dir);
+    float c = k.SqrMagnitude() - sphereRadius * sphereRadius;
+    float d = b*b - c;
+
+    if (d < 0) {
+        return -1.0f;
+    }
+
+    float sqrtfd = sqrtf(d);
+    float t1 = -b + sqrtfd;
+    float t2 = -b - sqrtfd;
+
+    float min_t = std::min(t1, t2);
+    float max_t = std::max(t1, t2);
+
+    float dist = (min_t >= 0) ? min_t : max_t;
+    if (dist <= 0) {
+        return -1.0f;
+    }
+    return dist;
+}
+
+static float IntersectShape(const Scene& scene, int shapeIdx, const Ray& ray) {
+    const float* shape = scene.Input + shapeIdx;
+    const float from[3] = {ray.From.X, ray.From.Y, ray.From.Z};
+    const float dir[3] = {ray.Dir.X, ray.Dir.Y, ray.Dir.Z};
+
+    if (UnpackInt(shape[0]) == SceneEncoder::SHAPE_BOARD) {
+        float dist = (shape[2] - from[1]) / dir[1];
+        if (!(dist > 0.0f)) {
+            return -1.0f;
+        }
+        float x = from[0] + dir[0] * dist;
+        float z = from[2] + dir[2] * dist;
+        if (std::abs(x - shape[1]) > 0.5f * shape[4] || std::abs(z - shape[3]) > 0.5f * shape[5]) {
+            return -1.0f;
+        }
+        return dist;
+    }
+
+    float tNear = -std::numeric_limits<float>::infinity();
+    float tFar = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (shape[1 + i] - 0.5f * shape[4 + i] - from[i]) / dir[i];
+        float t2 = (shape[1 + i] + 0.5f * shape[4 + i] - from[i]) / dir[i];
+        tNear = std::max(tNear, std::min(t1, t2));
+        tFar = std::min(tFar, std::max(t1, t2));
+    }
+    if (tNear > tFar || tFar <= 0.0f) {
+        return -1.0f;
+    }
+    return tNear > 0.0f ? tNear : tFar;
+}
+
+static void IntersectShapes(const Scene& scene, const Ray& ray, Hit& hit) {
+    for (int i = 0; i < scene.ShapesNumber; ++i) {
+        int shapeIdx = scene.ShapesIdx + i * SHAPE_SIZE;
+        float currDist = IntersectShape(scene, shapeIdx, ray);
+        if (currDist <= 0.0f) {
+            continue;
+        }
+        if (hit.Distance < 0.0f || currDist < hit.Distance) {
+            hit.Distance = currDist;
+            hit.Primitive = shapeIdx;
+        }
+    }
+}
+
+static void IntersectLeaf(const Scene& scene, const Tree& tree, int first, int count, const Ray& ray, Hit& hit) {
+    for (int i = first; i < first + count; ++i) {
+        int sphereIdx = tree.SpheresIdx + i * SPHERES_SIZE;
+        float currDist = IntersectSphere(scene, sphereIdx, ray);
+        if (currDist <= 0.0f) {
+            continue;
+        }
+        if (hit.Distance < 0.0f || currDist < hit.Distance) {
+            hit.Distance = currDist;
+            hit.Primitive = sphereIdx;
+        }
+    }
+}
+
+static bool IntersectBox(const float* node, const Ray& ray, const Vector3& invDir, float maxDist) {
+    float tMin = 0.0f;
+    float tMax = maxDist < 0.0f ? std::numeric_limits<float>::infinity() : maxDist;
+    const float from[3] = {ray.From.X, ray.From.Y, ray.From.Z};
+    const float inv[3] = {invDir.X, invDir.Y, invDir.Z};
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (node[i] - from[i]) * inv[i];
+        float t2 = (node[3 + i] - from[i]) * inv[i];
+        tMin = std::max(tMin, std::min(t1, t2));
+        tMax = std::min(tMax, std::max(t1, t2));
+    }
+    return tMin <= tMax;
+}
+
+static void IntersectTree(const Scene& scene, const Tree& tree, const Ray& ray, const Vector3& invDir, Hit& hit) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const float* node = scene.Input + tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(node, ray, invDir, hit.Distance)) {
+            continue;
+        }
+
+        int leftOrFirst = UnpackInt(node[6]);
+        int count = UnpackInt(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        IntersectLeaf(scene, tree, leftOrFirst, count, ray, hit);
+    }
+}
+
+// Tests all W child boxes of a wide node at once. Children are visited
+// nearest first and skipped once a closer hit is known.
+template<int W>
+static void IntersectWideTree(const Scene& scene, const Tree& tree, const Ray& ray, const Vector3& invDir, Hit& hit) {
+    typedef typename Lanes<W>::Float F;
+    typedef typename Lanes<W>::Mask M;
+    typedef typename Lanes<W>::Byte B;
+
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const int nodeSize = WideBVH::NodeSize(W);
+    const int lanes = sizeof(F) / sizeof(float);
+    const float from[3] = {ray.From.X, ray.From.Y, ray.From.Z};
+    const float inv[3] = {invDir.X, invDir.Y, invDir.Z};
+
+    struct Entry {
+        int Child;
+        int Count;
+        float Distance;
+    };
+    Entry stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        if (hit.Distance >= 0.0f && entry.Distance > hit.Distance) {
+            continue;
+        }
+        if (entry.Count > 0) {
+            IntersectLeaf(scene, tree, -entry.Child - 1, entry.Count, ray, hit);
+            continue;
+        }
+
+        const float* node = scene.Input + tree.NodesIdx + entry.Child * nodeSize;
+        const uint8_t* quantized = (const uint8_t*)(node + 6);
+        const float* children = node + WideBVH::ChildIdx(W);
+        uint8_t counts[W];
+        memcpy(counts, node + WideBVH::CountIdx(W), W);
+
+        // push in descending distance, so the nearest child is popped first
+        int first = stackSize;
+        for (int base = 0; base < W; base += lanes) {
+            F tNear = F{} + 0.0f;
+            F tFar = F{} + (hit.Distance < 0.0f ? std::numeric_limits<float>::infinity() : hit.Distance);
+            for (int axis = 0; axis < 3; ++axis) {
+                B qMin, qMax;
+                memcpy(&qMin, quantized + axis * W + base, lanes);
+                memcpy(&qMax, quantized + (3 + axis) * W + base, lanes);
+                F lo = node[axis] + __builtin_convertvector(qMin, F) * node[3 + axis];
+                F hi = node[axis] + __builtin_convertvector(qMax, F) * node[3 + axis];
+                F t1 = (lo - from[axis]) * inv[axis];
+                F t2 = (hi - from[axis]) * inv[axis];
+                tNear = Max<F, M>(tNear, Min<F, M>(t1, t2));
+                tFar = Min<F, M>(tFar, Max<F, M>(t1, t2));
+            }
+            M hits = tNear <= tFar;
+
+            for (int lane = 0; lane < lanes; ++lane) {
+                int i = base + lane;
+                int child = UnpackInt(children[i]);
+                if (!hits[lane] || (child == 0 && counts[i] == 0)) {
+                    continue;
+                }
+                int j = stackSize++;
+                for (; j > first && stack[j - 1].Distance < tNear[lane]; --j) {
+                    stack[j] = stack[j - 1];
+                }
+                stack[j] = {child, counts[i], tNear[lane]};
+            }
+        }
+    }
+}
+
+// 3D-DDA walk through the cells of a UniformGrid, see uniform_grid.hpp for the layout.
+// A sphere spans several cells, so a hit only ends the walk once it lies before the exit of the current cell.
+static void IntersectGrid(const Scene& scene, const Tree& tree, const Ray& ray, const Vector3& invDir, Hit& hit) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const float* grid = scene.Input + tree.NodesIdx;
+    const float* cellStarts = grid + UniformGrid::HEADER_SIZE;
+    const float* indices = cellStarts + tree.NodesNumber + 1;
+    const float from[3] = {ray.From.X, ray.From.Y, ray.From.Z};
+    const float dir[3] = {ray.Dir.X, ray.Dir.Y, ray.Dir.Z};
+    const float inv[3] = {invDir.X, invDir.Y, invDir.Z};
+    const int dims[3] = {UnpackInt(grid[6]), UnpackInt(grid[7]), UnpackInt(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = hit.Distance < 0.0f ? std::numeric_limits<float>::infinity() : hit.Distance;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - from[i]) * inv[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - from[i]) * inv[i];
+        tMin = std::max(tMin, std::min(t1, t2));
+        tMax = std::min(tMax, std::max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
+
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = from[i] + dir[i] * tMin;
+        cell[i] = std::max(0, std::min(dims[i] - 1, (int)((p - grid[i]) / grid[3 + i])));
+        step[i] = dir[i] < 0.0f ? -1 : 1;
+        if (dir[i] == 0.0f) {
+            tNext[i] = std::numeric_limits<float>::infinity();
+            tDelta[i] = std::numeric_limits<float>::infinity();
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - from[i]) * inv[i];
+        tDelta[i] = grid[3 + i] * std::abs(inv[i]);
+    }
+
+    while (true) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = UnpackInt(cellStarts[cellIdx]); i < UnpackInt(cellStarts[cellIdx + 1]); ++i) {
+            int sphereIdx = tree.SpheresIdx + UnpackInt(indices[i]) * SPHERES_SIZE;
+            float currDist = IntersectSphere(scene, sphereIdx, ray);
+            if (currDist <= 0.0f) {
+                continue;
+            }
+            if (hit.Distance < 0.0f || currDist < hit.Distance) {
+                hit.Distance = currDist;
+                hit.Primitive = sphereIdx;
+            }
+        }
+
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        float tExit = tNext[axis];
+        if ((hit.Distance >= 0.0f && hit.Distance <= tExit) || tExit > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+// Möller–Trumbore against all triangles of a packet at once, see mesh.hpp for the layout
+static void IntersectPacket(const float* packet, int packetIdx, const Ray& ray, float& bestDistance, int& bestTriangle) {
+    typedef Lanes<Mesh::PACKET_LANES>::Float F;
+    typedef Lanes<Mesh::PACKET_LANES>::Mask M;
+    const int lanes = Mesh::PACKET_LANES;
+
+    F row[9];
+    memcpy(row, packet, sizeof(row));
+    const F& v0x = row[0];
+    const F& v0y = row[1];
+    const F& v0z = row[2];
+    const F& e1x = row[3];
+    const F& e1y = row[4];
+    const F& e1z = row[5];
+    const F& e2x = row[6];
+    const F& e2y = row[7];
+    const F& e2z = row[8];
+
+    F px = ray.Dir.Y * e2z - ray.Dir.Z * e2y;
+    F py = ray.Dir.Z * e2x - ray.Dir.X * e2z;
+    F pz = ray.Dir.X * e2y - ray.Dir.Y * e2x;
+    F det = e1x * px + e1y * py + e1z * pz;
+    F invDet = 1.0f / det;
+
+    F tx = ray.From.X - v0x;
+    F ty = ray.From.Y - v0y;
+    F tz = ray.From.Z - v0z;
+    F u = (tx * px + ty * py + tz * pz) * invDet;
+
+    F qx = ty * e1z - tz * e1y;
+    F qy = tz * e1x - tx * e1z;
+    F qz = tx * e1y - ty * e1x;
+    F v = (ray.Dir.X * qx + ray.Dir.Y * qy + ray.Dir.Z * qz) * invDet;
+    F t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+    M hits = (det > TRIANGLE_EPSILON || det < -TRIANGLE_EPSILON) & (u >= -EDGE_EPSILON) & (v >= -EDGE_EPSILON) & (u + v <= 1.0f + EDGE_EPSILON) & (t > TRIANGLE_EPSILON);
+    for (int lane = 0; lane < lanes; ++lane) {
+        if (hits[lane] && (bestDistance < 0.0f || t[lane] < bestDistance)) {
+            bestDistance = t[lane];
+            bestTriangle = packetIdx + lane;
+        }
+    }
+}
+
+// Mesh trees live in object space: the ray is moved, rotated and scaled into it. The direction
+// keeps its length, so object space distances are world ones divided by the scale.
+static void IntersectInstance(const Scene& scene, int instanceIdx, const Ray& ray, Hit& hit) {
+    const float* instance = scene.Input + instanceIdx;
+    int nodesIdx = UnpackInt(instance[0]);
+    int packetsIdx = UnpackInt(instance[2]);
+    float scale = instance[6];
+    const float* r = instance + 7;
+    Vector3 from = (ray.From - Vector3(instance[3], instance[4], instance[5])) * (1.0f / scale);
+    Ray localRay = {
+        Vector3(
+            r[0] * from.X + r[3] * from.Y + r[6] * from.Z,
+            r[1] * from.X + r[4] * from.Y + r[7] * from.Z,
+            r[2] * from.X + r[5] * from.Y + r[8] * from.Z
+        ),
+        Vector3(
+            r[0] * ray.Dir.X + r[3] * ray.Dir.Y + r[6] * ray.Dir.Z,
+            r[1] * ray.Dir.X + r[4] * ray.Dir.Y + r[7] * ray.Dir.Z,
+            r[2] * ray.Dir.X + r[5] * ray.Dir.Y + r[8] * ray.Dir.Z
+        ),
+    };
+    Vector3 invDir(1.0f / localRay.Dir.X, 1.0f / localRay.Dir.Y, 1.0f / localRay.Dir.Z);
+    float bestDistance = hit.Distance < 0.0f ? -1.0f : hit.Distance / scale;
+    int bestTriangle = -1;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const float* node = scene.Input + nodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(node, localRay, invDir, bestDistance)) {
+            continue;
+        }
+        int leftOrFirst = UnpackInt(node[6]);
+        int count = UnpackInt(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        int packetIdx = packetsIdx + leftOrFirst * Mesh::PACKET_SIZE;
+        IntersectPacket(scene.Input + packetIdx, packetIdx, localRay, bestDistance, bestTriangle);
+    }
+
+    if (bestTriangle >= 0) {
+        hit.Distance = bestDistance * scale;
+        hit.Primitive = bestTriangle;
+        hit.Mesh = instanceIdx;
+    }
+}
+
+// Top level tree over the instances in world space, its leaves address instance records
+static void IntersectMeshes(const Scene& scene, const Ray& ray, const Vector3& invDir, Hit& hit) {
+    if (scene.MeshesNumber == 0) {
+        return;
+    }
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const float* node = scene.Input + scene.MeshNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(node, ray, invDir, hit.Distance)) {
+            continue;
+        }
+        int leftOrFirst = UnpackInt(node[6]);
+        int count = UnpackInt(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            IntersectInstance(scene, scene.MeshesIdx + i * MESH_SIZE, ray, hit);
+        }
+    }
+}
+
+// maxDistance bounds the search, as if something had already been hit there
+static Hit IntersectClosest(const Scene& scene, const Ray& ray, float maxDistance = -1.0f) {
+    // shapes go first, a floor hit then bounds the tree traversal. Meshes go last: sphere and
+    // shape hits do not clear Mesh, a triangle must only be kept when nothing closer was found.
+    Hit hit;
+    hit.Distance = maxDistance;
+    IntersectShapes(scene, ray, hit);
+    Vector3 invDir(1.0f / ray.Dir.X, 1.0f / ray.Dir.Y, 1.0f / ray.Dir.Z);
+    for (const Tree* tree: {&scene.StaticTree, &scene.DynamicTree}) {
+        if (scene.TreeWidth == SceneEncoder::GRID) {
+            IntersectGrid(scene, *tree, ray, invDir, hit);
+        } else if (scene.TreeWidth == 8) {
+            IntersectWideTree<8>(scene, *tree, ray, invDir, hit);
+        } else if (scene.TreeWidth == 4) {
+            IntersectWideTree<4>(scene, *tree, ray, invDir, hit);
+        } else {
+            IntersectTree(scene, *tree, ray, invDir, hit);
+        }
+    }
+    IntersectMeshes(scene, ray, invDir, hit);
+    return hit;
+}
+
+static void GetShapeAttributes(const Scene& scene, const Ray& ray, Hit& hit) {
+    const float* shape = scene.Input + hit.Primitive;
+    Vector3 point = ray.From + ray.Dir * hit.Distance;
+
+    if (UnpackInt(shape[0]) == SceneEncoder::SHAPE_BOARD) {
+        hit.Normal = Vector3(0.0f, ray.From.Y > shape[2] ? 1.0f : -1.0f, 0.0f);
+        int tiles = (int)std::floor(point.X / shape[6]) + (int)std::floor(point.Z / shape[6]);
+        hit.Material = shape + (tiles & 1 ? 16 : 7);
+        return;
+    }
+
+    // the face is on the axis where the point is relatively furthest from the center
+    const float local[3] = {
+        (point.X - shape[1]) / shape[4],
+        (point.Y - shape[2]) / shape[5],
+        (point.Z - shape[3]) / shape[6],
+    };
+    int axis = std::abs(local[0]) > std::abs(local[1]) ? 0 : 1;
+    axis = std::abs(local[axis]) > std::abs(local[2]) ? axis : 2;
+    float normal[3] = {0.0f, 0.0f, 0.0f};
+    normal[axis] = local[axis] > 0.0f ? 1.0f : -1.0f;
+    hit.Normal = Vector3(normal[0], normal[1], normal[2]);
+    hit.Material = shape + 7;
+}
+
+static void GetMeshAttributes(const Scene& scene, const Ray& ray, Hit& hit) {
+    // Primitive is the v0 x of the triangle lane, the edges follow every PACKET_LANES floats
+    const float* lane = scene.Input + hit.Primitive;
+    const int lanes = Mesh::PACKET_LANES;
+    const float* e1 = lane + 3 * lanes;
+    const float* e2 = lane + 6 * lanes;
+    Vector3 normal(
+        e1[lanes] * e2[2 * lanes] - e1[2 * lanes] * e2[lanes],
+        e1[2 * lanes] * e2[0] - e1[0] * e2[2 * lanes],
+        e1[0] * e2[lanes] - e1[lanes] * e2[0]
+    );
+    // back to world space, the rotation rows follow position and scale in the instance record
+    const float* r = scene.Input + hit.Mesh + 7;
+    hit.Normal = Vector3(
+        r[0] * normal.X + r[1] * normal.Y + r[2] * normal.Z,
+        r[3] * normal.X + r[4] * normal.Y + r[5] * normal.Z,
+        r[6] * normal.X + r[7] * normal.Y + r[8] * normal.Z
+    ).Normalized();
+    if (hit.Normal.Dot(ray.Dir) > 0.0f) {
+        hit.Normal = hit.Normal * -1.0f;
+    }
+    hit.Material = scene.Input + hit.Mesh + 16;
+}
+
+static Hit Intersect(const Scene& scene, const Ray& ray) {
+    Hit hit = IntersectClosest(scene, ray);
+    if (hit.Distance <= 0) {
+        return hit;
+    }
+    if (hit.Mesh >= 0) {
+        GetMeshAttributes(scene, ray, hit);
+        return hit;
+    }
+    // shapes are stored after all spheres
+    if (hit.Primitive >= scene.ShapesIdx) {
+        GetShapeAttributes(scene, ray, hit);
+        return hit;
+    }
+    const float* sphere = scene.Input + hit.Primitive;
+    hit.Normal = (ray.From + ray.Dir * hit.Distance - Vector3(sphere[0], sphere[1], sphere[2])).Normalized();
+    hit.Material = sphere + 4;
+    return hit;
+}
+
+// Only hits closer than maxDistance count, e.g. the light itself
+static bool IntersectAnything(const Scene& scene, const Ray& ray, float maxDistance) {
+    return IntersectClosest(scene, ray, maxDistance).Primitive >= 0;
+}
+
+// PCG hash, decorrelates the random streams of neighbouring pixels and frames
+static uint32_t Hash(uint32_t value) {
+    uint32_t state = value * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+namespace {
+
+struct Random {
+    uint32_t State;
+    float Next() {
+        State = Hash(State);
+        return (State >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+}
+
+static uint32_t FloatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float GetShadow(const Scene& scene, const Ray& ray, float maxDistance, int shadowQuality) {
+    if (shadowQuality == 0) {
+        return (float)(!IntersectAnything(scene, ray, maxDistance));
+    }
+    if (shadowQuality < 0) {
+        // one ray from a random point of the square the grid below covers, a new one every frame
+        Random random = {Hash(FloatBits(ray.From.X) ^ Hash(FloatBits(ray.From.Z) ^ Hash(scene.Frame)))};
+        Ray currRay = ray;
+        currRay.From.X += (random.Next() * 2.0f - 1.0f) * 0.1f;
+        currRay.From.Y += (random.Next() * 2.0f - 1.0f) * 0.1f;
+        return (float)(!IntersectAnything(scene, currRay, maxDistance));
+    }
+
+    int num = 0;
+    int total = 0;
+    for (int i = -shadowQuality; i <= shadowQuality; ++i) {
+        for (int j = -shadowQuality; j <= shadowQuality; ++j) {
+            Ray currRay = ray;
+            currRay.From.X += 0.05f * i;
+            currRay.From.Y += 0.05f * j;
+            if (IntersectAnything(scene, currRay, maxDistance)) {
+                ++num;
+            }
+            ++total;
+        }
+    }
+
+    return 1.0f - (float(num) / float(total));
+}
+
+namespace {
+
+// Shadow cone from a shading point to a light disk
+struct Cone {
+    Vector3 Apex;
+    Vector3 Dir;
+    float Length;       // distance to the light
+    float Angle;        // half angle of the light disk
+    float Slope;        // radius of the cone per unit of length
+};
+
+}
+
+// Boxes are grown by the cone radius at their far end along the axis, so that testing the
+// axis against them finds every box the cone touches
+static float GetConeRadius(const Cone& cone, const float* lo, const float* hi) {
+    const float from[3] = {cone.Apex.X, cone.Apex.Y, cone.Apex.Z};
+    const float dir[3] = {cone.Dir.X, cone.Dir.Y, cone.Dir.Z};
+    float far = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        far += std::max((lo[i] - from[i]) * dir[i], (hi[i] - from[i]) * dir[i]);
+    }
+    return cone.Slope * std::max(0.0f, std::min(cone.Length, far));
+}
+
+// 1 - cos(angle), without the cancellation of small angles
+static float GetCap(float angle) {
+    float s = sinf(0.5f * angle);
+    return 2.0f * s * s;
+}
+
+// Part of the light disk hidden by a sphere: the overlap of the light cone with the cone
+// around the sphere, with a smoothstep fit of the cap intersection for partial overlaps
+static float GetSphereOcclusion(const Cone& cone, const float* sphere) {
+    Vector3 toSphere = Vector3(sphere[0], sphere[1], sphere[2]) - cone.Apex;
+    float radius = sphere[3];
+    float distance = toSphere.Magnitude();
+    if (distance <= radius) {
+        return 1.0f;
+    }
+    if (distance - radius > cone.Length) {
+        return 0.0f;
+    }
+    float sphereAngle = asinf(radius / distance);
+    float angle = acosf(std::max(-1.0f, std::min(1.0f, toSphere.Dot(cone.Dir) / distance)));
+    if (angle >= sphereAngle + cone.Angle) {
+        return 0.0f;
+    }
+    float lightCap = GetCap(cone.Angle);
+    if (lightCap <= 0.0f) {
+        return 1.0f;
+    }
+    float overlap = std::min(1.0f, GetCap(sphereAngle) / lightCap);
+    float inner = std::abs(sphereAngle - cone.Angle);
+    if (angle <= inner) {
+        return overlap;
+    }
+    float x = (sphereAngle + cone.Angle - angle) / (sphereAngle + cone.Angle - inner);
+    return overlap * x * x * (3.0f - 2.0f * x);
+}
+
+static void OccludeLeaf(const Scene& scene, const Tree& tree, int first, int count, const Cone& cone, float& visibility) {
+    for (int i = first; i < first + count; ++i) {
+        visibility = std::min(visibility, 1.0f - GetSphereOcclusion(cone, scene.Input + tree.SpheresIdx + i * SPHERES_SIZE));
+    }
+}
+
+static void OccludeTree(const Scene& scene, const Tree& tree, const Cone& cone, const Vector3& invDir, float& visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+    Ray ray = {cone.Apex, cone.Dir};
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0 && visibility > 0.0f) {
+        const float* node = scene.Input + tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        float radius = GetConeRadius(cone, node, node + 3);
+        float box[6];
+        for (int i = 0; i < 3; ++i) {
+            box[i] = node[i] - radius;
+            box[3 + i] = node[3 + i] + radius;
+        }
+        if (!IntersectBox(box, ray, invDir, cone.Length)) {
+            continue;
+        }
+        int leftOrFirst = UnpackInt(node[6]);
+        int count = UnpackInt(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        OccludeLeaf(scene, tree, leftOrFirst, count, cone, visibility);
+    }
+}
+
+template<int W>
+static void OccludeWideTree(const Scene& scene, const Tree& tree, const Cone& cone, const Vector3& invDir, float& visibility) {
+    typedef typename Lanes<W>::Float F;
+    typedef typename Lanes<W>::Mask M;
+    typedef typename Lanes<W>::Byte B;
+
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const int nodeSize = WideBVH::NodeSize(W);
+    const int lanes = sizeof(F) / sizeof(float);
+    const float from[3] = {cone.Apex.X, cone.Apex.Y, cone.Apex.Z};
+    const float dir[3] = {cone.Dir.X, cone.Dir.Y, cone.Dir.Z};
+    const float inv[3] = {invDir.X, invDir.Y, invDir.Z};
+
+    int stack[BVH_STACK_SIZE];
+    int counts[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize] = 0;
+    counts[stackSize++] = 0;
+
+    while (stackSize > 0 && visibility > 0.0f) {
+        --stackSize;
+        if (counts[stackSize] > 0) {
+            OccludeLeaf(scene, tree, -stack[stackSize] - 1, counts[stackSize], cone, visibility);
+            continue;
+        }
+
+        const float* node = scene.Input + tree.NodesIdx + stack[stackSize] * nodeSize;
+        const uint8_t* quantized = (const uint8_t*)(node + 6);
+        const float* children = node + WideBVH::ChildIdx(W);
+        uint8_t childCounts[W];
+        memcpy(childCounts, node + WideBVH::CountIdx(W), W);
+
+        for (int base = 0; base < W; base += lanes) {
+            F lo[3];
+            F hi[3];
+            F far = F{} + 0.0f;
+            for (int axis = 0; axis < 3; ++axis) {
+                B qMin, qMax;
+                memcpy(&qMin, quantized + axis * W + base, lanes);
+                memcpy(&qMax, quantized + (3 + axis) * W + base, lanes);
+                lo[axis] = node[axis] + __builtin_convertvector(qMin, F) * node[3 + axis];
+                hi[axis] = node[axis] + __builtin_convertvector(qMax, F) * node[3 + axis];
+                far += Max<F, M>((lo[axis] - from[axis]) * dir[axis], (hi[axis] - from[axis]) * dir[axis]);
+            }
+            F radius = cone.Slope * Max<F, M>(F{} + 0.0f, Min<F, M>(F{} + cone.Length, far));
+
+            F tNear = F{} + 0.0f;
+            F tFar = F{} + cone.Length;
+            for (int axis = 0; axis < 3; ++axis) {
+                F t1 = (lo[axis] - radius - from[axis]) * inv[axis];
+                F t2 = (hi[axis] + radius - from[axis]) * inv[axis];
+                tNear = Max<F, M>(tNear, Min<F, M>(t1, t2));
+                tFar = Min<F, M>(tFar, Max<F, M>(t1, t2));
+            }
+            M hits = tNear <= tFar;
+
+            for (int lane = 0; lane < lanes; ++lane) {
+                int i = base + lane;
+                int child = UnpackInt(children[i]);
+                if (!hits[lane] || (child == 0 && childCounts[i] == 0)) {
+                    continue;
+                }
+                stack[stackSize] = child;
+                counts[stackSize++] = childCounts[i];
+            }
+        }
+    }
+}
+
+// Only the cells along the cone axis are visited, so a sphere that stays out of
+// them loses the outer part of its penumbra
+static void OccludeGrid(const Scene& scene, const Tree& tree, const Cone& cone, const Vector3& invDir, float& visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const float* grid = scene.Input + tree.NodesIdx;
+    const float* cellStarts = grid + UniformGrid::HEADER_SIZE;
+    const float* indices = cellStarts + tree.NodesNumber + 1;
+    const float from[3] = {cone.Apex.X, cone.Apex.Y, cone.Apex.Z};
+    const float dir[3] = {cone.Dir.X, cone.Dir.Y, cone.Dir.Z};
+    const float inv[3] = {invDir.X, invDir.Y, invDir.Z};
+    const int dims[3] = {UnpackInt(grid[6]), UnpackInt(grid[7]), UnpackInt(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = cone.Length;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - from[i]) * inv[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - from[i]) * inv[i];
+        tMin = std::max(tMin, std::min(t1, t2));
+        tMax = std::min(tMax, std::max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
+
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = from[i] + dir[i] * tMin;
+        cell[i] = std::max(0, std::min(dims[i] - 1, (int)((p - grid[i]) / grid[3 + i])));
+        step[i] = dir[i] < 0.0f ? -1 : 1;
+        if (dir[i] == 0.0f) {
+            tNext[i] = std::numeric_limits<float>::infinity();
+            tDelta[i] = std::numeric_limits<float>::infinity();
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - from[i]) * inv[i];
+        tDelta[i] = grid[3 + i] * std::abs(inv[i]);
+    }
+
+    // spheres spanning several cells are seen more than once, which min() does not mind
+    while (visibility > 0.0f) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = UnpackInt(cellStarts[cellIdx]); i < UnpackInt(cellStarts[cellIdx + 1]); ++i) {
+            OccludeLeaf(scene, tree, UnpackInt(indices[i]), 1, cone, visibility);
+        }
+
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (tNext[axis] > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+// Soft shadow of a light disk of radius light[5] at about the cost of one shadow ray.
+// Spheres occlude analytically, the visibility is the minimum over them. Boards, boxes
+// and meshes have no closed form and cast hard shadows along the cone axis.
+static float GetConeShadow(const Scene& scene, const float* light, const Vector3& point) {
+    Vector3 dirToLight = Vector3(light[0], light[1], light[2]) - point;
+    float lightDistance = dirToLight.Magnitude();
+    Cone cone;
+    cone.Dir = dirToLight / lightDistance;
+    cone.Apex = point + cone.Dir * 0.5f;
+    cone.Length = lightDistance - 0.5f;
+    cone.Slope = light[5] / lightDistance;
+    cone.Angle = atanf(cone.Slope);
+
+    Ray ray = {cone.Apex, cone.Dir};
+    Vector3 invDir(1.0f / ray.Dir.X, 1.0f / ray.Dir.Y, 1.0f / ray.Dir.Z);
+    Hit hit;
+    hit.Distance = cone.Length;
+    IntersectShapes(scene, ray, hit);
+    IntersectMeshes(scene, ray, invDir, hit);
+    if (hit.Primitive >= 0) {
+        return 0.0f;
+    }
+
+    float visibility = 1.0f;
+    for (const Tree* tree: {&scene.StaticTree, &scene.DynamicTree}) {
+        if (scene.TreeWidth == SceneEncoder::GRID) {
+            OccludeGrid(scene, *tree, cone, invDir, visibility);
+        } else if (scene.TreeWidth == 8) {
+            OccludeWideTree<8>(scene, *tree, cone, invDir, visibility);
+        } else if (scene.TreeWidth == 4) {
+            OccludeWideTree<4>(scene, *tree, cone, invDir, visibility);
+        } else {
+            OccludeTree(scene, *tree, cone, invDir, visibility);
+        }
+    }
+    return std::max(0.0f, visibility);
+}
+
+template<int Features, int Depth>
+static Color TraceColored(const Scene& scene, const Ray& ray);
+
+// Calls fn for every light record that can reach the point: all global lights, then
+// the local lights found in the light tree whose influence sphere holds the point
+template<typename Fn>
+static void ForEachLight(const Scene& scene, const Vector3& point, Fn fn) {
+    for (int i = 0; i < scene.GlobalLightsNumber; ++i) {
+        fn(scene.Input + scene.LightsIdx + i * LIGHT_SIZE);
+    }
+    if (scene.LocalLightsNumber == 0) {
+        return;
+    }
+
+    const float p[3] = {point.X, point.Y, point.Z};
+    const float* localLights = scene.Input + scene.LightsIdx + scene.GlobalLightsNumber * LIGHT_SIZE;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const float* node = scene.Input + scene.LightNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (p[0] < node[0] || p[1] < node[1] || p[2] < node[2] || p[0] > node[3] || p[1] > node[4] || p[2] > node[5]) {
+            continue;
+        }
+        int leftOrFirst = UnpackInt(node[6]);
+        int count = UnpackInt(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            const float* light = localLights + i * LIGHT_SIZE;
+            if ((Vector3(light[0], light[1], light[2]) - point).SqrMagnitude() < light[4] * light[4]) {
+                fn(light);
+            }
+        }
+    }
+}
+
+// Light power left at the given distance, local lights fade out smoothly to zero at their radius
+static float GetLightPower(const float* light, float distance) {
+    if (light[4] <= 0.0f) {
+        return light[3];
+    }
+    float x = distance / light[4];
+    float window = std::max(0.0f, 1.0f - x * x);
+    return light[3] * window * window;
+}
+
+// Unshadowed diffuse and specular light of one light at the point
+static Color GetLightColor(const float* light, const Vector3& point, const Vector3& normal, const Vector3& dirToCam, const float* material) {
+    Vector3 dirToLight = Vector3(light[0], light[1], light[2]) - point;
+    float lightDistance = dirToLight.Magnitude();
+    Vector3 dirToLightNorm = dirToLight / lightDistance;
+
+    Color color;
+    float lightPower = GetLightPower(light, lightDistance);
+    if (lightPower <= 0.0f) {
+        return color;
+    }
+
+    float dp = dirToLightNorm.Dot(normal);
+    float diffuseCF = material[3];
+    if (dp > 0) {
+        color.R += dp * diffuseCF * material[0] * lightPower;
+        color.G += dp * diffuseCF * material[1] * lightPower;
+        color.B += dp * diffuseCF * material[2] * lightPower;
+    }
+
+    dp = dirToLightNorm.Reflect(normal).Dot(dirToCam);
+
+    float albedoCF1 = material[4];
+    float albedoCF2 = material[5];
+    if (dp > 0) {
+        dp = powf(dp, albedoCF1);
+        color.R += dp * lightPower * albedoCF2;
+        color.G += dp * lightPower * albedoCF2;
+        color.B += dp * lightPower * albedoCF2;
+    }
+    return color;
+}
+
+// The code paths below are templates on the FEATURE_ mask of the scene, see SceneEncoder,
+// and on the trace depth, so that a scene only runs the code it needs
+template<int Features>
+static float GetLightShadow(const Scene& scene, const float* light, const Vector3& point, int shadowQuality) {
+    if constexpr ((Features & SceneEncoder::FEATURE_SHADOW_CONES) != 0) {
+        return GetConeShadow(scene, light, point);
+    } else {
+        Vector3 dirToLight = Vector3(light[0], light[1], light[2]) - point;
+        float lightDistance = dirToLight.Magnitude();
+        Vector3 dirToLightNorm = dirToLight / lightDistance;
+        return GetShadow(scene, {point + dirToLightNorm * 0.5f, dirToLightNorm}, lightDistance - 0.5f, shadowQuality);
+    }
+}
+
+// Reflected and refracted rays of the materials that have them, faded by the shadow of the point
+template<int Features, int Depth>
+static void AddReflections(const Scene& scene, const Ray& ray, const Hit& hit, float shadow, Color& color) {
+    const float* material = hit.Material;
+    const Vector3& normal = hit.Normal;
+    Vector3 dirToCam = ray.Dir * -1.0f;
+    Vector3 point = ray.From + ray.Dir * hit.Distance;
+
+    if constexpr ((Features & SceneEncoder::FEATURE_REFLECTIONS) != 0) {
+        if (material[6] > 0.0f) {
+            Vector3 reflDir = dirToCam.Reflect(normal);
+            Color reflectedColor = TraceColored<Features, Depth - 1>(scene, {point + reflDir * 0.01f, reflDir});
+            color.R += reflectedColor.R * material[6] * shadow;
+            color.G += reflectedColor.G * material[6] * shadow;
+            color.B += reflectedColor.B * material[6] * shadow;
+        }
+    }
+
+    if constexpr ((Features & SceneEncoder::FEATURE_REFRACTIONS) != 0) {
+        if (material[7] > 0.0f) {
+            Vector3 refrDir = Refract(ray.Dir, normal, Depth == 2 ? 1.8f : 1.4f).Normalized();
+            Color refrColor = TraceColored<Features, Depth - 1>(scene, {point + refrDir * (Depth == 2 ? 0.01f : 0.001f), refrDir});
+            color.R += refrColor.R * material[7] * shadow;
+            color.G += refrColor.G * material[7] * shadow;
+            color.B += refrColor.B * material[7] * shadow;
+        }
+    }
+}
+
+// Ambient and direct light of a hit; visibility gets the shadow of the best lit light, -1 if no light is in range
+template<int Features, int Depth>
+static Color GetDirectColor(const Scene& scene, const Ray& ray, const Hit& hit, float& visibility) {
+    Vector3 dirToCam = ray.Dir * -1.0f;
+    Vector3 point = ray.From + ray.Dir * hit.Distance;
+
+    float base = Depth == 2 ? 0.1f : 0.0f;
+    Color color(base, base, base);
+
+    ForEachLight(scene, point, [&](const float* light) {
+        float shadow = Depth == 2 ? GetLightShadow<Features>(scene, light, point, scene.ShadowQuality) : 1.0f;
+        visibility = std::max(visibility, shadow);
+        if (shadow <= 0.01f) {
+            return;
+        }
+        Color lightColor = GetLightColor(light, point, hit.Normal, dirToCam, hit.Material);
+        color.R += lightColor.R * shadow;
+        color.G += lightColor.G * shadow;
+        color.B += lightColor.B * shadow;
+    });
+    return color;
+}
+
+// Reflections fade with the best lit light, so points that no light reaches keep them
+template<int Features, int Depth>
+static Color AddVisibleReflections(const Scene& scene, const Ray& ray, const Hit& hit, float visibility, Color color) {
+    const int secondary = SceneEncoder::FEATURE_REFLECTIONS | SceneEncoder::FEATURE_REFRACTIONS;
+    if constexpr (Depth > 0 && (Features & secondary) != 0) {
+        float shadow = visibility < 0.0f ? 1.0f : visibility;
+        if (Depth == 2 && shadow <= 0.01f) {
+            return color;
+        }
+        AddReflections<Features, Depth>(scene, ray, hit, shadow, color);
+    }
+    return color;
+}
+
+// Depth 2 is GetColor, 1 is GetColor2 and 0 is GetColor3 of metal_kernel.c
+template<int Features, int Depth>
+static Color GetColor(const Scene& scene, const Ray& ray, const Hit& hit) {
+    float visibility = -1.0f;
+    Color color = GetDirectColor<Features, Depth>(scene, ray, hit, visibility);
+    return AddVisibleReflections<Features, Depth>(scene, ray, hit, visibility, color);
+}
+
+template<int Features, int Depth>
+static Color TraceColored(const Scene& scene, const Ray& ray) {
+    Hit hit = Intersect(scene, ray);
+    if (hit.Distance < 0) {
+        float background = Depth > 0 ? 0.98f : 0.8f;
+        return Color(background, background, background);
+    }
+    return GetColor<Features, Depth>(scene, ray, hit);
+}
+
+// Light of the reservoir and reflections of a primary hit, see CPURaytracer::ShadeSamples()
+template<int Features>
+static Color ShadeSample(const Scene& scene, const Ray& ray, const Hit& hit, const float* light, float weight) {
+    Vector3 point = ray.From + ray.Dir * hit.Distance;
+    Color color(0.1f, 0.1f, 0.1f);
+    float shadow = 1.0f;
+    if (light) {
+        shadow = GetLightShadow<Features>(scene, light, point, 0);
+        Color lightColor = GetLightColor(light, point, hit.Normal, ray.Dir * -1.0f, hit.Material);
+        color.R += lightColor.R * weight * shadow;
+        color.G += lightColor.G * weight * shadow;
+        color.B += lightColor.B * weight * shadow;
+    }
+    if (shadow > 0.01f) {
+        AddReflections<Features, 2>(scene, ray, hit, shadow, color);
+    }
+    return color;
+}
+
+// GetColor of a primary hit that takes the direct light from a reused hit, if any, and keeps it in cached.
+// The soft shadows are what costs, reflections follow the moving scene and are traced every frame.
+template<int Features>
+static Color ShadeCached(const Scene& scene, const Ray& ray, const Hit& hit, const CPURaytracer::CachedHit* reused, CPURaytracer::CachedHit& cached) {
+    if (reused) {
+        cached.Direct = reused->Direct;
+        cached.Visibility = reused->Visibility;
+    } else {
+        cached.Visibility = -1.0f;
+        cached.Direct = GetDirectColor<Features, 2>(scene, ray, hit, cached.Visibility);
+    }
+    return AddVisibleReflections<Features, 2>(scene, ray, hit, cached.Visibility, cached.Direct);
+}
+
+// Instantiations for every FEATURE_ mask, picked once per frame
+typedef Color (*Shader)(const Scene& scene, const Ray& ray, const Hit& hit);
+typedef Color (*SampleShader)(const Scene& scene, const Ray& ray, const Hit& hit, const float* light, float weight);
+typedef Color (*CachedShader)(const Scene& scene, const Ray& ray, const Hit& hit, const CPURaytracer::CachedHit* reused, CPURaytracer::CachedHit& cached);
+
+template<int... Masks>
+static Shader GetShader(int features, std::integer_sequence<int, Masks...>) {
+    static const Shader shaders[] = {&GetColor<Masks, 2>...};
+    return shaders[features];
+}
+
+static Shader GetShader(int features) {
+    return GetShader(features, std::make_integer_sequence<int, SceneEncoder::FEATURES_NUMBER>());
+}
+
+template<int... Masks>
+static SampleShader GetSampleShader(int features, std::integer_sequence<int, Masks...>) {
+    static const SampleShader shaders[] = {&ShadeSample<Masks>...};
+    return shaders[features];
+}
+
+static SampleShader GetSampleShader(int features) {
+    return GetSampleShader(features, std::make_integer_sequence<int, SceneEncoder::FEATURES_NUMBER>());
+}
+
+template<int... Masks>
+static CachedShader GetCachedShader(int features, std::integer_sequence<int, Masks...>) {
+    static const CachedShader shaders[] = {&ShadeCached<Masks>...};
+    return shaders[features];
+}
+
+static CachedShader GetCachedShader(int features) {
+    return GetCachedShader(features, std::make_integer_sequence<int, SceneEncoder::FEATURES_NUMBER>());
+}
+
+static Scene ReadScene(const float* input) {
+    Scene scene;
+    scene.Input = input;
+    scene.CameraPos = Vector3(input[2], input[3], input[4]);
+    scene.CameraForward = Vector3(input[23], input[24], input[25]);
+    scene.CameraRight = Vector3(input[26], input[27], input[28]);
+    scene.CameraUp = Vector3(input[29], input[30], input[31]);
+    scene.LensRight = Vector3(input[32], input[33], input[34]);
+    scene.LensUp = Vector3(input[35], input[36], input[37]);
+    scene.FocusDistance = input[38];
+    scene.Blend = input[39];
+    scene.Frame = (uint32_t)UnpackInt(input[40]);
+    scene.LightsIdx = UnpackInt(input[5]);
+    scene.GlobalLightsNumber = UnpackInt(input[6]);
+    scene.LocalLightsNumber = UnpackInt(input[7]);
+    scene.LightNodesIdx = UnpackInt(input[21]);
+    scene.SpheresNumber = UnpackInt(input[8]);
+    scene.StaticTree = {UnpackInt(input[9]), UnpackInt(input[10]), UnpackInt(input[11])};
+    scene.DynamicTree = {UnpackInt(input[12]), UnpackInt(input[13]), UnpackInt(input[14])};
+    scene.TreeWidth = UnpackInt(input[15]);
+    scene.ShapesIdx = UnpackInt(input[16]);
+    scene.ShapesNumber = UnpackInt(input[17]);
+    scene.MeshesIdx = UnpackInt(input[18]);
+    scene.MeshesNumber = UnpackInt(input[19]);
+    scene.MeshNodesIdx = UnpackInt(input[20]);
+    return scene;
+}
+
+static bool IsEmpty(const Scene& scene) {
+    return scene.SpheresNumber == 0 && scene.ShapesNumber == 0 && scene.MeshesNumber == 0;
+}
+
+// The lens vectors are scaled by the aperture, zero for a pinhole camera
+static bool HasLens(const Scene& scene) {
+    return scene.LensRight.SqrMagnitude() > 0.0f;
+}
+
+// Thin lens: the ray starts at a random point of the lens disk and goes through the
+// point the pinhole ray meets on the focus plane. The first frame after a camera move
+// is sampled through the lens too, it is only not blended with the older ones.
+static Ray GetPrimaryRay(const Scene& scene, int ci, int cj, int width, int height) {
+    Vector3 dir = scene.CameraForward + scene.CameraRight * (ci - 0.5f * width) + scene.CameraUp * (cj - 0.5f * height);
+    dir = dir.Normalized();
+    if (!HasLens(scene)) {
+        return {scene.CameraPos, dir};
+    }
+
+    Random random = {Hash((cj * width + ci) ^ Hash(scene.Frame ^ 0x6a09e667u))};
+    float radius = sqrtf(random.Next());
+    float angle = 2.0f * PI * random.Next();
+    Vector3 from = scene.CameraPos + scene.LensRight * (radius * cosf(angle)) + scene.LensUp * (radius * sinf(angle));
+    Vector3 focus = scene.CameraPos + dir * (scene.FocusDistance / dir.Dot(scene.CameraForward));
+    return {from, (focus - from).Normalized()};
+}
+
+static float Luminance(const Color& color) {
+    return 0.2126f * color.R + 0.7152f * color.G + 0.0722f * color.B;
+}
+
+// Resampling target: how bright the light would make the surface without shadows
+static float GetTargetPdf(const Scene& scene, const CPURaytracer::Surface& surface, int lightIdx) {
+    if (lightIdx < 0) {
+        return 0.0f;
+    }
+    Vector3 point = surface.From + surface.Dir * surface.Distance;
+    return Luminance(GetLightColor(scene.Input + lightIdx, point, surface.Normal, surface.Dir * -1.0f, scene.Input + surface.Material));
+}
+
+// Streams a candidate of the given resampling weight into the reservoir, m is the number of samples it stands for
+static void UpdateReservoir(CPURaytracer::Reservoir& reservoir, int lightIdx, float targetPdf, float weight, float m, Random& random) {
+    reservoir.WeightSum += weight;
+    reservoir.M += m;
+    if (weight > 0.0f && random.Next() * reservoir.WeightSum < weight) {
+        reservoir.Light = lightIdx;
+        reservoir.TargetPdf = targetPdf;
+    }
+}
+
+static bool IsAt(const float* light, const Vector3& position) {
+    return light[0] == position.X && light[1] == position.Y && light[2] == position.Z;
+}
+
+static void FinalizeReservoir(CPURaytracer::Reservoir& reservoir) {
+    reservoir.W = reservoir.TargetPdf > 0.0f ? reservoir.WeightSum / (reservoir.M * reservoir.TargetPdf) : 0.0f;
+}
+
+// The same surface seen again: close depth, normal and the same material
+static bool IsSimilar(const CPURaytracer::Surface& a, const CPURaytracer::Surface& b) {
+    return a.Distance > 0.0f && b.Distance > 0.0f
+        && std::abs(a.Distance - b.Distance) < 0.05f * a.Distance
+        && a.Normal.Dot(b.Normal) > 0.9f
+        && a.Material == b.Material;
+}
+
+static void WriteGuides(CPURaytracer::Guides& guides, int idx, float distance, const Vector3& normal, const float* material) {
+    bool isHit = distance > 0.0f;
+    guides.Depth[idx] = isHit ? distance : 0.0f;
+    guides.Normal[idx * 3] = isHit ? normal.X : 0.0f;
+    guides.Normal[idx * 3 + 1] = isHit ? normal.Y : 0.0f;
+    guides.Normal[idx * 3 + 2] = isHit ? normal.Z : 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        guides.Albedo[idx * 3 + i] = isHit ? material[i] : 0.0f;
+    }
+}
+
+static CPURaytracer::Mover GetMover(entt::registry& registry, entt::entity entity) {
+    const RigidBody* body = registry.try_get<RigidBody>(entity);
+    return {MOVER_ID | static_cast<uint32_t>(entity), body ? body->Velocity : Vector3()};
+}
+
+// Compares the records with their copy from the previous frame and keeps the new ones
+static bool KeepRecords(const float* records, int size, std::vector<float>& copy) {
+    bool same = (int)copy.size() == size && std::equal(records, records + size, copy.begin());
+    copy.assign(records, records + size);
+    return same;
+}
+
+// Hit of this frame for the cache; prevPoint is where its point was in the previous one,
+// moved back along the velocity of a dynamic sphere or mesh instance
+static CPURaytracer::CachedHit GetCachedHit(const Scene& scene, const std::vector<CPURaytracer::Mover>& movers,
+                                             const Ray& ray, const Hit& hit, Vector3& prevPoint) {
+    CPURaytracer::CachedHit cached;
+    cached.Id = hit.Mesh >= 0 ? hit.Mesh : hit.Primitive;
+    cached.Distance = hit.Distance;
+    cached.Age = 0;
+
+    // dynamic spheres are stored right before the shapes
+    int mover = -1;
+    if (hit.Mesh >= 0) {
+        mover = (scene.ShapesIdx - scene.DynamicTree.SpheresIdx) / SPHERES_SIZE + (hit.Mesh - scene.MeshesIdx) / MESH_SIZE;
+    } else if (hit.Primitive >= scene.DynamicTree.SpheresIdx && hit.Primitive < scene.ShapesIdx) {
+        mover = (hit.Primitive - scene.DynamicTree.SpheresIdx) / SPHERES_SIZE;
+    }
+    prevPoint = ray.From + ray.Dir * hit.Distance;
+    if (mover >= 0 && mover < (int)movers.size()) {
+        cached.Id = movers[mover].Id;
+        prevPoint = prevPoint - movers[mover].Velocity;
+    }
+    return cached;
+}
+
+// Pixel a point is seen at from the camera of the frame, -1 outside of the image
+template<typename Frame>
+static int Project(const Frame& frame, const Vector3& point, int width, int height) {
+    Vector3 toPoint = point - frame.CameraPos;
+    float forward = toPoint.Dot(frame.CameraForward) / frame.CameraForward.Dot(frame.CameraForward);
+    if (forward <= 0.0f) {
+        return -1;
+    }
+    int ci = (int)std::floor(toPoint.Dot(frame.CameraRight) / (frame.CameraRight.Dot(frame.CameraRight) * forward) + 0.5f * width + 0.5f);
+    int cj = (int)std::floor(toPoint.Dot(frame.CameraUp) / (frame.CameraUp.Dot(frame.CameraUp) * forward) + 0.5f * height + 0.5f);
+    if (ci < 0 || cj < 0 || ci >= width || cj >= height) {
+        return -1;
+    }
+    return cj * width + ci;
+}
+
+// The same record at the distance the reprojected point should be, and not expired
+static bool IsCached(const CPURaytracer::CachedHit& cached, const CPURaytracer::CachedHit& hit, float distance, int maxAge) {
+    return cached.Age >= 0 && cached.Age < maxAge && cached.Id == hit.Id
+        && std::abs(cached.Distance - distance) < CACHE_DEPTH_TOLERANCE * distance;
+}
+
+CPURaytracer::CPURaytracer(entt::registry& registry, int width, int height, int treeWidth, int threads,
+                           std::shared_ptr<SceneEncoder> encoder)
+    : Registry(registry)
+    , Encoder(encoder ? encoder : std::make_shared<SceneEncoder>(registry, width, height, treeWidth))
+    , Width(width)
+    , Height(height)
+    , LastRow(height)
+{
+    Threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    OutputData.resize(width * height * 3);
+}
+
+void CPURaytracer::SetLightSampling(LightSampling sampling) {
+    Sampling = sampling;
+    if (Sampling == LightSampling::Reservoirs) {
+        Surfaces.assign(Width * Height, Surface());
+        PrevSurfaces.assign(Width * Height, Surface());
+        Candidates.assign(Width * Height, Reservoir());
+        Reservoirs.assign(Width * Height, Reservoir());
+        HistoryLength.assign(Width * Height, 0);
+    }
+}
+
+void CPURaytracer::SetGuides(bool guides) {
+    Guide.Normal.assign(guides ? Width * Height * 3 : 0, 0.0f);
+    Guide.Depth.assign(guides ? Width * Height : 0, 0.0f);
+    Guide.Albedo.assign(guides ? Width * Height * 3 : 0, 0.0f);
+}
+
+void CPURaytracer::SetShadingCache(bool cache) {
+    for (CachedFrame& frame: CachedFrames) {
+        frame.Hits.assign(cache ? Width * Height : 0, CachedHit());
+    }
+}
+
+void CPURaytracer::Update() {
+    Render(Encoder->Encode());
+}
+
+void CPURaytracer::Render(const std::vector<float>& inputData) {
+    Input = &inputData[0];
+
+    if (!Guide.Depth.empty()) {
+        Scene scene = ReadScene(Input);
+        Guide.CameraPos = scene.CameraPos;
+        Guide.CameraForward = scene.CameraForward;
+        Guide.CameraRight = scene.CameraRight;
+        Guide.CameraUp = scene.CameraUp;
+    }
+
+    if (Sampling == LightSampling::Reservoirs) {
+        BuildLightCdf();
+        RunRows(&CPURaytracer::SampleLights);
+        RunRows(&CPURaytracer::ShadeSamples);
+        std::swap(Surfaces, PrevSurfaces);
+        Scene scene = ReadScene(Input);
+        PrevView = {scene.CameraPos, scene.CameraForward, scene.CameraRight, scene.CameraUp};
+        PrevFirstRow = FirstRow;
+        PrevLastRow = LastRow;
+        ++Frame;
+        return;
+    }
+
+    bool cached = !CachedFrames[0].Hits.empty();
+    if (cached) {
+        PrepareCache();
+    }
+    RunRows(&CPURaytracer::RenderRows);
+    if (cached) {
+        CurrentFrame = 1 - CurrentFrame;
+    }
+}
+
+// The previous frame is only reused while the static records, shapes, lights and shading
+// paths stay the same and the same rows are rendered
+void CPURaytracer::PrepareCache() {
+    Scene scene = ReadScene(Input);
+    bool sameShapes = KeepRecords(Input + scene.ShapesIdx, scene.ShapesNumber * SHAPE_SIZE, CachedShapes);
+    bool sameLights = KeepRecords(Input + scene.LightsIdx, (scene.GlobalLightsNumber + scene.LocalLightsNumber) * LIGHT_SIZE, CachedLights);
+    ReuseCache = sameShapes && sameLights
+        && CachedStaticBuilds == Encoder->GetStaticBuilds()
+        && CachedFeatures == Encoder->GetFeatures()
+        && CachedShadowQuality == ShadowQuality
+        && CachedFirstRow == FirstRow && CachedLastRow == LastRow;
+    CachedStaticBuilds = Encoder->GetStaticBuilds();
+    CachedFeatures = Encoder->GetFeatures();
+    CachedShadowQuality = ShadowQuality;
+    CachedFirstRow = FirstRow;
+    CachedLastRow = LastRow;
+
+    Movers.clear();
+    for (auto entity: Encoder->GetDynamicSpheres()) {
+        Movers.push_back(GetMover(Registry, entity));
+    }
+    for (auto entity: Encoder->GetInstances()) {
+        Movers.push_back(GetMover(Registry, entity));
+    }
+
+    // moving shadows fall on any surface, so the fastest mover sets how long light is reused
+    float maxSpeed = 0.0f;
+    for (const Mover& mover: Movers) {
+        maxSpeed = std::max(maxSpeed, mover.Velocity.Magnitude());
+    }
+    CacheMaxAge = maxSpeed * CACHE_MAX_AGE > CACHE_MAX_MOTION ? std::max(1, (int)(CACHE_MAX_MOTION / maxSpeed)) : CACHE_MAX_AGE;
+
+    CachedFrame& frame = CachedFrames[CurrentFrame];
+    frame.CameraPos = scene.CameraPos;
+    frame.CameraForward = scene.CameraForward;
+    frame.CameraRight = scene.CameraRight;
+    frame.CameraUp = scene.CameraUp;
+}
+
+void CPURaytracer::RunRows(void (CPURaytracer::*pass)(int firstRow, int rowStep)) {
+    // rows are interleaved between threads to even out the cost of busy parts of the frame
+    std::vector<std::thread> workers;
+    for (int i = 1; i < Threads; ++i) {
+        workers.emplace_back(pass, this, FirstRow + i, Threads);
+    }
+    (this->*pass)(FirstRow, Threads);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+void CPURaytracer::RenderRows(int firstRow, int rowStep) {
+    Scene scene = ReadScene(Input);
+    scene.ShadowQuality = ShadowQuality;
+    Shader shade = GetShader(Encoder->GetFeatures());
+    CachedShader shadeCached = GetCachedShader(Encoder->GetFeatures());
+    bool cached = !CachedFrames[0].Hits.empty();
+    CachedFrame& frame = CachedFrames[CurrentFrame];
+    const CachedFrame& prev = CachedFrames[1 - CurrentFrame];
+
+    for (int cj = firstRow; cj < LastRow; cj += rowStep) {
+        for (int ci = 0; ci < Width; ++ci) {
+            int idx = cj * Width + ci;
+            int pos = idx * 3;
+            if (cached) {
+                frame.Hits[idx] = CachedHit();
+            }
+
+            if (IsEmpty(scene)) {
+                OutputData[pos] = 0;
+                OutputData[pos + 1] = 0;
+                OutputData[pos + 2] = 1;
+                continue;
+            }
+
+            Ray ray = GetPrimaryRay(scene, ci, cj, Width, Height);
+            Hit hit = Intersect(scene, ray);
+
+            // lens rays start at random points, so only pinhole frames are cached
+            Color color(0.98f, 0.98f, 0.98f);
+            if (hit.Distance >= 0 && cached && !HasLens(scene)) {
+                Vector3 prevPoint;
+                CachedHit& current = frame.Hits[idx];
+                current = GetCachedHit(scene, Movers, ray, hit, prevPoint);
+                int prevIdx = ReuseCache ? Project(prev, prevPoint, Width, Height) : -1;
+                const CachedHit* reused = nullptr;
+                if (prevIdx >= FirstRow * Width && prevIdx < LastRow * Width
+                    && IsCached(prev.Hits[prevIdx], current, (prevPoint - prev.CameraPos).Magnitude(), CacheMaxAge)) {
+                    reused = &prev.Hits[prevIdx];
+                    current.Age = reused->Age + 1;
+                } else if (!ReuseCache) {
+                    // spreads the expiry of a fully shaded frame over the next ones
+                    current.Age = Hash(idx) % CacheMaxAge;
+                }
+                color = shadeCached(scene, ray, hit, reused, current);
+            } else if (hit.Distance >= 0) {
+                color = shade(scene, ray, hit);
+            }
+            if (!Guide.Depth.empty()) {
+                WriteGuides(Guide, idx, hit.Distance, hit.Normal, hit.Material);
+            }
+            if (scene.Blend < 1.0f) {
+                color.R = OutputData[pos] + (color.R - OutputData[pos]) * scene.Blend;
+                color.G = OutputData[pos + 1] + (color.G - OutputData[pos + 1]) * scene.Blend;
+                color.B = OutputData[pos + 2] + (color.B - OutputData[pos + 2]) * scene.Blend;
+            }
+            OutputData[pos] = color.R;
+            OutputData[pos + 1] = color.G;
+            OutputData[pos + 2] = color.B;
+        }
+    }
+}
+
+// Candidates are drawn in proportion to the light power, whatever the distance
+void CPURaytracer::BuildLightCdf() {
+    Scene scene = ReadScene(Input);
+    int lightsNumber = scene.GlobalLightsNumber + scene.LocalLightsNumber;
+    LightCdf.resize(lightsNumber);
+    float total = 0.0f;
+    for (int i = 0; i < lightsNumber; ++i) {
+        total += std::max(0.0f, Input[scene.LightsIdx + i * LIGHT_SIZE + 3]);
+        LightCdf[i] = total;
+    }
+}
+
+// First pass: primary hits and a reservoir per pixel from a few power sampled
+// candidates, merged with the reservoir the pixel ended with last frame
+void CPURaytracer::SampleLights(int firstRow, int rowStep) {
+    Scene scene = ReadScene(Input);
+    float totalPower = LightCdf.empty() ? 0.0f : LightCdf.back();
+    int candidatesNumber = std::min<int>(RESERVOIR_CANDIDATES, LightCdf.size());
+    int lightsEnd = scene.LightsIdx + LightCdf.size() * LIGHT_SIZE;
+
+    for (int cj = firstRow; cj < LastRow; cj += rowStep) {
+        for (int ci = 0; ci < Width; ++ci) {
+            int idx = cj * Width + ci;
+            Surface& surface = Surfaces[idx];
+            Reservoir& reservoir = Candidates[idx];
+            surface = Surface();
+            reservoir = Reservoir();
+            if (IsEmpty(scene)) {
+                continue;
+            }
+
+            Ray ray = GetPrimaryRay(scene, ci, cj, Width, Height);
+            Hit hit = Intersect(scene, ray);
+            if (hit.Distance <= 0.0f) {
+                continue;
+            }
+            surface.From = ray.From;
+            surface.Dir = ray.Dir;
+            surface.Normal = hit.Normal;
+            surface.Distance = hit.Distance;
+            surface.Material = hit.Material - Input;
+            if (totalPower <= 0.0f) {
+                continue;
+            }
+
+            Random random = {Hash(idx ^ Hash(Frame))};
+            for (int i = 0; i < candidatesNumber; ++i) {
+                int light = std::upper_bound(LightCdf.begin(), LightCdf.end(), random.Next() * totalPower) - LightCdf.begin();
+                light = std::min<int>(light, LightCdf.size() - 1);
+                float sourcePdf = (LightCdf[light] - (light > 0 ? LightCdf[light - 1] : 0.0f)) / totalPower;
+                int lightIdx = scene.LightsIdx + light * LIGHT_SIZE;
+                float targetPdf = GetTargetPdf(scene, surface, lightIdx);
+                UpdateReservoir(reservoir, lightIdx, targetPdf, sourcePdf > 0.0f ? targetPdf / sourcePdf : 0.0f, 1.0f, random);
+            }
+            FinalizeReservoir(reservoir);
+
+            // the previous reservoir is the one of the pixel the hit point was seen at with the previous
+            // camera. It only counts if it saw the same surface and its light is still there, its
+            // weight is capped so that stale history fades out.
+            Vector3 point = surface.From + surface.Dir * surface.Distance;
+            int prevIdx = Project(PrevView, point, Width, Height);
+            if (prevIdx >= PrevFirstRow * Width && prevIdx < PrevLastRow * Width) {
+                const Reservoir& prev = Reservoirs[prevIdx];
+                Surface seen = surface;
+                seen.Distance = (point - PrevView.CameraPos).Magnitude();
+                if (prev.Light >= scene.LightsIdx && prev.Light < lightsEnd && IsSimilar(seen, PrevSurfaces[prevIdx])
+                    && IsAt(Input + prev.Light, prev.LightPos)) {
+                    float m = std::min(prev.M, TEMPORAL_HISTORY * reservoir.M);
+                    float targetPdf = GetTargetPdf(scene, surface, prev.Light);
+                    UpdateReservoir(reservoir, prev.Light, targetPdf, targetPdf * prev.W * m, m, random);
+                    FinalizeReservoir(reservoir);
+                }
+            }
+            if (reservoir.Light >= 0) {
+                reservoir.LightPos = Vector3(Input[reservoir.Light], Input[reservoir.Light + 1], Input[reservoir.Light + 2]);
+            }
+        }
+    }
+}
+
+// Second pass: reservoirs of similar neighbours are merged in, then the chosen light
+// is shaded with a single shadow ray and the pixel is blended with its history
+void CPURaytracer::ShadeSamples(int firstRow, int rowStep) {
+    Scene scene = ReadScene(Input);
+    SampleShader shade = GetSampleShader(Encoder->GetFeatures());
+
+    for (int cj = firstRow; cj < LastRow; cj += rowStep) {
+        for (int ci = 0; ci < Width; ++ci) {
+            int idx = cj * Width + ci;
+            int pos = idx * 3;
+            const Surface& surface = Surfaces[idx];
+
+            if (IsEmpty(scene)) {
+                OutputData[pos] = 0;
+                OutputData[pos + 1] = 0;
+                OutputData[pos + 2] = 1;
+                continue;
+            }
+
+            if (!Guide.Depth.empty()) {
+                WriteGuides(Guide, idx, surface.Distance, surface.Normal, surface.Distance > 0.0f ? Input + surface.Material : nullptr);
+            }
+            if (surface.Distance <= 0.0f) {
+                HistoryLength[idx] = 0;
+                OutputData[pos] = 0.98f;
+                OutputData[pos + 1] = 0.98f;
+                OutputData[pos + 2] = 0.98f;
+                continue;
+            }
+
+            // neighbours are read from the candidates of this frame, complete after the first pass,
+            // and only within the rows it sampled: the others hold older frames
+            Random random = {Hash(idx ^ Hash(Frame + 0x9e3779b9u))};
+            const Reservoir& candidate = Candidates[idx];
+            Reservoir reservoir = candidate;
+            for (int i = 0; i < SPATIAL_NEIGHBOURS; ++i) {
+                int ni = ci + (int)((random.Next() * 2.0f - 1.0f) * SPATIAL_RADIUS);
+                int nj = cj + (int)((random.Next() * 2.0f - 1.0f) * SPATIAL_RADIUS);
+                if (ni < 0 || nj < FirstRow || ni >= Width || nj >= LastRow || (ni == ci && nj == cj)) {
+                    continue;
+                }
+                int neighbourIdx = nj * Width + ni;
+                const Reservoir& neighbour = Candidates[neighbourIdx];
+                if (neighbour.Light < 0 || !IsSimilar(surface, Surfaces[neighbourIdx])) {
+                    continue;
+                }
+                float targetPdf = GetTargetPdf(scene, surface, neighbour.Light);
+                UpdateReservoir(reservoir, neighbour.Light, targetPdf, targetPdf * neighbour.W * neighbour.M, neighbour.M, random);
+            }
+            FinalizeReservoir(reservoir);
+            if (reservoir.Light >= 0) {
+                reservoir.LightPos = Vector3(Input[reservoir.Light], Input[reservoir.Light + 1], Input[reservoir.Light + 2]);
+            }
+            Reservoirs[idx] = reservoir;
+
+            Ray ray = {surface.From, surface.Dir};
+            Hit hit;
+            hit.Distance = surface.Distance;
+            hit.Normal = surface.Normal;
+            hit.Material = Input + surface.Material;
+            Color color = shade(scene, ray, hit, reservoir.Light >= 0 ? Input + reservoir.Light : nullptr, reservoir.W);
+
+            // progressive accumulation over the frames that saw the same surface
+            int& historyLength = HistoryLength[idx];
+            historyLength = IsSimilar(surface, PrevSurfaces[idx]) ? std::min(historyLength + 1, MAX_HISTORY) : 1;
+            float blend = 1.0f / historyLength;
+            OutputData[pos] += (color.R - OutputData[pos]) * blend;
+            OutputData[pos + 1] += (color.G - OutputData[pos + 1]) * blend;
+            OutputData[pos + 2] += (color.B - OutputData[pos + 2]) * blend;
+        }
+    }
+}
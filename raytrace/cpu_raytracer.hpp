@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <entt/entt.hpp>
+
+#include "raytracer.hpp"
+#include "scene_encoder.hpp"
+
+// Multithreaded port of metal_kernel.c. It reads the same scene buffer as the
+// GPU backends; with treeWidth 4 or 8 the quantized wide trees are traversed
+// with SIMD box tests, SceneEncoder::GRID walks a uniform grid instead.
+//
+// LightSampling::Reservoirs replaces the loop over lights of the primary hits
+// with resampled importance sampling: every pixel keeps a reservoir holding one
+// light, picked among a few candidates by its unshadowed contribution and merged
+// with the reservoir of the pixel that saw the same point in the previous frame and
+// of nearby pixels. Only that light gets a shadow ray, and the noise is averaged out
+// over frames.
+//
+// SetShadingCache() keeps the primary hit of every pixel with its direct light.
+// Next frame a hit point is moved back by the RigidBody velocity of its entity
+// and projected with the previous camera: if the pixel there saw the same object
+// at the same distance, its direct light and soft shadows are reused, and only
+// the primary ray and the reflections are traced. Reused light expires after a
+// few frames, so moving shadows catch up, and everything is shaded again once
+// the lights or shapes change.
+class CPURaytracer : public Raytracer {
+public:
+    enum class LightSampling {
+        AllLights,      // every light in range with soft shadows, as the GPU kernels do
+        Reservoirs,     // one resampled light and shadow ray per pixel, accumulated over frames
+    };
+
+    // Primary hit kept for the reuse between pixels and frames
+    struct Surface {
+        Vector3 From;           // the camera, or a point of its lens
+        Vector3 Dir;
+        Vector3 Normal;
+        float Distance = -1.0f;
+        int Material = -1;      // offset in the scene buffer
+    };
+
+    // Camera of the previous frame, the reservoirs are looked up where a point was seen then
+    struct View {
+        Vector3 CameraPos;
+        Vector3 CameraForward;
+        Vector3 CameraRight;
+        Vector3 CameraUp;
+    };
+
+    struct Reservoir {
+        int Light = -1;         // offset of the light record
+        Vector3 LightPos;       // to tell if the record still holds the same light next frame
+        float TargetPdf = 0.0f;
+        float WeightSum = 0.0f;
+        float M = 0.0f;         // number of candidates seen
+        float W = 0.0f;         // weight of the chosen light
+    };
+
+    // Primary hit a pixel was shaded for
+    struct CachedHit {
+        uint32_t Id = 0;        // the record offset, or the entity of a moving record
+        float Distance = -1.0f;
+        int Age = -1;           // frames the shading has been reused, -1 for nothing to reuse
+        Color Direct;           // ambient and direct light, with the soft shadows
+        float Visibility = -1.0f;
+    };
+
+    // Primary hits of a frame and the camera they were seen from
+    struct CachedFrame {
+        std::vector<CachedHit> Hits;
+        Vector3 CameraPos;
+        Vector3 CameraForward;
+        Vector3 CameraRight;
+        Vector3 CameraUp;
+    };
+
+    // Dynamic sphere or mesh instance record, whose offset changes between frames
+    struct Mover {
+        uint32_t Id;
+        Vector3 Velocity;       // of its RigidBody, per frame
+    };
+
+    // Primary hits of the last frame for a Denoiser, planes of width * height pixels
+    struct Guides {
+        std::vector<float> Normal;      // x, y, z per pixel
+        std::vector<float> Depth;       // distance along the primary ray, 0 where it hits nothing
+        std::vector<float> Albedo;      // r, g, b of the material color per pixel
+        Vector3 CameraPos;              // the pinhole of the primary rays, as in the scene buffer
+        Vector3 CameraForward;
+        Vector3 CameraRight;            // one pixel long, as CameraUp
+        Vector3 CameraUp;
+    };
+
+    // encoder, when given, is shared with another backend and encodes the scene for both,
+    // see Render()
+    CPURaytracer(entt::registry& registry, int width, int height, int treeWidth = 4, int threads = 0,
+                 std::shared_ptr<SceneEncoder> encoder = nullptr);
+    void SetLightSampling(LightSampling sampling);
+    // Soft shadows of SceneEncoder::SHADOW_RAYS trace (2 * quality + 1)^2 rays per light,
+    // 2 by default. -1 traces one ray jittered every frame, noisy but cheap for a Denoiser.
+    void SetShadowQuality(int quality) {
+        ShadowQuality = quality;
+    }
+    // Keeps Guides of every frame, off by default
+    void SetGuides(bool guides);
+    const Guides& GetGuides() const {
+        return Guide;
+    }
+    // Reuses the shading of pixels that see the same surface as in the previous frame,
+    // off by default. Only with LightSampling::AllLights and a pinhole camera.
+    void SetShadingCache(bool cache);
+    void SetShadowMode(int shadowMode) override {
+        Encoder->SetShadowMode(shadowMode);
+    }
+    // Renders only rows [firstRow, lastRow), the rest of RawData() keeps older frames
+    void SetRows(int firstRow, int lastRow) {
+        FirstRow = firstRow;
+        LastRow = lastRow;
+    }
+    void Update() override;
+    // Renders a frame from inputData, the last Encode() of the encoder given to the constructor
+    void Render(const std::vector<float>& inputData);
+    void* RawData() override {
+        return &OutputData[0];
+    }
+private:
+    void RunRows(void (CPURaytracer::*pass)(int firstRow, int rowStep));
+    void RenderRows(int firstRow, int rowStep);
+    void PrepareCache();
+    void BuildLightCdf();
+    void SampleLights(int firstRow, int rowStep);
+    void ShadeSamples(int firstRow, int rowStep);
+private:
+    entt::registry& Registry;
+    std::shared_ptr<SceneEncoder> Encoder;
+    int Width;
+    int Height;
+    int FirstRow = 0;
+    int LastRow;
+    int Threads;
+    const float* Input = nullptr;
+    std::vector<float> OutputData;
+    LightSampling Sampling = LightSampling::AllLights;
+    int ShadowQuality = 2;
+    Guides Guide;
+    CachedFrame CachedFrames[2];            // of the current and previous frame
+    int CurrentFrame = 0;
+    std::vector<Mover> Movers;              // dynamic spheres, then mesh instances, in buffer order
+    std::vector<float> CachedShapes;
+    std::vector<float> CachedLights;
+    int CachedStaticBuilds = -1;
+    int CachedFeatures = -1;
+    int CachedShadowQuality = 0;
+    int CachedFirstRow = 0;
+    int CachedLastRow = 0;
+    bool ReuseCache = false;                // the previous frame can be reused in this one
+    int CacheMaxAge = 1;
+    std::vector<float> LightCdf;
+    std::vector<Surface> Surfaces;
+    std::vector<Surface> PrevSurfaces;
+    std::vector<Reservoir> Candidates;
+    std::vector<Reservoir> Reservoirs;
+    View PrevView;
+    int PrevFirstRow = 0;                   // rows the reservoirs were last sampled for
+    int PrevLastRow = 0;
+    std::vector<int> HistoryLength;
+    uint32_t Frame = 0;
+};
@@ -0,0 +1,377 @@
+#include "denoiser.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+// SSE and NEON width, the build does not assume wider units
+typedef float Float4 __attribute__((vector_size(16)));
+typedef int32_t Int4 __attribute__((vector_size(16)));
+
+const int LANES = 4;
+const float MAX_HISTORY = 32.0f;        // frames
+const float COLOR_ALPHA = 0.1f;         // least weight of the new frame, bounds the lag behind changes
+const float MOMENTS_ALPHA = 0.2f;
+const float HISTORY_CLAMP = 2.0f;       // standard deviations of the neighbourhood the history may be off
+const int SPATIAL_VARIANCE_FRAMES = 4;  // shorter histories estimate the variance from the neighbours
+const float DEPTH_TOLERANCE = 0.05f;    // relative, for the reprojected history
+const float NORMAL_TOLERANCE = 0.9f;
+const float ALBEDO_TOLERANCE = 0.1f;
+const float DEPTH_SIGMA = 0.05f;        // relative depth change per pixel the filter still averages over
+const float ALBEDO_SIGMA = 0.1f;
+const float LUMINANCE_SIGMA = 1.0f;     // in standard deviations of the blended color
+const float KERNEL[3] = {1.0f / 4.0f, 1.0f / 2.0f, 1.0f / 4.0f};    // per axis, 2 * RADIUS + 1 taps
+
+static inline Float4 Load(const float* ptr) {
+    Float4 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline void Store(float* ptr, Float4 value) {
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static inline Float4 Select(Int4 mask, Float4 a, Float4 b) {
+    return (Float4)(((Int4)a & mask) | ((Int4)b & ~mask));
+}
+
+static inline Float4 Max(Float4 a, Float4 b) {
+    return Select(a > b, a, b);
+}
+
+static inline Float4 Abs(Float4 a) {
+    return (Float4)((Int4)a & 0x7fffffff);
+}
+
+static inline Float4 Sqrt(Float4 a) {
+    for (int i = 0; i < LANES; ++i) {
+        a[i] = sqrtf(a[i]);
+    }
+    return a;
+}
+
+static inline Float4 Pow64(Float4 x) {
+    x *= x;
+    x *= x;
+    x *= x;
+    x *= x;
+    x *= x;
+    return x * x;
+}
+
+// e^x for x <= 0 as (1 + x / 64)^64, close enough for weights
+static inline Float4 Exp(Float4 x) {
+    return Pow64(Max(1.0f + x * (1.0f / 64.0f), Float4{}));
+}
+
+template<typename F>
+static inline F Luminance(F r, F g, F b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+Denoiser::Denoiser(int width, int height, int threads)
+    : Width(width)
+    , Height(height)
+{
+    Threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    Stride = (width + LANES - 1) / LANES * LANES + 2 * MARGIN;
+    size_t planeSize = Stride * (height + 2 * MARGIN);
+    for (Frame& frame: Frames) {
+        for (int axis = 0; axis < 3; ++axis) {
+            frame.Normal[axis].assign(planeSize, 0.0f);
+            frame.Albedo[axis].assign(planeSize, 0.0f);
+        }
+        frame.Depth.assign(planeSize, 0.0f);
+    }
+    for (int i = 0; i < 2; ++i) {
+        for (int channel = 0; channel < 3; ++channel) {
+            Color[i][channel].assign(planeSize, 0.0f);
+        }
+        Variance[i].assign(planeSize, 0.0f);
+        Moments[i][0].assign(planeSize, 0.0f);
+        Moments[i][1].assign(planeSize, 0.0f);
+        Length[i].assign(planeSize, 0.0f);
+    }
+    for (int channel = 0; channel < 3; ++channel) {
+        History[channel].assign(planeSize, 0.0f);
+    }
+    OutputData.resize(width * height * 3);
+}
+
+void Denoiser::Update(const float* color, const CPURaytracer::Guides& guides) {
+    Input = color;
+    Guide = &guides;
+    Frame& frame = Frames[Current];
+    frame.CameraPos = guides.CameraPos;
+    frame.CameraForward = guides.CameraForward;
+    frame.CameraRight = guides.CameraRight;
+    frame.CameraUp = guides.CameraUp;
+
+    RunRows(&Denoiser::Accumulate);
+    for (Pass = 0; Pass < PASSES; ++Pass) {
+        RunRows(&Denoiser::Filter);
+    }
+    Current = 1 - Current;
+}
+
+void Denoiser::RunRows(void (Denoiser::*pass)(int firstRow, int rowStep)) {
+    std::vector<std::thread> workers;
+    for (int i = 1; i < Threads; ++i) {
+        workers.emplace_back(pass, this, i, Threads);
+    }
+    (this->*pass)(0, Threads);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+// Temporal pass: the frame is copied into the planes and blended with the history at
+// the point the pixel saw in the previous frame
+void Denoiser::Accumulate(int firstRow, int rowStep) {
+    Frame& frame = Frames[Current];
+    const Frame& prev = Frames[1 - Current];
+    const CPURaytracer::Guides& guides = *Guide;
+    float rightScale = 1.0f / prev.CameraRight.Dot(prev.CameraRight);
+    float upScale = 1.0f / prev.CameraUp.Dot(prev.CameraUp);
+    float forwardScale = 1.0f / prev.CameraForward.Dot(prev.CameraForward);
+
+    for (int cj = firstRow; cj < Height; cj += rowStep) {
+        for (int ci = 0; ci < Width; ++ci) {
+            int pixel = cj * Width + ci;
+            int idx = GetIdx(ci, cj);
+            const float* input = Input + pixel * 3;
+            float depth = guides.Depth[pixel];
+            for (int axis = 0; axis < 3; ++axis) {
+                frame.Normal[axis][idx] = guides.Normal[pixel * 3 + axis];
+                frame.Albedo[axis][idx] = guides.Albedo[pixel * 3 + axis];
+                Color[0][axis][idx] = input[axis];
+            }
+            frame.Depth[idx] = depth;
+
+            float luminance = Luminance(input[0], input[1], input[2]);
+            float& length = Length[Current][idx];
+            float& moment1 = Moments[Current][0][idx];
+            float& moment2 = Moments[Current][1][idx];
+            length = 0.0f;
+            moment1 = luminance;
+            moment2 = luminance * luminance;
+            Variance[0][idx] = 0.0f;
+            if (depth <= 0.0f) {
+                continue;
+            }
+
+            // the point of this pixel in the previous frame, bilinear over the history samples of the same surface
+            Vector3 dir = frame.CameraForward + frame.CameraRight * (ci - 0.5f * Width) + frame.CameraUp * (cj - 0.5f * Height);
+            Vector3 point = frame.CameraPos + dir.Normalized() * depth;
+            Vector3 toPoint = point - prev.CameraPos;
+            float forward = toPoint.Dot(prev.CameraForward) * forwardScale;
+            float history[3] = {0.0f, 0.0f, 0.0f};
+            float historyMoments[2] = {0.0f, 0.0f};
+            float historyLength = 0.0f;
+            float weightSum = 0.0f;
+            if (forward > 0.0f) {
+                float x = toPoint.Dot(prev.CameraRight) * rightScale / forward + 0.5f * Width;
+                float y = toPoint.Dot(prev.CameraUp) * upScale / forward + 0.5f * Height;
+                float distance = toPoint.Magnitude();
+                int x0 = (int)std::floor(x);
+                int y0 = (int)std::floor(y);
+                for (int tap = 0; tap < 4; ++tap) {
+                    int tx = x0 + (tap & 1);
+                    int ty = y0 + (tap >> 1);
+                    if (tx < 0 || ty < 0 || tx >= Width || ty >= Height) {
+                        continue;
+                    }
+                    int q = GetIdx(tx, ty);
+                    float prevDepth = prev.Depth[q];
+                    float normalDot = 0.0f;
+                    float albedoDiff = 0.0f;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        normalDot += frame.Normal[axis][idx] * prev.Normal[axis][q];
+                        albedoDiff += std::abs(frame.Albedo[axis][idx] - prev.Albedo[axis][q]);
+                    }
+                    if (prevDepth <= 0.0f || std::abs(prevDepth - distance) > DEPTH_TOLERANCE * distance
+                        || normalDot < NORMAL_TOLERANCE || albedoDiff > ALBEDO_TOLERANCE) {
+                        continue;
+                    }
+                    float weight = ((tap & 1) ? x - x0 : 1.0f - (x - x0)) * ((tap >> 1) ? y - y0 : 1.0f - (y - y0));
+                    for (int channel = 0; channel < 3; ++channel) {
+                        history[channel] += History[channel][q] * weight;
+                    }
+                    historyMoments[0] += Moments[1 - Current][0][q] * weight;
+                    historyMoments[1] += Moments[1 - Current][1][q] * weight;
+                    historyLength += Length[1 - Current][q] * weight;
+                    weightSum += weight;
+                }
+            }
+
+            // statistics of the neighbourhood in this frame
+            float mean[3] = {0.0f, 0.0f, 0.0f};
+            float meanSquares[3] = {0.0f, 0.0f, 0.0f};
+            float luminanceSum = 0.0f;
+            float luminanceSquares = 0.0f;
+            int count = 0;
+            for (int nj = std::max(0, cj - 1); nj <= std::min(Height - 1, cj + 1); ++nj) {
+                for (int ni = std::max(0, ci - 1); ni <= std::min(Width - 1, ci + 1); ++ni) {
+                    int neighbour = nj * Width + ni;
+                    if (guides.Depth[neighbour] <= 0.0f) {
+                        continue;
+                    }
+                    const float* color = Input + neighbour * 3;
+                    for (int channel = 0; channel < 3; ++channel) {
+                        mean[channel] += color[channel];
+                        meanSquares[channel] += color[channel] * color[channel];
+                    }
+                    float value = Luminance(color[0], color[1], color[2]);
+                    luminanceSum += value;
+                    luminanceSquares += value * value;
+                    ++count;
+                }
+            }
+
+            length = 1.0f;
+            if (weightSum > 0.01f) {
+                length = std::min(historyLength / weightSum + 1.0f, MAX_HISTORY);
+                float alpha = std::max(1.0f / length, COLOR_ALPHA);
+                // history out of the range of the neighbourhood is stale, e.g. a highlight that moved
+                for (int channel = 0; channel < 3; ++channel) {
+                    float channelMean = mean[channel] / count;
+                    float deviation = sqrtf(std::max(0.0f, meanSquares[channel] / count - channelMean * channelMean));
+                    float value = history[channel] / weightSum;
+                    value = std::min(std::max(value, channelMean - HISTORY_CLAMP * deviation), channelMean + HISTORY_CLAMP * deviation);
+                    Color[0][channel][idx] = value + (input[channel] - value) * alpha;
+                }
+                alpha = std::max(1.0f / length, MOMENTS_ALPHA);
+                moment1 = historyMoments[0] / weightSum + (moment1 - historyMoments[0] / weightSum) * alpha;
+                moment2 = historyMoments[1] / weightSum + (moment2 - historyMoments[1] / weightSum) * alpha;
+            }
+            float variance = std::max(0.0f, moment2 - moment1 * moment1);
+
+            if (length < SPATIAL_VARIANCE_FRAMES) {
+                float luminanceMean = luminanceSum / count;
+                variance = std::max(variance, luminanceSquares / count - luminanceMean * luminanceMean);
+            }
+            // of the blended color rather than of one frame, the blend averages over about 2 / alpha - 1 frames
+            Variance[0][idx] = variance * std::max(1.0f / length, COLOR_ALPHA / (2.0f - COLOR_ALPHA));
+        }
+    }
+}
+
+// One à-trous pass over blocks of LANES pixels. The first one is kept as the history
+// of the next frame, the last one is the output.
+void Denoiser::Filter(int firstRow, int rowStep) {
+    const Frame& frame = Frames[Current];
+    const int step = 1 << Pass;
+    const int src = Pass & 1;
+    const int dst = 1 - src;
+    float tapDistances[2 * RADIUS + 1][2 * RADIUS + 1];
+    for (int dy = -RADIUS; dy <= RADIUS; ++dy) {
+        for (int dx = -RADIUS; dx <= RADIUS; ++dx) {
+            tapDistances[dy + RADIUS][dx + RADIUS] = 1.0f / std::max(1.0f, sqrtf(dx * dx + dy * dy));
+        }
+    }
+
+    for (int cj = firstRow; cj < Height; cj += rowStep) {
+        for (int ci = 0; ci < Width; ci += LANES) {
+            int p = GetIdx(ci, cj);
+            Float4 color[3];
+            for (int channel = 0; channel < 3; ++channel) {
+                color[channel] = Load(&Color[src][channel][p]);
+            }
+            Float4 variance = Load(&Variance[src][p]);
+            Float4 depth = Load(&frame.Depth[p]);
+            Int4 isHit = depth > 0.0f;
+
+            // pixels without a hit keep their color, as whole blocks of the background do
+            if (isHit[0] | isHit[1] | isHit[2] | isHit[3]) {
+                // the axes are spelled out, loops over arrays of vectors would keep them in memory
+                Float4 normalX = Load(&frame.Normal[0][p]);
+                Float4 normalY = Load(&frame.Normal[1][p]);
+                Float4 normalZ = Load(&frame.Normal[2][p]);
+                Float4 albedoR = Load(&frame.Albedo[0][p]);
+                Float4 albedoG = Load(&frame.Albedo[1][p]);
+                Float4 albedoB = Load(&frame.Albedo[2][p]);
+                Float4 luminance = Luminance(color[0], color[1], color[2]);
+
+                // the variance is blurred a little for a steadier luminance edge
+                Float4 blurred = {};
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        float weight = (dy == 0 ? 0.5f : 0.25f) * (dx == 0 ? 0.5f : 0.25f);
+                        blurred += Load(&Variance[src][p + dy * Stride + dx]) * weight;
+                    }
+                }
+                Float4 luminanceScale = 1.0f / (LUMINANCE_SIGMA * Sqrt(blurred) + 1e-4f);
+                Float4 depthScale = 1.0f / (DEPTH_SIGMA * step * depth + 1e-4f);
+
+                Float4 sumR = {};
+                Float4 sumG = {};
+                Float4 sumB = {};
+                Float4 varianceSum = {};
+                Float4 weightSum = {};
+                for (int dy = -RADIUS; dy <= RADIUS; ++dy) {
+                    for (int dx = -RADIUS; dx <= RADIUS; ++dx) {
+                        int q = p + (dy * Stride + dx) * step;
+                        Float4 tapDepth = Load(&frame.Depth[q]);
+                        Float4 normalDot = normalX * Load(&frame.Normal[0][q]) + normalY * Load(&frame.Normal[1][q])
+                                         + normalZ * Load(&frame.Normal[2][q]);
+                        Float4 albedoDiff = Abs(albedoR - Load(&frame.Albedo[0][q])) + Abs(albedoG - Load(&frame.Albedo[1][q]))
+                                          + Abs(albedoB - Load(&frame.Albedo[2][q]));
+                        Float4 tapR = Load(&Color[src][0][q]);
+                        Float4 tapG = Load(&Color[src][1][q]);
+                        Float4 tapB = Load(&Color[src][2][q]);
+
+                        Float4 weight = Pow64(Max(normalDot, Float4{}));
+                        weight *= Exp(-(Abs(depth - tapDepth) * depthScale * tapDistances[dy + RADIUS][dx + RADIUS]
+                                        + albedoDiff * (1.0f / ALBEDO_SIGMA)
+                                        + Abs(luminance - Luminance(tapR, tapG, tapB)) * luminanceScale));
+                        weight = Select(tapDepth > 0.0f, weight * (KERNEL[dy + RADIUS] * KERNEL[dx + RADIUS]), Float4{});
+
+                        sumR += tapR * weight;
+                        sumG += tapG * weight;
+                        sumB += tapB * weight;
+                        varianceSum += Load(&Variance[src][q]) * weight * weight;
+                        weightSum += weight;
+                    }
+                }
+
+                Int4 hasWeight = weightSum > 0.0f;
+                color[0] = Select(hasWeight, sumR / weightSum, color[0]);
+                color[1] = Select(hasWeight, sumG / weightSum, color[1]);
+                color[2] = Select(hasWeight, sumB / weightSum, color[2]);
+                variance = Select(hasWeight, varianceSum / (weightSum * weightSum), variance);
+            }
+
+            for (int channel = 0; channel < 3; ++channel) {
+                Store(&Color[dst][channel][p], color[channel]);
+                if (Pass == 0) {
+                    Store(&History[channel][p], color[channel]);
+                }
+            }
+            Store(&Variance[dst][p], variance);
+            if (Pass == PASSES - 1) {
+                for (int i = 0; i < LANES && ci + i < Width; ++i) {
+                    float* output = &OutputData[(cj * Width + ci + i) * 3];
+                    output[0] = color[0][i];
+                    output[1] = color[1][i];
+                    output[2] = color[2][i];
+                }
+            }
+        }
+    }
+}
+
+DenoisedCPURaytracer::DenoisedCPURaytracer(entt::registry& registry, int width, int height, int treeWidth, int threads)
+    : Cpu(registry, width, height, treeWidth, threads)
+    , Filter(width, height, threads)
+{
+    Cpu.SetShadowQuality(-1);
+    Cpu.SetGuides(true);
+}
+
+void DenoisedCPURaytracer::Update() {
+    Cpu.Update();
+    Filter.Update((const float*)Cpu.RawData(), Cpu.GetGuides());
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include <entt/entt.hpp>
+
+#include "cpu_raytracer.hpp"
+#include "raytracer.hpp"
+
+// Spatio-temporal filter for noisy frames of CPURaytracer, such as one jittered
+// shadow ray per light. Each pixel is first blended with its history, reprojected
+// with the camera movement and dropped where depth, normal or albedo disagree.
+// An edge-aware à-trous wavelet filter then smooths the image: 3x3 taps, 1, 2, 4, 8
+// pixels apart, weighted down across normal, depth and albedo edges and where the
+// luminance differs more than the variance of the pixel explains.
+//
+// The buffers are planes padded with empty pixels, so that the filter runs over
+// blocks of SIMD lanes along a row without border checks.
+class Denoiser {
+public:
+    Denoiser(int width, int height, int threads = 0);
+    // color is the width * height RGB frame the guides were kept for
+    void Update(const float* color, const CPURaytracer::Guides& guides);
+    void* RawData() {
+        return &OutputData[0];
+    }
+private:
+    // Guides of one frame
+    struct Frame {
+        std::vector<float> Normal[3];
+        std::vector<float> Depth;
+        std::vector<float> Albedo[3];
+        Vector3 CameraPos;
+        Vector3 CameraForward;
+        Vector3 CameraRight;
+        Vector3 CameraUp;
+    };
+
+    void RunRows(void (Denoiser::*pass)(int firstRow, int rowStep));
+    void Accumulate(int firstRow, int rowStep);
+    void Filter(int firstRow, int rowStep);
+    int GetIdx(int ci, int cj) const {
+        return (cj + MARGIN) * Stride + ci + MARGIN;
+    }
+private:
+    static const int PASSES = 4;
+    static const int RADIUS = 1;                            // taps on each side of a pixel
+    static const int MARGIN = RADIUS << (PASSES - 1);       // the farthest tap of the last pass
+
+    int Width;
+    int Height;
+    int Stride;         // floats per padded row
+    int Threads;
+    const float* Input = nullptr;
+    const CPURaytracer::Guides* Guide = nullptr;
+    Frame Frames[2];
+    int Current = 0;
+    std::vector<float> Color[2][3];     // the filter passes alternate between both
+    std::vector<float> Variance[2];
+    std::vector<float> History[3];      // color after the first pass, reprojected next frame
+    std::vector<float> Moments[2][2];   // luminance and its square, of the current and previous frame
+    std::vector<float> Length[2];       // frames in the history
+    int Pass = 0;
+    std::vector<float> OutputData;
+};
+
+// CPURaytracer with one jittered shadow ray per light, smoothed by the Denoiser
+class DenoisedCPURaytracer : public Raytracer {
+public:
+    DenoisedCPURaytracer(entt::registry& registry, int width, int height, int treeWidth = 4, int threads = 0);
+    void SetShadowMode(int shadowMode) override {
+        Cpu.SetShadowMode(shadowMode);
+    }
+    void Update() override;
+    void* RawData() override {
+        return Filter.RawData();
+    }
+private:
+    CPURaytracer Cpu;
+    Denoiser Filter;
+};
@@ -1,9 +1,16 @@
+#pragma once
+
+#include <memory>
+
 #include "linmath.hpp"
 #include "structs.hpp"
 
+class Mesh;
+
 struct Transform {
     Vector3 Position;
-    float Scale;
+    float Scale = 1.0f;
+    Vector3 Rotation;   // radians around X, then Y, then Z; only meshes are rotated
 };
 
 struct RigidBody {
@@ -11,7 +18,7 @@ struct RigidBody {
 };
 
 struct Material {
-    Color Color;
+    ::Color Color;
     float DiffuseCF;
     Vector3 AlbedoCF;
     Vector2 RefractCF;
@@ -22,15 +29,43 @@ struct SphereRenderer {
     float Radius;
 };
 
+// A light with a Radius only reaches points closer than it and fades out towards it,
+// which lets shading skip it everywhere else. Radius 0 lights the whole scene.
 struct LightSource {
     float Power;
+    float Radius = 0.0f;
+    float Size = 5.0f;      // radius of the emitting disk, sets the softness of the shadows
 };
 
+// Horizontal board at Transform.Position.Y, Size is its extent along X and Z.
+// Tiles alternate between Material.Color and SecondColor.
 struct ChessBoardRenderer {
     Vector2 Size;
+    ::Color SecondColor;
+    float TileSize = 4.0f;
+};
+
+// Axis-aligned box centered at Transform.Position
+struct BoxRenderer {
+    Vector3 Size;
+};
+
+// Instance of a triangle mesh placed by the entity Transform. Entities may
+// share one mesh, its geometry and tree are then uploaded once.
+struct MeshRenderer {
+    std::shared_ptr<::Mesh> Mesh;
 };
 
+// Looks along Direction, +Z when it is zero, with the horizon kept level.
+// FieldOfView is the vertical angle, the horizontal one follows from the
+// aspect of the frame as pixels are square.
+//
+// A thin lens of Aperture radius keeps the plane at FocusDistance sharp and
+// blurs the rest; every frame takes one lens sample per pixel and a still
+// camera averages them over the frames.
 struct Camera {
     Vector3 Direction;
     float FocusDistance;
+    float FieldOfView = 0.5f;   // radians
+    float Aperture = 0.0f;      // 0 is a pinhole, all in focus
 };
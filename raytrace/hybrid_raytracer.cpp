@@ -0,0 +1,61 @@
+#include "hybrid_raytracer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+
+const double BALANCE_SMOOTHING = 0.3;   // weight of the last frame in the share
+const int MIN_BAND = 32;                // of the image height, each side keeps some rows to be measured
+const int SPLIT_STEP = 64;              // of the image height, smaller changes are ignored
+
+HybridRaytracer::HybridRaytracer(entt::registry& registry, int width, int height, int treeWidth,
+                                 const std::string& device, int threads)
+    : Encoder(std::make_shared<SceneEncoder>(registry, width, height, treeWidth))
+    , Device(registry, width, height, treeWidth, device, Encoder)
+    , Cpu(registry, width, height, treeWidth, threads, Encoder)
+    , Width(width)
+    , Height(height)
+    , Split(height / 2)
+{
+    OutputData.resize(width * height * 3);
+}
+
+void HybridRaytracer::Update() {
+    Device.SetRows(0, Split);
+    Cpu.SetRows(Split, Height);
+
+    // the CPU starts on its band as soon as the device kernel is queued. This thread waits
+    // for the device meanwhile, so that both sides are timed on the host.
+    const std::vector<float>& inputData = Encoder->Encode();
+    auto start = std::chrono::steady_clock::now();
+    Device.Enqueue(inputData);
+    std::future<double> cpuDone = std::async(std::launch::async, [this, &inputData]() {
+        auto cpuStart = std::chrono::steady_clock::now();
+        Cpu.Render(inputData);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpuStart).count();
+    });
+    Device.Finish();
+    std::chrono::duration<double, std::milli> deviceTime = std::chrono::steady_clock::now() - start;
+    double cpuTime = cpuDone.get();
+
+    size_t rowSize = sizeof(float) * Width * 3;
+    memcpy(&OutputData[0], Device.RawData(), rowSize * Split);
+    memcpy(&OutputData[Width * 3 * Split], (float*)Cpu.RawData() + Width * 3 * Split, rowSize * (Height - Split));
+
+    Balance(deviceTime.count(), cpuTime);
+}
+
+void HybridRaytracer::Balance(double deviceTime, double cpuTime) {
+    double deviceRate = Split / std::max(deviceTime, 1e-3);
+    double cpuRate = (Height - Split) / std::max(cpuTime, 1e-3);
+    DeviceShare += (deviceRate / (deviceRate + cpuRate) - DeviceShare) * BALANCE_SMOOTHING;
+
+    int minBand = std::max(1, Height / MIN_BAND);
+    int split = std::min(std::max((int)std::lround(DeviceShare * Height), minBand), Height - minBand);
+    if (std::abs(split - Split) >= std::max(1, Height / SPLIT_STEP)) {
+        Split = split;
+    }
+}
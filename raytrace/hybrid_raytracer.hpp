@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <entt/entt.hpp>
+
+#include "cpu_raytracer.hpp"
+#include "opencl_raytracer.hpp"
+#include "raytracer.hpp"
+
+// Splits every frame between an OpenCL device and the CPU threads: the device renders
+// the top rows while the CPU renders the rest, and both bands are copied into one image.
+// The split follows the rows per millisecond of host wall time each side reached in the
+// previous frames.
+//
+// The scene is encoded once per frame into one buffer both backends read. Rows that change
+// hands blend into an older image while a lens camera accumulates, so the split only moves
+// by whole steps.
+class HybridRaytracer : public Raytracer {
+public:
+    // device and threads are passed to OCLRaytracer and CPURaytracer
+    HybridRaytracer(entt::registry& registry, int width, int height, int treeWidth = 4,
+                    const std::string& device = "", int threads = 0);
+    void SetShadowMode(int shadowMode) override {
+        Encoder->SetShadowMode(shadowMode);
+    }
+    void Update() override;
+    void* RawData() override {
+        return &OutputData[0];
+    }
+    // Device times of the band in RawData(), see OCLRaytracer::GetFrameTiming()
+    const OCLRaytracer::FrameTiming& GetFrameTiming() const {
+        return Device.GetFrameTiming();
+    }
+    // Rows the device renders, from the top of the image
+    int GetSplit() const {
+        return Split;
+    }
+private:
+    void Balance(double deviceTime, double cpuTime);
+private:
+    std::shared_ptr<SceneEncoder> Encoder;
+    OCLRaytracer Device;
+    CPURaytracer Cpu;
+    int Width;
+    int Height;
+    int Split;
+    double DeviceShare = 0.5;   // smoothed share of the rows the device should get
+    std::vector<float> OutputData;
+};
@@ -141,6 +141,9 @@ public:
     float Dot(const Vector3& other) const {
         return X * other.X + Y * other.Y + Z * other.Z;
     }
+    Vector3 Cross(const Vector3& other) const {
+        return Vector3(Y * other.Z - Z * other.Y, Z * other.X - X * other.Z, X * other.Y - Y * other.X);
+    }
     Vector3 Reflect(const Vector3& normal) const {
         return (normal * normal.Dot(*this) * 2.0f - *this).Normalized();
     }
@@ -13,8 +13,9 @@
 
 #include <entt/entt.hpp>
 
+#include "raytracer_factory.hpp"
+#include "hybrid_raytracer.hpp"
 #include "opencl_raytracer.hpp"
-#include "metal_raytracer.hpp"
 #include "entities.hpp"
 
 
@@ -110,8 +111,20 @@ private:
     entt::registry& Registry;
 };
 
+// Device times of the frame just shown by an OpenCL or hybrid backend, null for the others
+static const OCLRaytracer::FrameTiming* GetFrameTiming(Raytracer& raytracer) {
+    if (OCLRaytracer* opencl = dynamic_cast<OCLRaytracer*>(&raytracer)) {
+        return &opencl->GetFrameTiming();
+    }
+    if (HybridRaytracer* hybrid = dynamic_cast<HybridRaytracer*>(&raytracer)) {
+        return &hybrid->GetFrameTiming();
+    }
+    return nullptr;
+}
+
 
-int main(void)
+// Usage: raytrace [cpu | metal | opencl | opencl:<device> | auto]
+int main(int argc, char** argv)
 {
     //RunLinmathTests();
 
@@ -179,8 +192,6 @@ int main(void)
 
     entt::registry registry;
 
-//    OCLRaytracer oclRaytracer(registry, WIDTH, HEIGHT);
-    MetalRaytracer metalRaytracer(registry, WIDTH, HEIGHT);
     Physics physics(registry);
 
 
@@ -201,6 +212,23 @@ int main(void)
         light.Power = 0.9f;
     }
 
+    {
+        auto entity = registry.create();
+        Transform& transform = registry.assign<Transform>(entity);
+        transform.Position = Vector3(0.0f, -6.0f, 5.0f);
+
+        ChessBoardRenderer& board = registry.assign<ChessBoardRenderer>(entity);
+        board.Size = Vector2(24.0f, 32.0f);
+        board.SecondColor = Color(0.4f, 0.3f, 0.2f);
+
+        Material& material = registry.assign<Material>(entity);
+        material.Color = Color(1.0f, 1.0f, 0.8f);
+        material.DiffuseCF = 0.9f;
+        material.AlbedoCF = Vector3(20.0f, 2.4f, 0.2f);
+        material.RefractCF = Vector2(0.0f, 0.0f);
+        material.ShadowQuality = 2;
+    }
+
 
     /*
 
@@ -319,30 +347,30 @@ int main(void)
         rigidBody.Velocity = Vector3(GetRandom() * 0.16 - 0.08, GetRandom() * 0.16 - 0.08, GetRandom() * 0.16 - 0.08);
     }
 
+    // calibrates on the scene above unless a backend is named
+    std::unique_ptr<Raytracer> raytracer = CreateRaytracer(registry, WIDTH, HEIGHT, argc > 1 ? argv[1] : "");
 
     GLuint tex;
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-//    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WIDTH, HEIGHT, 0, GL_RGB, GL_FLOAT, oclRaytracer.RawData());
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WIDTH, HEIGHT, 0, GL_RGB, GL_FLOAT, metalRaytracer.RawData());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WIDTH, HEIGHT, 0, GL_RGB, GL_FLOAT, raytracer->RawData());
 
     clock_t prevTime = clock();
     int frames = 0;
+    OCLRaytracer::FrameTiming deviceTime;     // summed over the frames of the second
 
     while (!glfwWindowShouldClose(window))
     {
         physics.Update();
-//        oclRaytracer.Update();
-        metalRaytracer.Update();
+        raytracer->Update();
 
         float ratio;
         int width, height;
 
         glBindTexture(GL_TEXTURE_2D, tex);
-//        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGB, GL_FLOAT, oclRaytracer.RawData());
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGB, GL_FLOAT, metalRaytracer.RawData());
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGB, GL_FLOAT, raytracer->RawData());
 
         glfwGetFramebufferSize(window, &width, &height);
         ratio = width / (float) height;
@@ -356,12 +384,24 @@ int main(void)
         glfwSwapBuffers(window);
         glfwPollEvents();
         frames += 1;
+        if (const OCLRaytracer::FrameTiming* timing = GetFrameTiming(*raytracer)) {
+            deviceTime.Upload += timing->Upload;
+            deviceTime.Kernel += timing->Kernel;
+            deviceTime.Readback += timing->Readback;
+        }
 
         clock_t currTime = clock();
         double elapsed = (double) (currTime - prevTime) / CLOCKS_PER_SEC;
         if (elapsed >= 1.0f) {
-            cout << "FPS: " << frames << "\n";
+            cout << "FPS: " << frames;
+            if (GetFrameTiming(*raytracer)) {
+                cout << ", device ms per frame: upload " << deviceTime.Upload / frames
+                     << ", kernel " << deviceTime.Kernel / frames
+                     << ", readback " << deviceTime.Readback / frames;
+            }
+            cout << "\n";
             frames = 0;
+            deviceTime = OCLRaytracer::FrameTiming();
             prevTime = currTime;
         }
     }
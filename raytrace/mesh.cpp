@@ -0,0 +1,106 @@
+#include "mesh.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+void Mesh::Build() {
+    int trianglesNumber = Indices.size() / 3;
+    std::vector<BVHPrimitive> primitives(trianglesNumber);
+    for (int i = 0; i < trianglesNumber; ++i) {
+        float min[3];
+        float max[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = max[axis] = Vertices[Indices[3 * i] * 3 + axis];
+            for (int k = 1; k < 3; ++k) {
+                float value = Vertices[Indices[3 * i + k] * 3 + axis];
+                min[axis] = std::min(min[axis], value);
+                max[axis] = std::max(max[axis], value);
+            }
+        }
+        primitives[i].Center = Vector3(0.5f * (min[0] + max[0]), 0.5f * (min[1] + max[1]), 0.5f * (min[2] + max[2]));
+        primitives[i].Extent = Vector3(0.5f * (max[0] - min[0]), 0.5f * (max[1] - min[1]), 0.5f * (max[2] - min[2]));
+    }
+
+    BVH tree;
+    tree.Build(primitives);
+    Nodes = tree.Nodes;
+
+    Packets.clear();
+    int packetsNumber = 0;
+    for (BVHNode& node: Nodes) {
+        if (node.Count == 0) {
+            continue;
+        }
+        Packets.resize((packetsNumber + 1) * PACKET_SIZE, 0.0f);
+        float* packet = &Packets[packetsNumber * PACKET_SIZE];
+        for (int lane = 0; lane < node.Count; ++lane) {
+            const int* triangle = &Indices[3 * tree.Indices[node.LeftOrFirst + lane]];
+            for (int axis = 0; axis < 3; ++axis) {
+                float v0 = Vertices[triangle[0] * 3 + axis];
+                packet[axis * PACKET_LANES + lane] = v0;
+                packet[(3 + axis) * PACKET_LANES + lane] = Vertices[triangle[1] * 3 + axis] - v0;
+                packet[(6 + axis) * PACKET_LANES + lane] = Vertices[triangle[2] * 3 + axis] - v0;
+            }
+        }
+        node.LeftOrFirst = packetsNumber++;
+    }
+}
+
+// Index of the vertex in a face token like "7", "7/1", "7//3" or "-2/1/3"
+static int ParseVertexIndex(const char* token, int verticesNumber) {
+    int idx = std::strtol(token, nullptr, 10);
+    idx = idx < 0 ? verticesNumber + idx : idx - 1;
+    if (idx < 0 || idx >= verticesNumber) {
+        throw std::runtime_error("wrong vertex index in face");
+    }
+    return idx;
+}
+
+std::shared_ptr<Mesh> LoadOBJ(const std::string& fileName) {
+    std::ifstream ifs(fileName);
+    if (!ifs.is_open()) {
+        throw std::runtime_error("failed to open " + fileName);
+    }
+
+    auto mesh = std::make_shared<Mesh>();
+    std::string line;
+    std::vector<int> face;
+    while (std::getline(ifs, line)) {
+        const char* str = line.c_str();
+        while (*str == ' ' || *str == '\t') {
+            ++str;
+        }
+        if (str[0] == 'v' && (str[1] == ' ' || str[1] == '\t')) {
+            char* end = const_cast<char*>(str + 1);
+            for (int axis = 0; axis < 3; ++axis) {
+                mesh->Vertices.push_back(std::strtof(end, &end));
+            }
+        } else if (str[0] == 'f' && (str[1] == ' ' || str[1] == '\t')) {
+            int verticesNumber = mesh->Vertices.size() / 3;
+            face.clear();
+            const char* token = str + 1;
+            while (true) {
+                while (*token == ' ' || *token == '\t') {
+                    ++token;
+                }
+                if (*token == '\0' || *token == '\r') {
+                    break;
+                }
+                face.push_back(ParseVertexIndex(token, verticesNumber));
+                while (*token != '\0' && *token != ' ' && *token != '\t') {
+                    ++token;
+                }
+            }
+            for (size_t i = 2; i < face.size(); ++i) {
+                mesh->Indices.push_back(face[0]);
+                mesh->Indices.push_back(face[i - 1]);
+                mesh->Indices.push_back(face[i]);
+            }
+        }
+    }
+
+    mesh->Build();
+    return mesh;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bvh.hpp"
+
+// Triangle mesh in object space with its own BVH.
+//
+// Build() repacks the triangles in leaf order, one packet per leaf, so that a
+// leaf is tested in a single SIMD pass. Packet layout, PACKET_LANES floats per
+// row with one lane per triangle:
+//  v0 x, y, z, edge1 x, y, z, edge2 x, y, z
+// Unused lanes have zero edges and never report a hit.
+class Mesh {
+public:
+    static const int PACKET_LANES = BVH::MAX_LEAF_SIZE;
+    static const int PACKET_SIZE = 9 * PACKET_LANES;
+
+    void Build();
+public:
+    std::vector<float> Vertices;    // x, y, z per vertex
+    std::vector<int> Indices;       // three vertices per triangle
+    std::vector<BVHNode> Nodes;     // leaves address packets: LeftOrFirst is the packet index
+    std::vector<float> Packets;
+};
+
+// Streams vertices and faces of a Wavefront OBJ file, polygons are split into triangle fans.
+// The returned mesh is already built.
+std::shared_ptr<Mesh> LoadOBJ(const std::string& fileName);
@@ -586,13 +586,43 @@ static inline void vec3_refract(vec3 r, vec3 base, vec3 norm, float cf) {
 
 
 
-#define SPHERES_SIZE 13;
+#define SPHERES_SIZE 13
+#define NODE_SIZE 8
+#define BVH_STACK_SIZE 64       // SceneEncoder::STACK_SIZE, deeper trees are refused by the encoder
+#define GRID_HEADER_SIZE 9
+#define GRID 1
+#define SHAPE_SIZE 25
+#define SHAPE_BOARD 1
+#define MESH_SIZE 25
+#define LIGHT_SIZE 6
+#define SHADOW_CONES 1
+#define PACKET_LANES 4
+#define PACKET_SIZE (9 * PACKET_LANES)
+#define TRIANGLE_EPSILON 1e-7f
+#define EDGE_EPSILON 1e-5f
+
+typedef struct Tree {
+    int NodesIdx;
+    int NodesNumber;
+    int SpheresIdx;
+} Tree;
 
 typedef struct Scene {
     vec3 CameraPos;
-    vec3 LightPos;
+    int LightsIdx;
+    int GlobalLightsNumber;
+    int LocalLightsNumber;
+    int LightNodesIdx;
     int SpheresNumber;
-    int SpheresIdx;
+    int TreeWidth;
+    Tree StaticTree;
+    Tree DynamicTree;
+    int ShapesIdx;
+    int ShapesNumber;
+    int MeshesIdx;
+    int MeshesNumber;
+    int MeshNodesIdx;
+    int ShadowMode;
     const device float* Input;
 } Scene;
 
@@ -607,8 +637,17 @@ typedef struct Color {
     float B;
 } Color;
 
+// Shadow cone from a shading point to a light disk
+typedef struct Cone {
+    vec3 Apex;
+    vec3 Dir;
+    float Length;       // distance to the light
+    float Angle;        // half angle of the light disk
+    float Slope;        // radius of the cone per unit of length
+} Cone;
 
-float IntersectSphere(thread Scene* scene, int sphereIdx, Ray ray, const device float** material, vec3 normal)
+
+float IntersectSphere(thread Scene* scene, int sphereIdx, Ray ray)
 {
     vec3 spherePos = {scene->Input[sphereIdx + 0], scene->Input[sphereIdx + 1], scene->Input[sphereIdx + 2]};
     float sphereRadius = scene->Input[sphereIdx + 3];
@@ -636,57 +675,386 @@ float IntersectSphere(thread Scene* scene, int sphereIdx, Ray ray, const device
     if (dist <= 0) {
         return -1.0f;
     }
+    return dist;
+}
 
-    vec3 dirToPoint;
-    vec3_scale(dirToPoint, ray.Dir, dist);
+bool IntersectBox(thread Scene* scene, int nodeIdx, Ray ray, vec3 invDir, float maxDist) {
+    float tMin = 0.0f;
+    float tMax = maxDist < 0.0f ? INFINITY : maxDist;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (scene->Input[nodeIdx + i] - ray.From[i]) * invDir[i];
+        float t2 = (scene->Input[nodeIdx + 3 + i] - ray.From[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    return tMin <= tMax;
+}
 
-    vec3 point;
-    vec3_add(point, ray.From, dirToPoint);
+void IntersectTree(thread Scene* scene, Tree tree, Ray ray, vec3 invDir, thread float* bestDistance, thread int* bestSphere) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-    vec3 normDir;
-    vec3_sub(normDir, point, spherePos);
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
 
-    vec3_norm(normal, normDir);
-    *material = &scene->Input[sphereIdx + 4];
+    while (stackSize > 0) {
+        int nodeIdx = tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, ray, invDir, *bestDistance)) {
+            continue;
+        }
 
-    return dist;
+        int leftOrFirst = as_type<int>(scene->Input[nodeIdx + 6]);
+        int count = as_type<int>(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            int sphereIdx = tree.SpheresIdx + i * SPHERES_SIZE;
+            float currDist = IntersectSphere(scene, sphereIdx, ray);
+            if (currDist <= 0.0f) {
+                continue;
+            }
+            if (*bestDistance < 0.0f || currDist < *bestDistance) {
+                *bestDistance = currDist;
+                *bestSphere = sphereIdx;
+            }
+        }
+    }
 }
 
-void Intersect(thread Scene* scene, Ray ray, thread float* distance, const device float** material, vec3 normal) {
-    float bestDistance = -1.0f;
-    vec3 bestNormal;
-    bestNormal[0] = 0;
-    bestNormal[1] = 0;
-    bestNormal[2] = 0;
-    vec3 currNormal;
-    for (int i = 0; i < scene->SpheresNumber; ++i) {
-        int sphereIdx = scene->SpheresIdx + i * SPHERES_SIZE;
-        const device float* currMaterial;
-        float currDist = IntersectSphere(scene, sphereIdx, ray, &currMaterial, currNormal);
+// 3D-DDA walk through the cells of a uniform grid, see uniform_grid.hpp for the layout
+void IntersectGrid(thread Scene* scene, Tree tree, Ray ray, vec3 invDir, thread float* bestDistance, thread int* bestSphere) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const device float* grid = scene->Input + tree.NodesIdx;
+    const device float* cellStarts = grid + GRID_HEADER_SIZE;
+    const device float* indices = cellStarts + tree.NodesNumber + 1;
+    int dims[3] = {as_type<int>(grid[6]), as_type<int>(grid[7]), as_type<int>(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = *bestDistance < 0.0f ? INFINITY : *bestDistance;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - ray.From[i]) * invDir[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - ray.From[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
+
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = ray.From[i] + ray.Dir[i] * tMin;
+        cell[i] = clamp((int)((p - grid[i]) / grid[3 + i]), 0, dims[i] - 1);
+        step[i] = ray.Dir[i] < 0.0f ? -1 : 1;
+        if (ray.Dir[i] == 0.0f) {
+            tNext[i] = INFINITY;
+            tDelta[i] = INFINITY;
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - ray.From[i]) * invDir[i];
+        tDelta[i] = grid[3 + i] * fabs(invDir[i]);
+    }
+
+    while (true) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = as_type<int>(cellStarts[cellIdx]); i < as_type<int>(cellStarts[cellIdx + 1]); ++i) {
+            int sphereIdx = tree.SpheresIdx + as_type<int>(indices[i]) * SPHERES_SIZE;
+            float currDist = IntersectSphere(scene, sphereIdx, ray);
+            if (currDist <= 0.0f) {
+                continue;
+            }
+            if (*bestDistance < 0.0f || currDist < *bestDistance) {
+                *bestDistance = currDist;
+                *bestSphere = sphereIdx;
+            }
+        }
+
+        // a sphere spans several cells, so a hit only ends the walk before the exit of the current cell
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        float tExit = tNext[axis];
+        if ((*bestDistance >= 0.0f && *bestDistance <= tExit) || tExit > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+float IntersectShape(thread Scene* scene, int shapeIdx, Ray ray) {
+    const device float* shape = scene->Input + shapeIdx;
+
+    if (as_type<int>(shape[0]) == SHAPE_BOARD) {
+        float dist = (shape[2] - ray.From[1]) / ray.Dir[1];
+        if (!(dist > 0.0f)) {
+            return -1.0f;
+        }
+        float x = ray.From[0] + ray.Dir[0] * dist;
+        float z = ray.From[2] + ray.Dir[2] * dist;
+        if (fabs(x - shape[1]) > 0.5f * shape[4] || fabs(z - shape[3]) > 0.5f * shape[5]) {
+            return -1.0f;
+        }
+        return dist;
+    }
+
+    float tNear = -INFINITY;
+    float tFar = INFINITY;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (shape[1 + i] - 0.5f * shape[4 + i] - ray.From[i]) / ray.Dir[i];
+        float t2 = (shape[1 + i] + 0.5f * shape[4 + i] - ray.From[i]) / ray.Dir[i];
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+    if (tNear > tFar || tFar <= 0.0f) {
+        return -1.0f;
+    }
+    return tNear > 0.0f ? tNear : tFar;
+}
+
+void IntersectShapes(thread Scene* scene, Ray ray, thread float* bestDistance, thread int* bestShape) {
+    for (int i = 0; i < scene->ShapesNumber; ++i) {
+        int shapeIdx = scene->ShapesIdx + i * SHAPE_SIZE;
+        float currDist = IntersectShape(scene, shapeIdx, ray);
         if (currDist <= 0.0f) {
             continue;
         }
-        if (bestDistance < 0.0f || currDist < bestDistance) {
-            bestDistance = currDist;
-            vec3_set(bestNormal, currNormal);
-            *material = currMaterial;
+        if (*bestDistance < 0.0f || currDist < *bestDistance) {
+            *bestDistance = currDist;
+            *bestShape = shapeIdx;
         }
     }
-    *distance = bestDistance;
-    vec3_set(normal, bestNormal);
 }
 
-bool IntersectAnything(thread Scene* scene, Ray ray) {
-    float distance;
-    vec3 normal;
-    const device float* material = 0;
-    Intersect(scene, ray, &distance, &material, normal);
-    return distance > 0;
+void GetShapeAttributes(thread Scene* scene, int shapeIdx, Ray ray, float distance, const device float** material, vec3 normal) {
+    const device float* shape = scene->Input + shapeIdx;
+    vec3 point;
+    vec3_scale(point, ray.Dir, distance);
+    vec3_add(point, ray.From, point);
+
+    normal[0] = 0;
+    normal[1] = 0;
+    normal[2] = 0;
+
+    if (as_type<int>(shape[0]) == SHAPE_BOARD) {
+        normal[1] = ray.From[1] > shape[2] ? 1.0f : -1.0f;
+        int tiles = (int)floor(point[0] / shape[6]) + (int)floor(point[2] / shape[6]);
+        *material = shape + ((tiles & 1) ? 16 : 7);
+        return;
+    }
+
+    // the face is on the axis where the point is relatively furthest from the center
+    vec3 local;
+    for (int i = 0; i < 3; ++i) {
+        local[i] = (point[i] - shape[1 + i]) / shape[4 + i];
+    }
+    int axis = fabs(local[0]) > fabs(local[1]) ? 0 : 1;
+    axis = fabs(local[axis]) > fabs(local[2]) ? axis : 2;
+    normal[axis] = local[axis] > 0.0f ? 1.0f : -1.0f;
+    *material = shape + 7;
+}
+
+// Möller–Trumbore against the triangle lanes of a packet, one at a time
+void IntersectPacket(thread Scene* scene, int packetIdx, Ray ray, thread float* bestDistance, thread int* bestTriangle) {
+    for (int lane = 0; lane < PACKET_LANES; ++lane) {
+        const device float* v0 = scene->Input + packetIdx + lane;
+        vec3 e1 = {v0[3 * PACKET_LANES], v0[4 * PACKET_LANES], v0[5 * PACKET_LANES]};
+        vec3 e2 = {v0[6 * PACKET_LANES], v0[7 * PACKET_LANES], v0[8 * PACKET_LANES]};
+        vec3 p;
+        vec3_mul_cross(p, ray.Dir, e2);
+        float det = vec3_mul_inner(e1, p);
+        if (fabs(det) <= TRIANGLE_EPSILON) {
+            continue;
+        }
+        float invDet = 1.0f / det;
+        vec3 t = {ray.From[0] - v0[0], ray.From[1] - v0[PACKET_LANES], ray.From[2] - v0[2 * PACKET_LANES]};
+        float u = vec3_mul_inner(t, p) * invDet;
+        vec3 q;
+        vec3_mul_cross(q, t, e1);
+        float v = vec3_mul_inner(ray.Dir, q) * invDet;
+        float dist = vec3_mul_inner(e2, q) * invDet;
+        if (u < -EDGE_EPSILON || v < -EDGE_EPSILON || u + v > 1.0f + EDGE_EPSILON || dist <= TRIANGLE_EPSILON) {
+            continue;
+        }
+        if (*bestDistance < 0.0f || dist < *bestDistance) {
+            *bestDistance = dist;
+            *bestTriangle = packetIdx + lane;
+        }
+    }
+}
+
+// Mesh trees live in object space: the ray is moved, rotated and scaled into it. The direction
+// keeps its length, so object space distances are world ones divided by the scale.
+void IntersectInstance(thread Scene* scene, int instanceIdx, Ray ray, thread float* bestDistance, thread int* bestTriangle, thread int* bestMesh) {
+    const device float* instance = scene->Input + instanceIdx;
+    int nodesIdx = as_type<int>(instance[0]);
+    int packetsIdx = as_type<int>(instance[2]);
+    float scale = instance[6];
+    const device float* r = instance + 7;
+    vec3 from;
+    for (int k = 0; k < 3; ++k) {
+        from[k] = (ray.From[k] - instance[3 + k]) / scale;
+    }
+    Ray localRay;
+    for (int k = 0; k < 3; ++k) {
+        localRay.From[k] = r[k] * from[0] + r[3 + k] * from[1] + r[6 + k] * from[2];
+        localRay.Dir[k] = r[k] * ray.Dir[0] + r[3 + k] * ray.Dir[1] + r[6 + k] * ray.Dir[2];
+    }
+    vec3 invDir = {1.0f / localRay.Dir[0], 1.0f / localRay.Dir[1], 1.0f / localRay.Dir[2]};
+    float localDistance = *bestDistance < 0.0f ? -1.0f : *bestDistance / scale;
+    int triangle = -1;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        int nodeIdx = nodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, localRay, invDir, localDistance)) {
+            continue;
+        }
+        int leftOrFirst = as_type<int>(scene->Input[nodeIdx + 6]);
+        int count = as_type<int>(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        IntersectPacket(scene, packetsIdx + leftOrFirst * PACKET_SIZE, localRay, &localDistance, &triangle);
+    }
+
+    if (triangle >= 0) {
+        *bestDistance = localDistance * scale;
+        *bestTriangle = triangle;
+        *bestMesh = instanceIdx;
+    }
+}
+
+// Top level tree over the instances in world space, its leaves address instance records
+void IntersectMeshes(thread Scene* scene, Ray ray, vec3 invDir, thread float* bestDistance, thread int* bestTriangle, thread int* bestMesh) {
+    if (scene->MeshesNumber == 0) {
+        return;
+    }
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        int nodeIdx = scene->MeshNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, ray, invDir, *bestDistance)) {
+            continue;
+        }
+        int leftOrFirst = as_type<int>(scene->Input[nodeIdx + 6]);
+        int count = as_type<int>(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            IntersectInstance(scene, scene->MeshesIdx + i * MESH_SIZE, ray, bestDistance, bestTriangle, bestMesh);
+        }
+    }
+}
+
+void GetMeshAttributes(thread Scene* scene, int triangleIdx, int meshIdx, Ray ray, const device float** material, vec3 normal) {
+    // triangleIdx is the v0 x of the triangle lane, the edges follow every PACKET_LANES floats
+    const device float* lane = scene->Input + triangleIdx;
+    vec3 e1 = {lane[3 * PACKET_LANES], lane[4 * PACKET_LANES], lane[5 * PACKET_LANES]};
+    vec3 e2 = {lane[6 * PACKET_LANES], lane[7 * PACKET_LANES], lane[8 * PACKET_LANES]};
+    vec3 faceNormal;
+    vec3_mul_cross(faceNormal, e1, e2);
+    // back to world space, the rotation rows follow position and scale in the instance record
+    const device float* r = scene->Input + meshIdx + 7;
+    vec3 world;
+    for (int k = 0; k < 3; ++k) {
+        world[k] = r[3 * k] * faceNormal[0] + r[3 * k + 1] * faceNormal[1] + r[3 * k + 2] * faceNormal[2];
+    }
+    vec3_norm(normal, world);
+    if (vec3_mul_inner(normal, ray.Dir) > 0.0f) {
+        vec3_scale(normal, normal, -1.0f);
+    }
+    *material = scene->Input + meshIdx + 16;
+}
+
+// Closest hit as distance and primitive offset only, normal and material are left to the caller.
+// For a triangle hit meshIdx is the instance record and primitiveIdx the triangle lane.
+// maxDistance bounds the search, as if something had already been hit there.
+float IntersectClosest(thread Scene* scene, Ray ray, float maxDistance, thread int* primitiveIdx, thread int* meshIdx) {
+    // shapes go first, a floor hit then bounds the tree traversal. Meshes go last: sphere and
+    // shape hits do not clear meshIdx, a triangle must only be kept when nothing closer was found.
+    float bestDistance = maxDistance;
+    *primitiveIdx = -1;
+    *meshIdx = -1;
+    IntersectShapes(scene, ray, &bestDistance, primitiveIdx);
+
+    vec3 invDir = {1.0f / ray.Dir[0], 1.0f / ray.Dir[1], 1.0f / ray.Dir[2]};
+    if (scene->TreeWidth == GRID) {
+        IntersectGrid(scene, scene->StaticTree, ray, invDir, &bestDistance, primitiveIdx);
+        IntersectGrid(scene, scene->DynamicTree, ray, invDir, &bestDistance, primitiveIdx);
+    } else {
+        IntersectTree(scene, scene->StaticTree, ray, invDir, &bestDistance, primitiveIdx);
+        IntersectTree(scene, scene->DynamicTree, ray, invDir, &bestDistance, primitiveIdx);
+    }
+    IntersectMeshes(scene, ray, invDir, &bestDistance, primitiveIdx, meshIdx);
+    return bestDistance;
+}
+
+void Intersect(thread Scene* scene, Ray ray, thread float* distance, const device float** material, vec3 normal) {
+    int primitiveIdx;
+    int meshIdx;
+    *distance = IntersectClosest(scene, ray, -1.0f, &primitiveIdx, &meshIdx);
+    if (*distance < 0.0f) {
+        normal[0] = 0;
+        normal[1] = 0;
+        normal[2] = 0;
+        return;
+    }
+    if (meshIdx >= 0) {
+        GetMeshAttributes(scene, primitiveIdx, meshIdx, ray, material, normal);
+        return;
+    }
+    // shapes are stored after all spheres
+    if (primitiveIdx >= scene->ShapesIdx) {
+        GetShapeAttributes(scene, primitiveIdx, ray, *distance, material, normal);
+        return;
+    }
+    int sphereIdx = primitiveIdx;
+
+    vec3 spherePos = {scene->Input[sphereIdx + 0], scene->Input[sphereIdx + 1], scene->Input[sphereIdx + 2]};
+    vec3 dirToPoint;
+    vec3_scale(dirToPoint, ray.Dir, *distance);
+    vec3 point;
+    vec3_add(point, ray.From, dirToPoint);
+    vec3 normDir;
+    vec3_sub(normDir, point, spherePos);
+    vec3_norm(normal, normDir);
+    *material = &scene->Input[sphereIdx + 4];
+}
+
+// Only hits closer than maxDistance count, e.g. the light itself
+bool IntersectAnything(thread Scene* scene, Ray ray, float maxDistance) {
+    int primitiveIdx;
+    int meshIdx;
+    IntersectClosest(scene, ray, maxDistance, &primitiveIdx, &meshIdx);
+    return primitiveIdx >= 0;
 }
 
-float GetShadow(thread Scene* scene, Ray ray, int shadowQuality) {
+float GetShadow(thread Scene* scene, Ray ray, float maxDistance, int shadowQuality) {
     if (shadowQuality == 0) {
-        return (float)(!IntersectAnything(scene, ray));
+        return (float)(!IntersectAnything(scene, ray, maxDistance));
     }
 
     int num = 0;
@@ -701,7 +1069,7 @@ float GetShadow(thread Scene* scene, Ray ray, int shadowQuality) {
 
             currRay.From[0] += 0.05f * i;
             currRay.From[1] += 0.05f * j;
-            if (IntersectAnything(scene, currRay)) {
+            if (IntersectAnything(scene, currRay, maxDistance)) {
                 ++num;
             }
             ++total;
@@ -711,43 +1079,240 @@ float GetShadow(thread Scene* scene, Ray ray, int shadowQuality) {
     return 1.0f - (float(num) / float(total));
 }
 
+// 1 - cos(angle), without the cancellation of small angles
+float GetCap(float angle) {
+    float s = sin(0.5f * angle);
+    return 2.0f * s * s;
+}
 
+// Part of the light disk hidden by a sphere: the overlap of the light cone with the cone
+// around the sphere, with a smoothstep fit of the cap intersection for partial overlaps
+float GetSphereOcclusion(thread Scene* scene, thread Cone* cone, int sphereIdx) {
+    vec3 toSphere = {scene->Input[sphereIdx + 0] - cone->Apex[0], scene->Input[sphereIdx + 1] - cone->Apex[1], scene->Input[sphereIdx + 2] - cone->Apex[2]};
+    float radius = scene->Input[sphereIdx + 3];
+    float distance = vec3_len(toSphere);
+    if (distance <= radius) {
+        return 1.0f;
+    }
+    if (distance - radius > cone->Length) {
+        return 0.0f;
+    }
+    float sphereAngle = asin(radius / distance);
+    float angle = acos(clamp(vec3_mul_inner(toSphere, cone->Dir) / distance, -1.0f, 1.0f));
+    if (angle >= sphereAngle + cone->Angle) {
+        return 0.0f;
+    }
+    float lightCap = GetCap(cone->Angle);
+    if (lightCap <= 0.0f) {
+        return 1.0f;
+    }
+    float overlap = min(1.0f, GetCap(sphereAngle) / lightCap);
+    float inner = fabs(sphereAngle - cone->Angle);
+    if (angle <= inner) {
+        return overlap;
+    }
+    float x = (sphereAngle + cone->Angle - angle) / (sphereAngle + cone->Angle - inner);
+    return overlap * x * x * (3.0f - 2.0f * x);
+}
 
+void OccludeLeaf(thread Scene* scene, Tree tree, int first, int count, thread Cone* cone, thread float* visibility) {
+    for (int i = first; i < first + count; ++i) {
+        *visibility = min(*visibility, 1.0f - GetSphereOcclusion(scene, cone, tree.SpheresIdx + i * SPHERES_SIZE));
+    }
+}
 
-Color GetColor3(thread Scene* scene, Ray ray, float distance, const device float* material, vec3 normal, int depth) {
-    vec3 dirToCam;
-    vec3_scale(dirToCam, ray.Dir, -1.0f);
+// Occluders are gathered with the cone axis against boxes grown by the cone radius
+// at their far end along the axis, which finds every box the cone touches
+bool IntersectConeBox(thread Cone* cone, vec3 invDir, vec3 lo, vec3 hi) {
+    float far = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        far += max((lo[i] - cone->Apex[i]) * cone->Dir[i], (hi[i] - cone->Apex[i]) * cone->Dir[i]);
+    }
+    float radius = cone->Slope * clamp(far, 0.0f, cone->Length);
+
+    float tMin = 0.0f;
+    float tMax = cone->Length;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (lo[i] - radius - cone->Apex[i]) * invDir[i];
+        float t2 = (hi[i] + radius - cone->Apex[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    return tMin <= tMax;
+}
 
-    vec3 dirToPoint;
-    vec3_scale(dirToPoint, ray.Dir, distance);
-    vec3 point;
-    vec3_add(point, ray.From, dirToPoint);
+void OccludeTree(thread Scene* scene, Tree tree, thread Cone* cone, vec3 invDir, thread float* visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-    Color color;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
 
-    color.R = 0;
-    color.G = 0;
-    color.B = 0;
+    while (stackSize > 0 && *visibility > 0.0f) {
+        const device float* node = scene->Input + tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        vec3 lo = {node[0], node[1], node[2]};
+        vec3 hi = {node[3], node[4], node[5]};
+        if (!IntersectConeBox(cone, invDir, lo, hi)) {
+            continue;
+        }
 
-    vec3 dirToLight;
-    vec3_sub(dirToLight, scene->LightPos, point);
+        int leftOrFirst = as_type<int>(node[6]);
+        int count = as_type<int>(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        OccludeLeaf(scene, tree, leftOrFirst, count, cone, visibility);
+    }
+}
 
-    vec3 dirToLightNorm;
-    vec3_norm(dirToLightNorm, dirToLight);
+// Only the cells along the cone axis are visited, so a sphere that stays out of
+// them loses the outer part of its penumbra
+void OccludeGrid(thread Scene* scene, Tree tree, thread Cone* cone, vec3 invDir, thread float* visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
+
+    const device float* grid = scene->Input + tree.NodesIdx;
+    const device float* cellStarts = grid + GRID_HEADER_SIZE;
+    const device float* indices = cellStarts + tree.NodesNumber + 1;
+    int dims[3] = {as_type<int>(grid[6]), as_type<int>(grid[7]), as_type<int>(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = cone->Length;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - cone->Apex[i]) * invDir[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - cone->Apex[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
+
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = cone->Apex[i] + cone->Dir[i] * tMin;
+        cell[i] = clamp((int)((p - grid[i]) / grid[3 + i]), 0, dims[i] - 1);
+        step[i] = cone->Dir[i] < 0.0f ? -1 : 1;
+        if (cone->Dir[i] == 0.0f) {
+            tNext[i] = INFINITY;
+            tDelta[i] = INFINITY;
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - cone->Apex[i]) * invDir[i];
+        tDelta[i] = grid[3 + i] * fabs(invDir[i]);
+    }
+
+    // spheres spanning several cells are seen more than once, which min() does not mind
+    while (*visibility > 0.0f) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = as_type<int>(cellStarts[cellIdx]); i < as_type<int>(cellStarts[cellIdx + 1]); ++i) {
+            OccludeLeaf(scene, tree, as_type<int>(indices[i]), 1, cone, visibility);
+        }
+
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (tNext[axis] > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+// Soft shadow of a light disk of radius light[5] at about the cost of one shadow ray.
+// Spheres occlude analytically, boards, boxes and meshes cast hard shadows along the cone axis.
+float GetConeShadow(thread Scene* scene, const device float* light, vec3 point) {
+    vec3 dirToLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+    float lightDistance = vec3_len(dirToLight);
+    Cone cone;
+    vec3_scale(cone.Dir, dirToLight, 1.0f / lightDistance);
+    vec3_scale(cone.Apex, cone.Dir, 0.5f);
+    vec3_add(cone.Apex, point, cone.Apex);
+    cone.Length = lightDistance - 0.5f;
+    cone.Slope = light[5] / lightDistance;
+    cone.Angle = atan(cone.Slope);
+
+    Ray ray;
+    vec3_set(ray.From, cone.Apex);
+    vec3_set(ray.Dir, cone.Dir);
+    vec3 invDir = {1.0f / ray.Dir[0], 1.0f / ray.Dir[1], 1.0f / ray.Dir[2]};
+    float bestDistance = cone.Length;
+    int primitiveIdx = -1;
+    int meshIdx = -1;
+    IntersectShapes(scene, ray, &bestDistance, &primitiveIdx);
+    IntersectMeshes(scene, ray, invDir, &bestDistance, &primitiveIdx, &meshIdx);
+    if (primitiveIdx >= 0) {
+        return 0.0f;
+    }
+
+    float visibility = 1.0f;
+    if (scene->TreeWidth == GRID) {
+        OccludeGrid(scene, scene->StaticTree, &cone, invDir, &visibility);
+        OccludeGrid(scene, scene->DynamicTree, &cone, invDir, &visibility);
+    } else {
+        OccludeTree(scene, scene->StaticTree, &cone, invDir, &visibility);
+        OccludeTree(scene, scene->DynamicTree, &cone, invDir, &visibility);
+    }
+    return max(0.0f, visibility);
+}
+
+
+// Light power left at the given distance, local lights fade out smoothly to zero at their radius
+float GetLightPower(const device float* light, float distance) {
+    if (light[4] <= 0.0f) {
+        return light[3];
+    }
+    float x = distance / light[4];
+    float window = max(0.0f, 1.0f - x * x);
+    return light[3] * window * window;
+}
 
-    Ray rayToLight;
-    vec3_scale(rayToLight.From, dirToLightNorm, 0.001f);
-    vec3_add(rayToLight.From, point, rayToLight.From);
-    vec3_set(rayToLight.Dir, dirToLightNorm);
+// Diffuse and specular part of one light, shadowQuality < 0 skips the shadows and cone
+// shadows ignore the quality.
+// visibility keeps the best shadow factor over the lights.
+void AddLight(thread Scene* scene, const device float* light, vec3 point, vec3 normal, vec3 dirToCam,
+              const device float* material, int shadowQuality, thread Color* color, thread float* visibility) {
+    vec3 dirToLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+    float lightDistance = vec3_len(dirToLight);
+
+    vec3 dirToLightNorm;
+    vec3_scale(dirToLightNorm, dirToLight, 1.0f / lightDistance);
+
+    float shadow = 1.0f;
+    if (shadowQuality >= 0 && scene->ShadowMode == SHADOW_CONES) {
+        shadow = GetConeShadow(scene, light, point);
+    } else if (shadowQuality >= 0) {
+        Ray rayToLight;
+        vec3_scale(rayToLight.From, dirToLightNorm, 0.5f);
+        vec3_add(rayToLight.From, point, rayToLight.From);
+        vec3_set(rayToLight.Dir, dirToLightNorm);
+        shadow = GetShadow(scene, rayToLight, lightDistance - 0.5f, shadowQuality);
+    }
+    *visibility = max(*visibility, shadow);
+    float lightPower = GetLightPower(light, lightDistance) * shadow;
+    if (shadow <= 0.01f || lightPower <= 0.0f) {
+        return;
+    }
 
     float dp = 0;
     dp = vec3_mul_inner(dirToLightNorm, normal);
 
     float diffuseCF = material[3];
     if (dp > 0) {
-        color.R += dp * diffuseCF * material[0];
-        color.G += dp * diffuseCF * material[1];
-        color.B += dp * diffuseCF * material[2];
+        color->R += dp * diffuseCF * material[0] * lightPower;
+        color->G += dp * diffuseCF * material[1] * lightPower;
+        color->B += dp * diffuseCF * material[2] * lightPower;
     }
 
     vec3 refl;
@@ -755,16 +1320,72 @@ Color GetColor3(thread Scene* scene, Ray ray, float distance, const device float
 
     dp = vec3_mul_inner(refl, dirToCam);
 
-    float lightPower = 0.9f;
     float albedoCF1 = material[4];
     float albedoCF2 = material[5];
 
     if (dp > 0) {
         dp = pow(dp, albedoCF1);
-        color.R += dp * lightPower * albedoCF2;
-        color.G += dp * lightPower * albedoCF2;
-        color.B += dp * lightPower * albedoCF2;
+        color->R += dp * lightPower * albedoCF2;
+        color->G += dp * lightPower * albedoCF2;
+        color->B += dp * lightPower * albedoCF2;
     }
+}
+
+// All global lights, then the local lights found in the light tree whose influence sphere holds the point
+void AddLights(thread Scene* scene, vec3 point, vec3 normal, vec3 dirToCam, const device float* material, int shadowQuality, thread Color* color, thread float* visibility) {
+    for (int i = 0; i < scene->GlobalLightsNumber; ++i) {
+        AddLight(scene, scene->Input + scene->LightsIdx + i * LIGHT_SIZE, point, normal, dirToCam, material, shadowQuality, color, visibility);
+    }
+    if (scene->LocalLightsNumber == 0) {
+        return;
+    }
+
+    const device float* localLights = scene->Input + scene->LightsIdx + scene->GlobalLightsNumber * LIGHT_SIZE;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const device float* node = scene->Input + scene->LightNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (point[0] < node[0] || point[1] < node[1] || point[2] < node[2] ||
+            point[0] > node[3] || point[1] > node[4] || point[2] > node[5]) {
+            continue;
+        }
+        int leftOrFirst = as_type<int>(node[6]);
+        int count = as_type<int>(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            const device float* light = localLights + i * LIGHT_SIZE;
+            vec3 toLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+            if (vec3_mul_inner(toLight, toLight) < light[4] * light[4]) {
+                AddLight(scene, light, point, normal, dirToCam, material, shadowQuality, color, visibility);
+            }
+        }
+    }
+}
+
+
+
+Color GetColor3(thread Scene* scene, Ray ray, float distance, const device float* material, vec3 normal, int depth) {
+    vec3 dirToCam;
+    vec3_scale(dirToCam, ray.Dir, -1.0f);
+
+    vec3 dirToPoint;
+    vec3_scale(dirToPoint, ray.Dir, distance);
+    vec3 point;
+    vec3_add(point, ray.From, dirToPoint);
+
+    Color color;
+
+    color.R = 0;
+    color.G = 0;
+    color.B = 0;
+
+    float visibility = -1.0f;
+    AddLights(scene, point, normal, dirToCam, material, -1, &color, &visibility);
     return color;
 }
 
@@ -803,17 +1424,6 @@ Color GetColor2(thread Scene* scene, Ray ray, float distance, const device float
     color.G = 0;
     color.B = 0;
 
-    vec3 dirToLight;
-    vec3_sub(dirToLight, scene->LightPos, point);
-
-    vec3 dirToLightNorm;
-    vec3_norm(dirToLightNorm, dirToLight);
-
-    Ray rayToLight;
-    vec3_scale(rayToLight.From, dirToLightNorm, 0.001f);
-    vec3_add(rayToLight.From, point, rayToLight.From);
-    vec3_set(rayToLight.Dir, dirToLightNorm);
-
     if (depth > 0) {
         vec3 reflDir;
         vec3_reflect2(reflDir, dirToCam, normal);
@@ -849,31 +1459,8 @@ Color GetColor2(thread Scene* scene, Ray ray, float distance, const device float
     }
 
 
-    float dp = 0;
-    dp = vec3_mul_inner(dirToLightNorm, normal);
-
-    float diffuseCF = material[3];
-    if (dp > 0) {
-        color.R += dp * diffuseCF * material[0];
-        color.G += dp * diffuseCF * material[1];
-        color.B += dp * diffuseCF * material[2];
-    }
-
-    vec3 refl;
-    vec3_reflect2(refl, dirToLightNorm, normal);
-
-    dp = vec3_mul_inner(refl, dirToCam);
-
-    float lightPower = 0.9f;
-    float albedoCF1 = material[4];
-    float albedoCF2 = material[5];
-
-    if (dp > 0) {
-        dp = pow(dp, albedoCF1);
-        color.R += dp * lightPower * albedoCF2;
-        color.G += dp * lightPower * albedoCF2;
-        color.B += dp * lightPower * albedoCF2;
-    }
+    float visibility = -1.0f;
+    AddLights(scene, point, normal, dirToCam, material, -1, &color, &visibility);
     return color;
 }
 
@@ -909,18 +1496,11 @@ Color GetColor(thread Scene* scene, Ray ray, float distance, const device float*
     color.G = 0.1;
     color.B = 0.1;
 
-    vec3 dirToLight;
-    vec3_sub(dirToLight, scene->LightPos, point);
-
-    vec3 dirToLightNorm;
-    vec3_norm(dirToLightNorm, dirToLight);
+    // reflections fade with the best lit light, so points that no light reaches keep them
+    float visibility = -1.0f;
+    AddLights(scene, point, normal, dirToCam, material, 2, &color, &visibility);
 
-    Ray rayToLight;
-    vec3_scale(rayToLight.From, dirToLightNorm, 0.5f);
-    vec3_add(rayToLight.From, point, rayToLight.From);
-    vec3_set(rayToLight.Dir, dirToLightNorm);
-
-    float shadow = GetShadow(scene, rayToLight, 2);
+    float shadow = visibility < 0.0f ? 1.0f : visibility;
     if (shadow <= 0.01f) {
         return color;
     }
@@ -959,32 +1539,6 @@ Color GetColor(thread Scene* scene, Ray ray, float distance, const device float*
         color.B += refrColor.B * material[7] * shadow;
     }
 
-    float dp = 0;
-    dp = vec3_mul_inner(dirToLightNorm, normal);
-
-    float diffuseCF = material[3];
-    if (dp > 0) {
-        color.R += dp * diffuseCF * material[0] * shadow;
-        color.G += dp * diffuseCF * material[1] * shadow;
-        color.B += dp * diffuseCF * material[2] * shadow;
-    }
-
-    vec3 refl;
-    vec3_reflect2(refl, dirToLightNorm, normal);
-
-    dp = vec3_mul_inner(refl, dirToCam);
-
-    float lightPower = 0.9f;
-    float albedoCF1 = material[4];
-    float albedoCF2 = material[5];
-
-    if (dp > 0) {
-        dp = pow(dp, albedoCF1);
-        color.R += dp * lightPower * albedoCF2 * shadow;
-        color.G += dp * lightPower * albedoCF2 * shadow;
-        color.B += dp * lightPower * albedoCF2 * shadow;
-    }
-
     return color;
 }
 
@@ -1005,6 +1559,37 @@ Color TraceColored(thread Scene* scene, Ray ray, int depth) {
 }
 
 
+// PCG hash, decorrelates the random streams of neighbouring pixels and frames
+uint Hash(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float NextRandom(thread uint* state) {
+    *state = Hash(*state);
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Thin lens: the ray starts at a random point of the lens disk and goes through the
+// point the pinhole ray meets on the focus plane
+void ApplyLens(const device float* input, uint seed, thread Ray* ray) {
+    float radius = sqrt(NextRandom(&seed));
+    float angle = 2.0f * M_PI_F * NextRandom(&seed);
+    float lensX = radius * cos(angle);
+    float lensY = radius * sin(angle);
+    vec3 forward = {input[23], input[24], input[25]};
+    float focus = input[38] / vec3_mul_inner(ray->Dir, forward);
+
+    vec3 dir;
+    for (int k = 0; k < 3; ++k) {
+        float from = ray->From[k] + input[32 + k] * lensX + input[35 + k] * lensY;
+        dir[k] = ray->From[k] + ray->Dir[k] * focus - from;
+        ray->From[k] = from;
+    }
+    vec3_norm(ray->Dir, dir);
+}
+
 // -----------------------------------------------------------------------------------------------------
 
 kernel void processRaytrace(
@@ -1012,10 +1597,8 @@ kernel void processRaytrace(
         device float *output [[ buffer(1) ]],
         uint i[[ thread_position_in_grid ]])
 {
-    float SCALE = 0.01;
-
-    int width = (int)input[0];
-    int height = (int)input[1];
+    int width = as_type<int>(input[0]);
+    int height = as_type<int>(input[1]);
 
     int ci = i / height;
     int cj = i % height;
@@ -1028,29 +1611,44 @@ kernel void processRaytrace(
     scene.CameraPos[1] = input[3];
     scene.CameraPos[2] = input[4];
 
-    scene.LightPos[0] = input[5];
-    scene.LightPos[1] = input[6];
-    scene.LightPos[2] = input[7];
-
-    scene.SpheresNumber = (int)input[8];
-    scene.SpheresIdx = 9;
+    scene.LightsIdx = as_type<int>(input[5]);
+    scene.GlobalLightsNumber = as_type<int>(input[6]);
+    scene.LocalLightsNumber = as_type<int>(input[7]);
+    scene.LightNodesIdx = as_type<int>(input[21]);
+
+    scene.SpheresNumber = as_type<int>(input[8]);
+    scene.StaticTree.NodesIdx = as_type<int>(input[9]);
+    scene.StaticTree.NodesNumber = as_type<int>(input[10]);
+    scene.StaticTree.SpheresIdx = as_type<int>(input[11]);
+    scene.DynamicTree.NodesIdx = as_type<int>(input[12]);
+    scene.DynamicTree.NodesNumber = as_type<int>(input[13]);
+    scene.DynamicTree.SpheresIdx = as_type<int>(input[14]);
+    scene.TreeWidth = as_type<int>(input[15]);
+    scene.ShapesIdx = as_type<int>(input[16]);
+    scene.ShapesNumber = as_type<int>(input[17]);
+    scene.MeshesIdx = as_type<int>(input[18]);
+    scene.MeshesNumber = as_type<int>(input[19]);
+    scene.MeshNodesIdx = as_type<int>(input[20]);
+    scene.ShadowMode = as_type<int>(input[22]);
 
     if (i >= width * height) {
         return;
     }
 
-    if (scene.SpheresNumber == 0) {
+    if (scene.SpheresNumber == 0 && scene.ShapesNumber == 0 && scene.MeshesNumber == 0) {
         output[pos] = 0;
         output[pos + 1] = 0;
         output[pos + 2] = 1;
         return;
     }
 
-    output[pos] = 1;
-    output[pos + 1] = 1;
-    output[pos + 2] = 1;
-
-    vec3 dir = {(ci - 0.5f * width) * SCALE, (cj - 0.5f * height) * SCALE, 20.0f};
+    // camera basis from the header, right and up are one pixel long
+    float x = ci - 0.5f * width;
+    float y = cj - 0.5f * height;
+    vec3 dir;
+    for (int k = 0; k < 3; ++k) {
+        dir[k] = input[23 + k] + input[26 + k] * x + input[29 + k] * y;
+    }
 
     vec3 dirNorm;
     vec3_norm(dirNorm, dir);
@@ -1059,7 +1657,19 @@ kernel void processRaytrace(
     vec3_set(ray.From, scene.CameraPos);
     vec3_set(ray.Dir, dirNorm);
 
+    // a lens camera takes one sample per frame and blends it into the previous frames,
+    // except on the first frame after a move. The lens vectors are zero for a pinhole.
+    float blend = input[39];
+    if (input[32] != 0.0f || input[33] != 0.0f || input[34] != 0.0f) {
+        ApplyLens(input, Hash(i ^ Hash(as_type<uint>(input[40]) ^ 0x6a09e667u)), &ray);
+    }
+
     Color color = TraceColored(&scene, ray, 2);
+    if (blend < 1.0f) {
+        color.R = output[pos] + (color.R - output[pos]) * blend;
+        color.G = output[pos + 1] + (color.G - output[pos + 1]) * blend;
+        color.B = output[pos + 2] + (color.B - output[pos + 2]) * blend;
+    }
     output[pos] = color.R;
     output[pos + 1] = color.G;
     output[pos + 2] = color.B;
@@ -3,8 +3,11 @@
 
 #include "entities.hpp"
 
-MetalRaytracer::MetalRaytracer(entt::registry& registry, int width, int height)
+const size_t MIN_INPUT_CAPACITY = 1 << 16;     // floats
+
+MetalRaytracer::MetalRaytracer(entt::registry& registry, int width, int height, int treeWidth)
     : Registry(registry)
+    , Encoder(registry, width, height, treeWidth)
 {
     Width = width;
     Height = height;
@@ -40,72 +43,32 @@ MetalRaytracer::MetalRaytracer(entt::registry& registry, int width, int height)
     CommandsQueue = Device.NewCommandQueue();
     assert(CommandsQueue);
 
-    const uint32_t dataCount = 1024 * 1024 * 15;
-
-    InBuffer = Device.NewBuffer(sizeof(float) * dataCount, mtlpp::ResourceOptions::StorageModeManaged);
-    assert(InBuffer);
-
     OutBuffer = Device.NewBuffer(sizeof(float) * Width * Height * 3, mtlpp::ResourceOptions::StorageModeManaged);
     assert(OutBuffer);
 }
 
 void MetalRaytracer::Update() {
-    std::vector<float> inputData;
-    inputData.push_back(Width);
-    inputData.push_back(Height);
-
-    {
-        auto view = Registry.view<Camera, Transform>();
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
-            break;
-        }
-    }
-
-    {
-        auto view = Registry.view<LightSource, Transform>();
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
-            break;
-        }
+    const std::vector<float>& inputData = Encoder.Encode();
+
+    // the static part of the scene stays on the device until it changes or the buffer is
+    // reallocated, its capacity follows the size of the scene, see GetCapacity()
+    size_t changedFrom = Encoder.FirstChanged();
+    size_t capacity = GetCapacity(InCapacity, inputData.size(), MIN_INPUT_CAPACITY);
+    if (capacity != InCapacity) {
+        InBuffer = Device.NewBuffer(sizeof(float) * capacity, mtlpp::ResourceOptions::StorageModeManaged);
+        assert(InBuffer);
+        InCapacity = capacity;
+        changedFrom = SceneEncoder::HEADER_SIZE;
     }
-
-    {
-        auto view = Registry.view<SphereRenderer, Transform, Material>();
-        inputData.push_back(view.size());
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
-
-            SphereRenderer& sphere = view.get<SphereRenderer>(entity);
-            inputData.push_back(sphere.Radius);
-
-            Material& material = view.get<Material>(entity);
-            inputData.push_back(material.Color.R);
-            inputData.push_back(material.Color.G);
-            inputData.push_back(material.Color.B);
-            inputData.push_back(material.DiffuseCF);
-            inputData.push_back(material.AlbedoCF.X);
-            inputData.push_back(material.AlbedoCF.Y);
-            inputData.push_back(material.AlbedoCF.Z);
-            inputData.push_back(material.RefractCF.X);
-            inputData.push_back(material.RefractCF.Y);
-        }
-    }
-
     float* inData = static_cast<float*>(InBuffer.GetContents());
-    for (size_t i = 0; i < inputData.size(); ++i) {
+    for (size_t i = 0; i < SceneEncoder::HEADER_SIZE; ++i) {
+        inData[i] = inputData[i];
+    }
+    for (size_t i = changedFrom; i < inputData.size(); ++i) {
         inData[i] = inputData[i];
     }
-    InBuffer.DidModify(ns::Range(0, inputData.size() * sizeof(float)));
+    InBuffer.DidModify(ns::Range(0, SceneEncoder::HEADER_SIZE * sizeof(float)));
+    InBuffer.DidModify(ns::Range(changedFrom * sizeof(float), (inputData.size() - changedFrom) * sizeof(float)));
 
 
     mtlpp::CommandBuffer commandBuffer = CommandsQueue.CommandBuffer();
@@ -3,19 +3,26 @@
 #include <entt/entt.hpp>
 
 #include "linmath.hpp"
+#include "raytracer.hpp"
+#include "scene_encoder.hpp"
 
 #include "mtlpp.hpp"
 
-class MetalRaytracer {
+class MetalRaytracer : public Raytracer {
 public:
-    MetalRaytracer(entt::registry& registry, int width, int height);
-    void Update();
-    void* RawData() {
+    // treeWidth is 2 or SceneEncoder::GRID, the layouts the kernel can traverse
+    MetalRaytracer(entt::registry& registry, int width, int height, int treeWidth = 2);
+    void SetShadowMode(int shadowMode) override {
+        Encoder.SetShadowMode(shadowMode);
+    }
+    void Update() override;
+    void* RawData() override {
         float* outData = static_cast<float*>(OutBuffer.GetContents());
         return outData;
     }
 private:
     entt::registry& Registry;
+    SceneEncoder Encoder;
     int Width;
     int Height;
     std::string KernelSource;
@@ -26,5 +33,6 @@ private:
     mtlpp::ComputePipelineState ComputePipelineState;
     mtlpp::CommandQueue CommandsQueue;
     mtlpp::Buffer InBuffer;
+    size_t InCapacity = 0;      // floats
     mtlpp::Buffer OutBuffer;
 };
@@ -1,678 +1,1062 @@
+// vec3 helpers in the manner of linmath.h. With NATIVE_VECTORS the arrays are loaded into
+// float3 for the arithmetic, which gives the compiler vector instructions and the dot,
+// cross and rsqrt builtins.
+typedef float vec3[3];
 
+#ifndef NATIVE_VECTORS
 
-#define LINMATH_H_DEFINE_VEC(n) \
-typedef float vec##n[n]; \
-static inline void vec##n##_add(vec##n r, vec##n const a, vec##n const b) \
-{ \
-	int i; \
-	for(i=0; i<n; ++i) \
-		r[i] = a[i] + b[i]; \
-} \
-static inline void vec##n##_sub(vec##n r, vec##n const a, vec##n const b) \
-{ \
-	int i; \
-	for(i=0; i<n; ++i) \
-		r[i] = a[i] - b[i]; \
-} \
-static inline void vec##n##_scale(vec##n r, vec##n const v, float const s) \
-{ \
-	int i; \
-	for(i=0; i<n; ++i) \
-		r[i] = v[i] * s; \
-} \
-static inline void vec##n##_set(vec##n r, vec##n const v) \
-{ \
-	int i; \
-	for(i=0; i<n; ++i) \
-		r[i] = v[i]; \
-} \
-static inline float vec##n##_mul_inner(vec##n const a, vec##n const b) \
-{ \
-	float p = 0.; \
-	int i; \
-	for(i=0; i<n; ++i) \
-		p += b[i]*a[i]; \
-	return p; \
-} \
-static inline float vec##n##_len(vec##n const v) \
-{ \
-	return (float) sqrt(vec##n##_mul_inner(v,v)); \
-} \
-static inline void vec##n##_norm(vec##n r, vec##n const v) \
-{ \
-	float k = 1.f / vec##n##_len(v); \
-	vec##n##_scale(r, v, k); \
-}
-
-LINMATH_H_DEFINE_VEC(2)
-LINMATH_H_DEFINE_VEC(3)
-LINMATH_H_DEFINE_VEC(4)
-
-static inline void vec3_mul_cross(vec3 r, vec3 const a, vec3 const b)
+static inline void vec3_add(vec3 r, vec3 const a, vec3 const b)
 {
-    r[0] = a[1]*b[2] - a[2]*b[1];
-    r[1] = a[2]*b[0] - a[0]*b[2];
-    r[2] = a[0]*b[1] - a[1]*b[0];
+    int i;
+    for(i=0; i<3; ++i)
+        r[i] = a[i] + b[i];
 }
-
-static inline void vec3_reflect(vec3 r, vec3 const v, vec3 const n)
+static inline void vec3_sub(vec3 r, vec3 const a, vec3 const b)
 {
-    float p  = 2.f*vec3_mul_inner(v, n);
     int i;
-    for(i=0;i<3;++i)
-        r[i] = v[i] - p*n[i];
+    for(i=0; i<3; ++i)
+        r[i] = a[i] - b[i];
 }
-
-static inline void vec3_reflect2(vec3 r, vec3 const v, vec3 const n)
+static inline void vec3_scale(vec3 r, vec3 const v, float const s)
 {
-    float p  = 2.f*vec3_mul_inner(v, n);
     int i;
-    for(i=0;i<3;++i)
-        r[i] = p*n[i] - v[i];
-    vec3_norm(r, r);
+    for(i=0; i<3; ++i)
+        r[i] = v[i] * s;
+}
+static inline void vec3_set(vec3 r, vec3 const v)
+{
+    int i;
+    for(i=0; i<3; ++i)
+        r[i] = v[i];
+}
+static inline float vec3_mul_inner(vec3 const a, vec3 const b)
+{
+    float p = 0.;
+    int i;
+    for(i=0; i<3; ++i)
+        p += b[i]*a[i];
+    return p;
+}
+static inline float vec3_len(vec3 const v)
+{
+    return (float) sqrt(vec3_mul_inner(v,v));
+}
+static inline void vec3_norm(vec3 r, vec3 const v)
+{
+    float k = 1.f / vec3_len(v);
+    vec3_scale(r, v, k);
 }
 
-static inline void vec4_mul_cross(vec4 r, vec4 a, vec4 b)
+static inline void vec3_mul_cross(vec3 r, vec3 const a, vec3 const b)
 {
     r[0] = a[1]*b[2] - a[2]*b[1];
     r[1] = a[2]*b[0] - a[0]*b[2];
     r[2] = a[0]*b[1] - a[1]*b[0];
-    r[3] = 1.f;
 }
 
-static inline void vec4_reflect(vec4 r, vec4 v, vec4 n)
+static inline void vec3_reflect2(vec3 r, vec3 const v, vec3 const n)
 {
-    float p  = 2.f*vec4_mul_inner(v, n);
+    float p  = 2.f*vec3_mul_inner(v, n);
     int i;
-    for(i=0;i<4;++i)
-        r[i] = v[i] - p*n[i];
+    for(i=0;i<3;++i)
+        r[i] = p*n[i] - v[i];
+    vec3_norm(r, r);
 }
 
-typedef vec4 mat4x4[4];
-static inline void mat4x4_identity(mat4x4 M)
+#else
+
+static inline void vec3_add(vec3 r, vec3 const a, vec3 const b)
 {
-    int i, j;
-    for(i=0; i<4; ++i)
-        for(j=0; j<4; ++j)
-            M[i][j] = i==j ? 1.f : 0.f;
+    vstore3(vload3(0, a) + vload3(0, b), 0, r);
 }
-static inline void mat4x4_dup(mat4x4 M, mat4x4 N)
+static inline void vec3_sub(vec3 r, vec3 const a, vec3 const b)
 {
-    int i, j;
-    for(i=0; i<4; ++i)
-        for(j=0; j<4; ++j)
-            M[i][j] = N[i][j];
+    vstore3(vload3(0, a) - vload3(0, b), 0, r);
 }
-static inline void mat4x4_row(vec4 r, mat4x4 M, int i)
+static inline void vec3_scale(vec3 r, vec3 const v, float const s)
 {
-    int k;
-    for(k=0; k<4; ++k)
-        r[k] = M[k][i];
+    vstore3(vload3(0, v) * s, 0, r);
 }
-static inline void mat4x4_col(vec4 r, mat4x4 M, int i)
+static inline void vec3_set(vec3 r, vec3 const v)
 {
-    int k;
-    for(k=0; k<4; ++k)
-        r[k] = M[i][k];
+    vstore3(vload3(0, v), 0, r);
 }
-static inline void mat4x4_transpose(mat4x4 M, mat4x4 N)
+static inline float vec3_mul_inner(vec3 const a, vec3 const b)
 {
-    int i, j;
-    for(j=0; j<4; ++j)
-        for(i=0; i<4; ++i)
-            M[i][j] = N[j][i];
+    return dot(vload3(0, a), vload3(0, b));
 }
-static inline void mat4x4_add(mat4x4 M, mat4x4 a, mat4x4 b)
+static inline float vec3_len(vec3 const v)
 {
-    int i;
-    for(i=0; i<4; ++i)
-        vec4_add(M[i], a[i], b[i]);
+    return length(vload3(0, v));
 }
-static inline void mat4x4_sub(mat4x4 M, mat4x4 a, mat4x4 b)
+static inline void vec3_norm(vec3 r, vec3 const v)
 {
-    int i;
-    for(i=0; i<4; ++i)
-        vec4_sub(M[i], a[i], b[i]);
+    float3 x = vload3(0, v);
+    vstore3(x * rsqrt(dot(x, x)), 0, r);
 }
-static inline void mat4x4_scale(mat4x4 M, mat4x4 a, float k)
+
+static inline void vec3_mul_cross(vec3 r, vec3 const a, vec3 const b)
 {
-    int i;
-    for(i=0; i<4; ++i)
-        vec4_scale(M[i], a[i], k);
+    vstore3(cross(vload3(0, a), vload3(0, b)), 0, r);
 }
-static inline void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y, float z)
+
+static inline void vec3_reflect2(vec3 r, vec3 const v, vec3 const n)
 {
-    int i;
-    vec4_scale(M[0], a[0], x);
-    vec4_scale(M[1], a[1], y);
-    vec4_scale(M[2], a[2], z);
-    for(i = 0; i < 4; ++i) {
-        M[3][i] = a[3][i];
-    }
+    float3 x = vload3(0, v);
+    float3 normal = vload3(0, n);
+    float3 reflected = mad(2.0f * dot(x, normal), normal, -x);
+    vstore3(reflected * rsqrt(dot(reflected, reflected)), 0, r);
 }
-static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
-{
-    mat4x4 temp;
-    int k, r, c;
-    for(c=0; c<4; ++c) for(r=0; r<4; ++r) {
-            temp[c][r] = 0.f;
-            for(k=0; k<4; ++k)
-                temp[c][r] += a[k][r] * b[c][k];
+
+#endif
+
+#define SPHERES_SIZE 13
+#define NODE_SIZE 8
+#define WIDE_NODE_SIZE 17
+#define BVH_STACK_SIZE 64       // SceneEncoder::STACK_SIZE, deeper trees are refused by the encoder
+#define GRID_HEADER_SIZE 9
+#define GRID 1
+#define SHAPE_SIZE 25
+#define SHAPE_BOARD 1
+#define MESH_SIZE 25
+#define LIGHT_SIZE 6
+#define SHADOW_CONES 1
+#define PACKET_LANES 4
+#define PACKET_SIZE (9 * PACKET_LANES)
+#define TRIANGLE_EPSILON 1e-7f
+#define EDGE_EPSILON 1e-5f
+
+// The scene is in __constant memory when it fits there, see OCLRaytracer::GetOptions()
+#ifndef SCENE_SPACE
+#define SCENE_SPACE __global
+#endif
+
+// SHADOW_MODE fixes the shadow mode at build time, so that the other one is compiled out,
+// else the header tells it
+#ifdef SHADOW_MODE
+#define GET_SHADOW_MODE(scene) SHADOW_MODE
+#else
+#define GET_SHADOW_MODE(scene) ((scene)->ShadowMode)
+#endif
+
+// With LOCAL_SPHERES defined to a tile size, every work-group copies the centers and radii of
+// the first spheres, static ones first, into local memory once. Rays test the copy for those
+// and read the rest from the scene buffer, so spheres are handed over as private copies.
+
+typedef struct Tree {
+    int NodesIdx;
+    int NodesNumber;
+    int SpheresIdx;
+    int LocalFirst;     // of the tree's spheres in the local copy
+} Tree;
+
+typedef struct Scene {
+    vec3 CameraPos;
+    int LightsIdx;
+    int GlobalLightsNumber;
+    int LocalLightsNumber;
+    int LightNodesIdx;
+    int SpheresNumber;
+    int TreeWidth;
+    Tree StaticTree;
+    Tree DynamicTree;
+    int ShapesIdx;
+    int ShapesNumber;
+    int MeshesIdx;
+    int MeshesNumber;
+    int MeshNodesIdx;
+    int ShadowMode;
+    SCENE_SPACE float* Input;
+#ifdef LOCAL_SPHERES
+    __local float* Spheres;     // center and radius, static spheres first
+    int LocalNumber;            // of the spheres in the local tile
+#endif
+} Scene;
+
+typedef struct Ray {
+    vec3 From;
+    vec3 Dir;
+} Ray;
+
+typedef struct Color {
+    float R;
+    float G;
+    float B;
+} Color;
+
+// Shadow cone from a shading point to a light disk
+typedef struct Cone {
+    vec3 Apex;
+    vec3 Dir;
+    float Length;       // distance to the light
+    float Angle;        // half angle of the light disk
+    float Slope;        // radius of the cone per unit of length
+} Cone;
+
+
+// Copies the center and radius of the i-th sphere of a tree, from the local tile when it is there
+float* GetSphere(Scene* scene, Tree tree, int i, float* sphere) {
+#ifdef LOCAL_SPHERES
+    int k = tree.LocalFirst + i;
+    if (k < scene->LocalNumber) {
+        for (int c = 0; c < 4; ++c) {
+            sphere[c] = scene->Spheres[k * 4 + c];
         }
-    mat4x4_dup(M, temp);
-}
-static inline void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
-{
-    int i, j;
-    for(j=0; j<4; ++j) {
-        r[j] = 0.f;
-        for(i=0; i<4; ++i)
-            r[j] += M[i][j] * v[i];
+        return sphere;
     }
+#endif
+    for (int c = 0; c < 4; ++c) {
+        sphere[c] = scene->Input[tree.SpheresIdx + i * SPHERES_SIZE + c];
+    }
+    return sphere;
 }
-static inline void mat4x4_translate(mat4x4 T, float x, float y, float z)
-{
-    mat4x4_identity(T);
-    T[3][0] = x;
-    T[3][1] = y;
-    T[3][2] = z;
-}
-static inline void mat4x4_translate_in_place(mat4x4 M, float x, float y, float z)
-{
-    vec4 t = {x, y, z, 0};
-    vec4 r;
-    int i;
-    for (i = 0; i < 4; ++i) {
-        mat4x4_row(r, M, i);
-        M[3][i] += vec4_mul_inner(r, t);
+
+#ifdef NATIVE_VECTORS
+
+// Nearest hit of the ray in front of its origin, -1 for a miss
+float IntersectSphere(float* sphere, Ray ray) {
+    float3 k = vload3(0, ray.From) - (float3)(sphere[0], sphere[1], sphere[2]);
+    float b = dot(k, vload3(0, ray.Dir));
+    float c = fma(-sphere[3], sphere[3], dot(k, k));
+    float d = fma(b, b, -c);
+    if (d < 0.0f) {
+        return -1.0f;
     }
+    float sqrtfd = sqrt(d);
+    float dist = -b - sqrtfd >= 0.0f ? -b - sqrtfd : -b + sqrtfd;
+    return dist <= 0.0f ? -1.0f : dist;
 }
-static inline void mat4x4_from_vec3_mul_outer(mat4x4 M, vec3 a, vec3 b)
-{
-    int i, j;
-    for(i=0; i<4; ++i) for(j=0; j<4; ++j)
-            M[i][j] = i<3 && j<3 ? a[i] * b[j] : 0.f;
+
+// Slab test of a box on all three axes at once
+bool IntersectSlabs(float3 lo, float3 hi, float3 from, float3 invDir, float tMin, float tMax) {
+    float3 t1 = (lo - from) * invDir;
+    float3 t2 = (hi - from) * invDir;
+    float3 tNear = min(t1, t2);
+    float3 tFar = max(t1, t2);
+    tMin = max(tMin, max(tNear.x, max(tNear.y, tNear.z)));
+    tMax = min(tMax, min(tFar.x, min(tFar.y, tFar.z)));
+    return tMin <= tMax;
 }
-static inline void mat4x4_rotate(mat4x4 R, mat4x4 M, float x, float y, float z, float angle)
-{
-    float s = sinf(angle);
-    float c = cosf(angle);
-    vec3 u = {x, y, z};
 
-    if(vec3_len(u) > 1e-4) {
-        mat4x4 T, C, S = {{0}};
+bool IntersectBox(Scene* scene, int nodeIdx, Ray ray, vec3 invDir, float maxDist) {
+    SCENE_SPACE float* node = scene->Input + nodeIdx;
+    return IntersectSlabs((float3)(node[0], node[1], node[2]), (float3)(node[3], node[4], node[5]),
+                          vload3(0, ray.From), vload3(0, invDir), 0.0f, maxDist < 0.0f ? INFINITY : maxDist);
+}
+
+#else
 
-        vec3_norm(u, u);
-        mat4x4_from_vec3_mul_outer(T, u, u);
+float IntersectSphere(float* sphere, Ray ray) {
+    vec3 spherePos = {sphere[0], sphere[1], sphere[2]};
+    float sphereRadius = sphere[3];
 
-        S[1][2] =  u[0];
-        S[2][1] = -u[0];
-        S[2][0] =  u[1];
-        S[0][2] = -u[1];
-        S[0][1] =  u[2];
-        S[1][0] = -u[2];
+    vec3 k;
+    vec3_sub(k, ray.From, spherePos);
 
-        mat4x4_scale(S, S, s);
+    float b = vec3_mul_inner(k, ray.Dir);
+    float kLen = vec3_len(k);
+    float c = kLen * kLen - sphereRadius * sphereRadius;
+    float d = b*b - c;
 
-        mat4x4_identity(C);
-        mat4x4_sub(C, C, T);
+    if (d < 0) {
+        return -1.0f;
+    }
 
-        mat4x4_scale(C, C, c);
+    float sqrtfd = sqrt(d);
+    float t1 = -b + sqrtfd;
+    float t2 = -b - sqrtfd;
 
-        mat4x4_add(T, T, C);
-        mat4x4_add(T, T, S);
+    float min_t  = min(t1,t2);
+    float max_t = max(t1,t2);
 
-        T[3][3] = 1.;
-        mat4x4_mul(R, M, T);
-    } else {
-        mat4x4_dup(R, M);
+    float dist = (min_t >= 0) ? min_t : max_t;
+    if (dist <= 0) {
+        return -1.0f;
     }
+    return dist;
 }
-static inline void mat4x4_rotate_X(mat4x4 Q, mat4x4 M, float angle)
-{
-    float s = sinf(angle);
-    float c = cosf(angle);
-    mat4x4 R = {
-            {1.f, 0.f, 0.f, 0.f},
-            {0.f,   c,   s, 0.f},
-            {0.f,  -s,   c, 0.f},
-            {0.f, 0.f, 0.f, 1.f}
-    };
-    mat4x4_mul(Q, M, R);
-}
-static inline void mat4x4_rotate_Y(mat4x4 Q, mat4x4 M, float angle)
-{
-    float s = sinf(angle);
-    float c = cosf(angle);
-    mat4x4 R = {
-            {   c, 0.f,   s, 0.f},
-            { 0.f, 1.f, 0.f, 0.f},
-            {  -s, 0.f,   c, 0.f},
-            { 0.f, 0.f, 0.f, 1.f}
-    };
-    mat4x4_mul(Q, M, R);
-}
-static inline void mat4x4_rotate_Z(mat4x4 Q, mat4x4 M, float angle)
-{
-    float s = sinf(angle);
-    float c = cosf(angle);
-    mat4x4 R = {
-            {   c,   s, 0.f, 0.f},
-            {  -s,   c, 0.f, 0.f},
-            { 0.f, 0.f, 1.f, 0.f},
-            { 0.f, 0.f, 0.f, 1.f}
-    };
-    mat4x4_mul(Q, M, R);
-}
-static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
-{
-    float idet;
-    float s[6];
-    float c[6];
-    s[0] = M[0][0]*M[1][1] - M[1][0]*M[0][1];
-    s[1] = M[0][0]*M[1][2] - M[1][0]*M[0][2];
-    s[2] = M[0][0]*M[1][3] - M[1][0]*M[0][3];
-    s[3] = M[0][1]*M[1][2] - M[1][1]*M[0][2];
-    s[4] = M[0][1]*M[1][3] - M[1][1]*M[0][3];
-    s[5] = M[0][2]*M[1][3] - M[1][2]*M[0][3];
-
-    c[0] = M[2][0]*M[3][1] - M[3][0]*M[2][1];
-    c[1] = M[2][0]*M[3][2] - M[3][0]*M[2][2];
-    c[2] = M[2][0]*M[3][3] - M[3][0]*M[2][3];
-    c[3] = M[2][1]*M[3][2] - M[3][1]*M[2][2];
-    c[4] = M[2][1]*M[3][3] - M[3][1]*M[2][3];
-    c[5] = M[2][2]*M[3][3] - M[3][2]*M[2][3];
-
-    /* Assumes it is invertible */
-    idet = 1.0f/( s[0]*c[5]-s[1]*c[4]+s[2]*c[3]+s[3]*c[2]-s[4]*c[1]+s[5]*c[0] );
-
-    T[0][0] = ( M[1][1] * c[5] - M[1][2] * c[4] + M[1][3] * c[3]) * idet;
-    T[0][1] = (-M[0][1] * c[5] + M[0][2] * c[4] - M[0][3] * c[3]) * idet;
-    T[0][2] = ( M[3][1] * s[5] - M[3][2] * s[4] + M[3][3] * s[3]) * idet;
-    T[0][3] = (-M[2][1] * s[5] + M[2][2] * s[4] - M[2][3] * s[3]) * idet;
-
-    T[1][0] = (-M[1][0] * c[5] + M[1][2] * c[2] - M[1][3] * c[1]) * idet;
-    T[1][1] = ( M[0][0] * c[5] - M[0][2] * c[2] + M[0][3] * c[1]) * idet;
-    T[1][2] = (-M[3][0] * s[5] + M[3][2] * s[2] - M[3][3] * s[1]) * idet;
-    T[1][3] = ( M[2][0] * s[5] - M[2][2] * s[2] + M[2][3] * s[1]) * idet;
-
-    T[2][0] = ( M[1][0] * c[4] - M[1][1] * c[2] + M[1][3] * c[0]) * idet;
-    T[2][1] = (-M[0][0] * c[4] + M[0][1] * c[2] - M[0][3] * c[0]) * idet;
-    T[2][2] = ( M[3][0] * s[4] - M[3][1] * s[2] + M[3][3] * s[0]) * idet;
-    T[2][3] = (-M[2][0] * s[4] + M[2][1] * s[2] - M[2][3] * s[0]) * idet;
-
-    T[3][0] = (-M[1][0] * c[3] + M[1][1] * c[1] - M[1][2] * c[0]) * idet;
-    T[3][1] = ( M[0][0] * c[3] - M[0][1] * c[1] + M[0][2] * c[0]) * idet;
-    T[3][2] = (-M[3][0] * s[3] + M[3][1] * s[1] - M[3][2] * s[0]) * idet;
-    T[3][3] = ( M[2][0] * s[3] - M[2][1] * s[1] + M[2][2] * s[0]) * idet;
-}
-static inline void mat4x4_orthonormalize(mat4x4 R, mat4x4 M)
-{
-    float s = 1.;
-    vec3 h;
-
-    mat4x4_dup(R, M);
-    vec3_norm(R[2], R[2]);
 
-    s = vec3_mul_inner(R[1], R[2]);
-    vec3_scale(h, R[2], s);
-    vec3_sub(R[1], R[1], h);
-    vec3_norm(R[2], R[2]);
+bool IntersectBox(Scene* scene, int nodeIdx, Ray ray, vec3 invDir, float maxDist) {
+    float tMin = 0.0f;
+    float tMax = maxDist < 0.0f ? INFINITY : maxDist;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (scene->Input[nodeIdx + i] - ray.From[i]) * invDir[i];
+        float t2 = (scene->Input[nodeIdx + 3 + i] - ray.From[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    return tMin <= tMax;
+}
 
-    s = vec3_mul_inner(R[1], R[2]);
-    vec3_scale(h, R[2], s);
-    vec3_sub(R[1], R[1], h);
-    vec3_norm(R[1], R[1]);
+#endif
 
-    s = vec3_mul_inner(R[0], R[1]);
-    vec3_scale(h, R[1], s);
-    vec3_sub(R[0], R[0], h);
-    vec3_norm(R[0], R[0]);
+void IntersectLeaf(Scene* scene, Tree tree, int first, int count, Ray ray, float* bestDistance, int* bestSphere) {
+    float sphere[4];
+    for (int i = first; i < first + count; ++i) {
+        float currDist = IntersectSphere(GetSphere(scene, tree, i, sphere), ray);
+        if (currDist <= 0.0f) {
+            continue;
+        }
+        if (*bestDistance < 0.0f || currDist < *bestDistance) {
+            *bestDistance = currDist;
+            *bestSphere = tree.SpheresIdx + i * SPHERES_SIZE;
+        }
+    }
 }
 
-static inline void mat4x4_frustum(mat4x4 M, float l, float r, float b, float t, float n, float f)
-{
-    M[0][0] = 2.f*n/(r-l);
-    M[0][1] = M[0][2] = M[0][3] = 0.f;
+void IntersectTree(Scene* scene, Tree tree, Ray ray, vec3 invDir, float* bestDistance, int* bestSphere) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-    M[1][1] = 2.f*n/(t-b);
-    M[1][0] = M[1][2] = M[1][3] = 0.f;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
 
-    M[2][0] = (r+l)/(r-l);
-    M[2][1] = (t+b)/(t-b);
-    M[2][2] = -(f+n)/(f-n);
-    M[2][3] = -1.f;
+    while (stackSize > 0) {
+        int nodeIdx = tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, ray, invDir, *bestDistance)) {
+            continue;
+        }
 
-    M[3][2] = -2.f*(f*n)/(f-n);
-    M[3][0] = M[3][1] = M[3][3] = 0.f;
+        int leftOrFirst = as_int(scene->Input[nodeIdx + 6]);
+        int count = as_int(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        IntersectLeaf(scene, tree, leftOrFirst, count, ray, bestDistance, bestSphere);
+    }
 }
-static inline void mat4x4_ortho(mat4x4 M, float l, float r, float b, float t, float n, float f)
-{
-    M[0][0] = 2.f/(r-l);
-    M[0][1] = M[0][2] = M[0][3] = 0.f;
-
-    M[1][1] = 2.f/(t-b);
-    M[1][0] = M[1][2] = M[1][3] = 0.f;
 
-    M[2][2] = -2.f/(f-n);
-    M[2][0] = M[2][1] = M[2][3] = 0.f;
+// 4-wide nodes with child boxes quantized to bytes, see wide_bvh.hpp for the layout
+void IntersectWideTree(Scene* scene, Tree tree, Ray ray, vec3 invDir, float* bestDistance, int* bestSphere) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-    M[3][0] = -(r+l)/(r-l);
-    M[3][1] = -(t+b)/(t-b);
-    M[3][2] = -(f+n)/(f-n);
-    M[3][3] = 1.f;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        SCENE_SPACE float* node = scene->Input + tree.NodesIdx + stack[--stackSize] * WIDE_NODE_SIZE;
+        uint counts = as_uint(node[16]);
+
+        for (int c = 0; c < 4; ++c) {
+            int child = as_int(node[12 + c]);
+            int count = (counts >> (8 * c)) & 0xFF;
+            if (child == 0 && count == 0) {
+                continue;
+            }
+
+#ifdef NATIVE_VECTORS
+            float3 origin = (float3)(node[0], node[1], node[2]);
+            float3 scale = (float3)(node[3], node[4], node[5]);
+            uint3 lo = (uint3)(as_uint(node[6]), as_uint(node[7]), as_uint(node[8])) >> (uint)(8 * c) & 0xFF;
+            uint3 hi = (uint3)(as_uint(node[9]), as_uint(node[10]), as_uint(node[11])) >> (uint)(8 * c) & 0xFF;
+            if (!IntersectSlabs(mad(convert_float3(lo), scale, origin), mad(convert_float3(hi), scale, origin),
+                                vload3(0, ray.From), vload3(0, invDir), 0.0f, *bestDistance < 0.0f ? INFINITY : *bestDistance)) {
+                continue;
+            }
+#else
+            float tMin = 0.0f;
+            float tMax = *bestDistance < 0.0f ? INFINITY : *bestDistance;
+            for (int i = 0; i < 3; ++i) {
+                float lo = node[i] + ((as_uint(node[6 + i]) >> (8 * c)) & 0xFF) * node[3 + i];
+                float hi = node[i] + ((as_uint(node[9 + i]) >> (8 * c)) & 0xFF) * node[3 + i];
+                float t1 = (lo - ray.From[i]) * invDir[i];
+                float t2 = (hi - ray.From[i]) * invDir[i];
+                tMin = max(tMin, min(t1, t2));
+                tMax = min(tMax, max(t1, t2));
+            }
+            if (tMin > tMax) {
+                continue;
+            }
+#endif
+
+            if (count > 0) {
+                IntersectLeaf(scene, tree, -child - 1, count, ray, bestDistance, bestSphere);
+            } else {
+                stack[stackSize++] = child;
+            }
+        }
+    }
 }
-static inline void mat4x4_perspective(mat4x4 m, float y_fov, float aspect, float n, float f)
-{
-    /* NOTE: Degrees are an unhandy unit to work with.
-     * linmath.h uses radians for everything! */
-    float const a = 1.f / (float) tan(y_fov / 2.f);
-
-    m[0][0] = a / aspect;
-    m[0][1] = 0.f;
-    m[0][2] = 0.f;
-    m[0][3] = 0.f;
-
-    m[1][0] = 0.f;
-    m[1][1] = a;
-    m[1][2] = 0.f;
-    m[1][3] = 0.f;
-
-    m[2][0] = 0.f;
-    m[2][1] = 0.f;
-    m[2][2] = -((f + n) / (f - n));
-    m[2][3] = -1.f;
-
-    m[3][0] = 0.f;
-    m[3][1] = 0.f;
-    m[3][2] = -((2.f * f * n) / (f - n));
-    m[3][3] = 0.f;
-}
-static inline void mat4x4_look_at(mat4x4 m, vec3 eye, vec3 center, vec3 up)
-{
-    /* Adapted from Android's OpenGL Matrix.java.                        */
-    /* See the OpenGL GLUT documentation for gluLookAt for a description */
-    /* of the algorithm. We implement it in a straightforward way:       */
 
-    /* TODO: The negation of of can be spared by swapping the order of
-     *       operands in the following cross products in the right way. */
-    vec3 f;
-    vec3 s;
-    vec3 t;
+// 3D-DDA walk through the cells of a uniform grid, see uniform_grid.hpp for the layout
+void IntersectGrid(Scene* scene, Tree tree, Ray ray, vec3 invDir, float* bestDistance, int* bestSphere) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-    vec3_sub(f, center, eye);
-    vec3_norm(f, f);
+    SCENE_SPACE float* grid = scene->Input + tree.NodesIdx;
+    SCENE_SPACE float* cellStarts = grid + GRID_HEADER_SIZE;
+    SCENE_SPACE float* indices = cellStarts + tree.NodesNumber + 1;
+    int dims[3] = {as_int(grid[6]), as_int(grid[7]), as_int(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = *bestDistance < 0.0f ? INFINITY : *bestDistance;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - ray.From[i]) * invDir[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - ray.From[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
 
-    vec3_mul_cross(s, f, up);
-    vec3_norm(s, s);
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = ray.From[i] + ray.Dir[i] * tMin;
+        cell[i] = clamp((int)((p - grid[i]) / grid[3 + i]), 0, dims[i] - 1);
+        step[i] = ray.Dir[i] < 0.0f ? -1 : 1;
+        if (ray.Dir[i] == 0.0f) {
+            tNext[i] = INFINITY;
+            tDelta[i] = INFINITY;
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - ray.From[i]) * invDir[i];
+        tDelta[i] = grid[3 + i] * fabs(invDir[i]);
+    }
 
-    vec3_mul_cross(t, s, f);
+    float sphereCopy[4];
+    while (true) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = as_int(cellStarts[cellIdx]); i < as_int(cellStarts[cellIdx + 1]); ++i) {
+            int sphere = as_int(indices[i]);
+            float currDist = IntersectSphere(GetSphere(scene, tree, sphere, sphereCopy), ray);
+            if (currDist <= 0.0f) {
+                continue;
+            }
+            if (*bestDistance < 0.0f || currDist < *bestDistance) {
+                *bestDistance = currDist;
+                *bestSphere = tree.SpheresIdx + sphere * SPHERES_SIZE;
+            }
+        }
 
-    m[0][0] =  s[0];
-    m[0][1] =  t[0];
-    m[0][2] = -f[0];
-    m[0][3] =   0.f;
+        // a sphere spans several cells, so a hit only ends the walk before the exit of the current cell
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        float tExit = tNext[axis];
+        if ((*bestDistance >= 0.0f && *bestDistance <= tExit) || tExit > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
 
-    m[1][0] =  s[1];
-    m[1][1] =  t[1];
-    m[1][2] = -f[1];
-    m[1][3] =   0.f;
+float IntersectShape(Scene* scene, int shapeIdx, Ray ray) {
+    SCENE_SPACE float* shape = scene->Input + shapeIdx;
 
-    m[2][0] =  s[2];
-    m[2][1] =  t[2];
-    m[2][2] = -f[2];
-    m[2][3] =   0.f;
+    if (as_int(shape[0]) == SHAPE_BOARD) {
+        float dist = (shape[2] - ray.From[1]) / ray.Dir[1];
+        if (!(dist > 0.0f)) {
+            return -1.0f;
+        }
+        float x = ray.From[0] + ray.Dir[0] * dist;
+        float z = ray.From[2] + ray.Dir[2] * dist;
+        if (fabs(x - shape[1]) > 0.5f * shape[4] || fabs(z - shape[3]) > 0.5f * shape[5]) {
+            return -1.0f;
+        }
+        return dist;
+    }
 
-    m[3][0] =  0.f;
-    m[3][1] =  0.f;
-    m[3][2] =  0.f;
-    m[3][3] =  1.f;
+    float tNear = -INFINITY;
+    float tFar = INFINITY;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (shape[1 + i] - 0.5f * shape[4 + i] - ray.From[i]) / ray.Dir[i];
+        float t2 = (shape[1 + i] + 0.5f * shape[4 + i] - ray.From[i]) / ray.Dir[i];
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+    if (tNear > tFar || tFar <= 0.0f) {
+        return -1.0f;
+    }
+    return tNear > 0.0f ? tNear : tFar;
+}
 
-    mat4x4_translate_in_place(m, -eye[0], -eye[1], -eye[2]);
+void IntersectShapes(Scene* scene, Ray ray, float* bestDistance, int* bestShape) {
+    for (int i = 0; i < scene->ShapesNumber; ++i) {
+        int shapeIdx = scene->ShapesIdx + i * SHAPE_SIZE;
+        float currDist = IntersectShape(scene, shapeIdx, ray);
+        if (currDist <= 0.0f) {
+            continue;
+        }
+        if (*bestDistance < 0.0f || currDist < *bestDistance) {
+            *bestDistance = currDist;
+            *bestShape = shapeIdx;
+        }
+    }
 }
 
-typedef float quat[4];
-static inline void quat_identity(quat q)
-{
-    q[0] = q[1] = q[2] = 0.f;
-    q[3] = 1.f;
+void GetShapeAttributes(Scene* scene, int shapeIdx, Ray ray, float distance, SCENE_SPACE float** material, vec3 normal) {
+    SCENE_SPACE float* shape = scene->Input + shapeIdx;
+    vec3 point;
+    vec3_scale(point, ray.Dir, distance);
+    vec3_add(point, ray.From, point);
+
+    normal[0] = 0;
+    normal[1] = 0;
+    normal[2] = 0;
+
+    if (as_int(shape[0]) == SHAPE_BOARD) {
+        normal[1] = ray.From[1] > shape[2] ? 1.0f : -1.0f;
+        int tiles = (int)floor(point[0] / shape[6]) + (int)floor(point[2] / shape[6]);
+        *material = shape + ((tiles & 1) ? 16 : 7);
+        return;
+    }
+
+    // the face is on the axis where the point is relatively furthest from the center
+    vec3 local;
+    for (int i = 0; i < 3; ++i) {
+        local[i] = (point[i] - shape[1 + i]) / shape[4 + i];
+    }
+    int axis = fabs(local[0]) > fabs(local[1]) ? 0 : 1;
+    axis = fabs(local[axis]) > fabs(local[2]) ? axis : 2;
+    normal[axis] = local[axis] > 0.0f ? 1.0f : -1.0f;
+    *material = shape + 7;
 }
-static inline void quat_add(quat r, quat a, quat b)
-{
-    int i;
-    for(i=0; i<4; ++i)
-        r[i] = a[i] + b[i];
+
+// Möller–Trumbore against the triangle lanes of a packet, one at a time
+void IntersectPacket(Scene* scene, int packetIdx, Ray ray, float* bestDistance, int* bestTriangle) {
+    for (int lane = 0; lane < PACKET_LANES; ++lane) {
+        SCENE_SPACE float* v0 = scene->Input + packetIdx + lane;
+        vec3 e1 = {v0[3 * PACKET_LANES], v0[4 * PACKET_LANES], v0[5 * PACKET_LANES]};
+        vec3 e2 = {v0[6 * PACKET_LANES], v0[7 * PACKET_LANES], v0[8 * PACKET_LANES]};
+        vec3 p;
+        vec3_mul_cross(p, ray.Dir, e2);
+        float det = vec3_mul_inner(e1, p);
+        if (fabs(det) <= TRIANGLE_EPSILON) {
+            continue;
+        }
+        float invDet = 1.0f / det;
+        vec3 t = {ray.From[0] - v0[0], ray.From[1] - v0[PACKET_LANES], ray.From[2] - v0[2 * PACKET_LANES]};
+        float u = vec3_mul_inner(t, p) * invDet;
+        vec3 q;
+        vec3_mul_cross(q, t, e1);
+        float v = vec3_mul_inner(ray.Dir, q) * invDet;
+        float dist = vec3_mul_inner(e2, q) * invDet;
+        if (u < -EDGE_EPSILON || v < -EDGE_EPSILON || u + v > 1.0f + EDGE_EPSILON || dist <= TRIANGLE_EPSILON) {
+            continue;
+        }
+        if (*bestDistance < 0.0f || dist < *bestDistance) {
+            *bestDistance = dist;
+            *bestTriangle = packetIdx + lane;
+        }
+    }
 }
-static inline void quat_sub(quat r, quat a, quat b)
-{
-    int i;
-    for(i=0; i<4; ++i)
-        r[i] = a[i] - b[i];
+
+// Mesh trees live in object space: the ray is moved, rotated and scaled into it. The direction
+// keeps its length, so object space distances are world ones divided by the scale.
+void IntersectInstance(Scene* scene, int instanceIdx, Ray ray, float* bestDistance, int* bestTriangle, int* bestMesh) {
+    SCENE_SPACE float* instance = scene->Input + instanceIdx;
+    int nodesIdx = as_int(instance[0]);
+    int packetsIdx = as_int(instance[2]);
+    float scale = instance[6];
+    SCENE_SPACE float* r = instance + 7;
+    vec3 from;
+    for (int k = 0; k < 3; ++k) {
+        from[k] = (ray.From[k] - instance[3 + k]) / scale;
+    }
+    Ray localRay;
+    for (int k = 0; k < 3; ++k) {
+        localRay.From[k] = r[k] * from[0] + r[3 + k] * from[1] + r[6 + k] * from[2];
+        localRay.Dir[k] = r[k] * ray.Dir[0] + r[3 + k] * ray.Dir[1] + r[6 + k] * ray.Dir[2];
+    }
+    vec3 invDir = {1.0f / localRay.Dir[0], 1.0f / localRay.Dir[1], 1.0f / localRay.Dir[2]};
+    float localDistance = *bestDistance < 0.0f ? -1.0f : *bestDistance / scale;
+    int triangle = -1;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        int nodeIdx = nodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, localRay, invDir, localDistance)) {
+            continue;
+        }
+        int leftOrFirst = as_int(scene->Input[nodeIdx + 6]);
+        int count = as_int(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        IntersectPacket(scene, packetsIdx + leftOrFirst * PACKET_SIZE, localRay, &localDistance, &triangle);
+    }
+
+    if (triangle >= 0) {
+        *bestDistance = localDistance * scale;
+        *bestTriangle = triangle;
+        *bestMesh = instanceIdx;
+    }
 }
-static inline void quat_mul(quat r, quat p, quat q)
-{
-    vec3 w;
-    vec3_mul_cross(r, p, q);
-    vec3_scale(w, p, q[3]);
-    vec3_add(r, r, w);
-    vec3_scale(w, q, p[3]);
-    vec3_add(r, r, w);
-    r[3] = p[3]*q[3] - vec3_mul_inner(p, q);
-}
-static inline void quat_scale(quat r, quat v, float s)
-{
-    int i;
-    for(i=0; i<4; ++i)
-        r[i] = v[i] * s;
+
+// Top level tree over the instances in world space, its leaves address instance records
+void IntersectMeshes(Scene* scene, Ray ray, vec3 invDir, float* bestDistance, int* bestTriangle, int* bestMesh) {
+    if (scene->MeshesNumber == 0) {
+        return;
+    }
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        int nodeIdx = scene->MeshNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (!IntersectBox(scene, nodeIdx, ray, invDir, *bestDistance)) {
+            continue;
+        }
+        int leftOrFirst = as_int(scene->Input[nodeIdx + 6]);
+        int count = as_int(scene->Input[nodeIdx + 7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            IntersectInstance(scene, scene->MeshesIdx + i * MESH_SIZE, ray, bestDistance, bestTriangle, bestMesh);
+        }
+    }
 }
-static inline float quat_inner_product(quat a, quat b)
-{
-    float p = 0.f;
-    int i;
-    for(i=0; i<4; ++i)
-        p += b[i]*a[i];
-    return p;
+
+void GetMeshAttributes(Scene* scene, int triangleIdx, int meshIdx, Ray ray, SCENE_SPACE float** material, vec3 normal) {
+    // triangleIdx is the v0 x of the triangle lane, the edges follow every PACKET_LANES floats
+    SCENE_SPACE float* lane = scene->Input + triangleIdx;
+    vec3 e1 = {lane[3 * PACKET_LANES], lane[4 * PACKET_LANES], lane[5 * PACKET_LANES]};
+    vec3 e2 = {lane[6 * PACKET_LANES], lane[7 * PACKET_LANES], lane[8 * PACKET_LANES]};
+    vec3 faceNormal;
+    vec3_mul_cross(faceNormal, e1, e2);
+    // back to world space, the rotation rows follow position and scale in the instance record
+    SCENE_SPACE float* r = scene->Input + meshIdx + 7;
+    vec3 world;
+    for (int k = 0; k < 3; ++k) {
+        world[k] = r[3 * k] * faceNormal[0] + r[3 * k + 1] * faceNormal[1] + r[3 * k + 2] * faceNormal[2];
+    }
+    vec3_norm(normal, world);
+    if (vec3_mul_inner(normal, ray.Dir) > 0.0f) {
+        vec3_scale(normal, normal, -1.0f);
+    }
+    *material = scene->Input + meshIdx + 16;
 }
-static inline void quat_conj(quat r, quat q)
-{
-    int i;
-    for(i=0; i<3; ++i)
-        r[i] = -q[i];
-    r[3] = q[3];
+
+// Closest hit as distance and primitive offset only, normal and material are left to the caller.
+// For a triangle hit meshIdx is the instance record and primitiveIdx the triangle lane.
+// maxDistance bounds the search, as if something had already been hit there.
+float IntersectClosest(Scene* scene, Ray ray, float maxDistance, int* primitiveIdx, int* meshIdx) {
+    // shapes go first, a floor hit then bounds the tree traversal. Meshes go last: sphere and
+    // shape hits do not clear meshIdx, a triangle must only be kept when nothing closer was found.
+    float bestDistance = maxDistance;
+    *primitiveIdx = -1;
+    *meshIdx = -1;
+    IntersectShapes(scene, ray, &bestDistance, primitiveIdx);
+
+    vec3 invDir = {1.0f / ray.Dir[0], 1.0f / ray.Dir[1], 1.0f / ray.Dir[2]};
+    if (scene->TreeWidth == GRID) {
+        IntersectGrid(scene, scene->StaticTree, ray, invDir, &bestDistance, primitiveIdx);
+        IntersectGrid(scene, scene->DynamicTree, ray, invDir, &bestDistance, primitiveIdx);
+    } else if (scene->TreeWidth == 4) {
+        IntersectWideTree(scene, scene->StaticTree, ray, invDir, &bestDistance, primitiveIdx);
+        IntersectWideTree(scene, scene->DynamicTree, ray, invDir, &bestDistance, primitiveIdx);
+    } else {
+        IntersectTree(scene, scene->StaticTree, ray, invDir, &bestDistance, primitiveIdx);
+        IntersectTree(scene, scene->DynamicTree, ray, invDir, &bestDistance, primitiveIdx);
+    }
+    IntersectMeshes(scene, ray, invDir, &bestDistance, primitiveIdx, meshIdx);
+    return bestDistance;
 }
-static inline void quat_rotate(quat r, float angle, vec3 axis) {
-    int i;
-    vec3 v;
-    vec3_scale(v, axis, sinf(angle / 2));
-    for(i=0; i<3; ++i)
-        r[i] = v[i];
-    r[3] = cosf(angle / 2);
+
+void Intersect(Scene* scene, Ray ray, float* distance, SCENE_SPACE float** material, vec3 normal) {
+    int primitiveIdx;
+    int meshIdx;
+    *distance = IntersectClosest(scene, ray, -1.0f, &primitiveIdx, &meshIdx);
+    if (*distance < 0.0f) {
+        normal[0] = 0;
+        normal[1] = 0;
+        normal[2] = 0;
+        return;
+    }
+    if (meshIdx >= 0) {
+        GetMeshAttributes(scene, primitiveIdx, meshIdx, ray, material, normal);
+        return;
+    }
+    // shapes are stored after all spheres
+    if (primitiveIdx >= scene->ShapesIdx) {
+        GetShapeAttributes(scene, primitiveIdx, ray, *distance, material, normal);
+        return;
+    }
+    int sphereIdx = primitiveIdx;
+
+    vec3 spherePos = {scene->Input[sphereIdx + 0], scene->Input[sphereIdx + 1], scene->Input[sphereIdx + 2]};
+    vec3 dirToPoint;
+    vec3_scale(dirToPoint, ray.Dir, *distance);
+    vec3 point;
+    vec3_add(point, ray.From, dirToPoint);
+    vec3 normDir;
+    vec3_sub(normDir, point, spherePos);
+    vec3_norm(normal, normDir);
+    *material = scene->Input + sphereIdx + 4;
 }
-#define quat_norm vec4_norm
-static inline void quat_mul_vec3(vec3 r, quat q, vec3 v)
-{
-/*
- * Method by Fabian 'ryg' Giessen (of Farbrausch)
-t = 2 * cross(q.xyz, v)
-v' = v + q.w * t + cross(q.xyz, t)
- */
-    vec3 t = {q[0], q[1], q[2]};
-    vec3 u = {q[0], q[1], q[2]};
 
-    vec3_mul_cross(t, t, v);
-    vec3_scale(t, t, 2);
+// Only hits closer than maxDistance count, e.g. the light itself
+bool IntersectAnything(Scene* scene, Ray ray, float maxDistance) {
+    int primitiveIdx;
+    int meshIdx;
+    IntersectClosest(scene, ray, maxDistance, &primitiveIdx, &meshIdx);
+    return primitiveIdx >= 0;
+}
 
-    vec3_mul_cross(u, u, t);
-    vec3_scale(t, t, q[3]);
+// 1 - cos(angle), without the cancellation of small angles
+float GetCap(float angle) {
+    float s = sin(0.5f * angle);
+    return 2.0f * s * s;
+}
 
-    vec3_add(r, v, t);
-    vec3_add(r, r, u);
+// Part of the light disk hidden by a sphere: the overlap of the light cone with the cone
+// around the sphere, with a smoothstep fit of the cap intersection for partial overlaps
+float GetSphereOcclusion(float* sphere, Cone* cone) {
+    vec3 toSphere = {sphere[0] - cone->Apex[0], sphere[1] - cone->Apex[1], sphere[2] - cone->Apex[2]};
+    float radius = sphere[3];
+    float distance = vec3_len(toSphere);
+    if (distance <= radius) {
+        return 1.0f;
+    }
+    if (distance - radius > cone->Length) {
+        return 0.0f;
+    }
+    float sphereAngle = asin(radius / distance);
+    float angle = acos(clamp(vec3_mul_inner(toSphere, cone->Dir) / distance, -1.0f, 1.0f));
+    if (angle >= sphereAngle + cone->Angle) {
+        return 0.0f;
+    }
+    float lightCap = GetCap(cone->Angle);
+    if (lightCap <= 0.0f) {
+        return 1.0f;
+    }
+    float overlap = min(1.0f, GetCap(sphereAngle) / lightCap);
+    float inner = fabs(sphereAngle - cone->Angle);
+    if (angle <= inner) {
+        return overlap;
+    }
+    float x = (sphereAngle + cone->Angle - angle) / (sphereAngle + cone->Angle - inner);
+    return overlap * x * x * (3.0f - 2.0f * x);
 }
-static inline void mat4x4_from_quat(mat4x4 M, quat q)
-{
-    float a = q[3];
-    float b = q[0];
-    float c = q[1];
-    float d = q[2];
-    float a2 = a*a;
-    float b2 = b*b;
-    float c2 = c*c;
-    float d2 = d*d;
-
-    M[0][0] = a2 + b2 - c2 - d2;
-    M[0][1] = 2.f*(b*c + a*d);
-    M[0][2] = 2.f*(b*d - a*c);
-    M[0][3] = 0.f;
-
-    M[1][0] = 2*(b*c - a*d);
-    M[1][1] = a2 - b2 + c2 - d2;
-    M[1][2] = 2.f*(c*d + a*b);
-    M[1][3] = 0.f;
-
-    M[2][0] = 2.f*(b*d + a*c);
-    M[2][1] = 2.f*(c*d - a*b);
-    M[2][2] = a2 - b2 - c2 + d2;
-    M[2][3] = 0.f;
-
-    M[3][0] = M[3][1] = M[3][2] = 0.f;
-    M[3][3] = 1.f;
-}
-
-static inline void mat4x4o_mul_quat(mat4x4 R, mat4x4 M, quat q)
-{
-/*  XXX: The way this is written only works for othogonal matrices. */
-/* TODO: Take care of non-orthogonal case. */
-    quat_mul_vec3(R[0], q, M[0]);
-    quat_mul_vec3(R[1], q, M[1]);
-    quat_mul_vec3(R[2], q, M[2]);
 
-    R[3][0] = R[3][1] = R[3][2] = 0.f;
-    R[3][3] = 1.f;
+void OccludeLeaf(Scene* scene, Tree tree, int first, int count, Cone* cone, float* visibility) {
+    float sphere[4];
+    for (int i = first; i < first + count; ++i) {
+        *visibility = min(*visibility, 1.0f - GetSphereOcclusion(GetSphere(scene, tree, i, sphere), cone));
+    }
 }
-static inline void quat_from_mat4x4(quat q, mat4x4 M)
-{
-    float r=0.f;
-    int i;
 
-    int perm[] = { 0, 1, 2, 0, 1 };
-    int *p = perm;
+// Occluders are gathered with the cone axis against boxes grown by the cone radius
+// at their far end along the axis, which finds every box the cone touches
+bool IntersectConeBox(Cone* cone, vec3 invDir, vec3 lo, vec3 hi) {
+#ifdef NATIVE_VECTORS
+    float3 apex = vload3(0, cone->Apex);
+    float3 dir = vload3(0, cone->Dir);
+    float3 low = vload3(0, lo) - apex;
+    float3 high = vload3(0, hi) - apex;
+    float3 far = max(low * dir, high * dir);
+    float radius = cone->Slope * clamp(far.x + far.y + far.z, 0.0f, cone->Length);
+    return IntersectSlabs(low - radius, high + radius, (float3)(0.0f), vload3(0, invDir), 0.0f, cone->Length);
+#else
+    float far = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        far += max((lo[i] - cone->Apex[i]) * cone->Dir[i], (hi[i] - cone->Apex[i]) * cone->Dir[i]);
+    }
+    float radius = cone->Slope * clamp(far, 0.0f, cone->Length);
+
+    float tMin = 0.0f;
+    float tMax = cone->Length;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (lo[i] - radius - cone->Apex[i]) * invDir[i];
+        float t2 = (hi[i] + radius - cone->Apex[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    return tMin <= tMax;
+#endif
+}
 
-    for(i = 0; i<3; i++) {
-        float m = M[i][i];
-        if( m < r )
-            continue;
-        m = r;
-        p = &perm[i];
+void OccludeTree(Scene* scene, Tree tree, Cone* cone, vec3 invDir, float* visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
     }
 
-    r = (float) sqrt(1.f + M[p[0]][p[0]] - M[p[1]][p[1]] - M[p[2]][p[2]] );
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
 
-    if(r < 1e-6) {
-        q[0] = 1.f;
-        q[1] = q[2] = q[3] = 0.f;
+    while (stackSize > 0 && *visibility > 0.0f) {
+        SCENE_SPACE float* node = scene->Input + tree.NodesIdx + stack[--stackSize] * NODE_SIZE;
+        vec3 lo = {node[0], node[1], node[2]};
+        vec3 hi = {node[3], node[4], node[5]};
+        if (!IntersectConeBox(cone, invDir, lo, hi)) {
+            continue;
+        }
+
+        int leftOrFirst = as_int(node[6]);
+        int count = as_int(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        OccludeLeaf(scene, tree, leftOrFirst, count, cone, visibility);
+    }
+}
+
+void OccludeWideTree(Scene* scene, Tree tree, Cone* cone, vec3 invDir, float* visibility) {
+    if (tree.NodesNumber == 0) {
         return;
     }
 
-    q[0] = r/2.f;
-    q[1] = (M[p[0]][p[1]] - M[p[1]][p[0]])/(2.f*r);
-    q[2] = (M[p[2]][p[0]] - M[p[0]][p[2]])/(2.f*r);
-    q[3] = (M[p[2]][p[1]] - M[p[1]][p[2]])/(2.f*r);
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0 && *visibility > 0.0f) {
+        SCENE_SPACE float* node = scene->Input + tree.NodesIdx + stack[--stackSize] * WIDE_NODE_SIZE;
+        uint counts = as_uint(node[16]);
+
+        for (int c = 0; c < 4; ++c) {
+            int child = as_int(node[12 + c]);
+            int count = (counts >> (8 * c)) & 0xFF;
+            if (child == 0 && count == 0) {
+                continue;
+            }
+
+            vec3 lo;
+            vec3 hi;
+            for (int i = 0; i < 3; ++i) {
+                lo[i] = node[i] + ((as_uint(node[6 + i]) >> (8 * c)) & 0xFF) * node[3 + i];
+                hi[i] = node[i] + ((as_uint(node[9 + i]) >> (8 * c)) & 0xFF) * node[3 + i];
+            }
+            if (!IntersectConeBox(cone, invDir, lo, hi)) {
+                continue;
+            }
+
+            if (count > 0) {
+                OccludeLeaf(scene, tree, -child - 1, count, cone, visibility);
+            } else {
+                stack[stackSize++] = child;
+            }
+        }
+    }
 }
 
-#define SPHERES_SIZE 4;
+// Only the cells along the cone axis are visited, so a sphere that stays out of
+// them loses the outer part of its penumbra
+void OccludeGrid(Scene* scene, Tree tree, Cone* cone, vec3 invDir, float* visibility) {
+    if (tree.NodesNumber == 0) {
+        return;
+    }
 
-typedef struct Scene {
-    vec3 CameraPos;
-    vec3 LightPos;
-    int SpheresNumber;
-    int SpheresIdx;
-    __global float* Input;
-} Scene;
+    SCENE_SPACE float* grid = scene->Input + tree.NodesIdx;
+    SCENE_SPACE float* cellStarts = grid + GRID_HEADER_SIZE;
+    SCENE_SPACE float* indices = cellStarts + tree.NodesNumber + 1;
+    int dims[3] = {as_int(grid[6]), as_int(grid[7]), as_int(grid[8])};
+
+    float tMin = 0.0f;
+    float tMax = cone->Length;
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (grid[i] - cone->Apex[i]) * invDir[i];
+        float t2 = (grid[i] + dims[i] * grid[3 + i] - cone->Apex[i]) * invDir[i];
+        tMin = max(tMin, min(t1, t2));
+        tMax = min(tMax, max(t1, t2));
+    }
+    if (tMin > tMax) {
+        return;
+    }
 
-typedef struct Ray {
-    vec3 From;
-    vec3 Dir;
-} Ray;
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    for (int i = 0; i < 3; ++i) {
+        float p = cone->Apex[i] + cone->Dir[i] * tMin;
+        cell[i] = clamp((int)((p - grid[i]) / grid[3 + i]), 0, dims[i] - 1);
+        step[i] = cone->Dir[i] < 0.0f ? -1 : 1;
+        if (cone->Dir[i] == 0.0f) {
+            tNext[i] = INFINITY;
+            tDelta[i] = INFINITY;
+            continue;
+        }
+        float boundary = grid[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid[3 + i];
+        tNext[i] = (boundary - cone->Apex[i]) * invDir[i];
+        tDelta[i] = grid[3 + i] * fabs(invDir[i]);
+    }
 
-typedef struct Color {
-    float R;
-    float G;
-    float B;
-} Color;
+    // spheres spanning several cells are seen more than once, which min() does not mind
+    while (*visibility > 0.0f) {
+        int cellIdx = (cell[2] * dims[1] + cell[1]) * dims[0] + cell[0];
+        for (int i = as_int(cellStarts[cellIdx]); i < as_int(cellStarts[cellIdx + 1]); ++i) {
+            OccludeLeaf(scene, tree, as_int(indices[i]), 1, cone, visibility);
+        }
 
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (tNext[axis] > tMax) {
+            return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
 
-float IntersectSphere(Scene* scene, int sphereIdx, Ray ray, float* material, vec3 normal) {
-    vec3 spherePos = {scene->Input[sphereIdx + 0], scene->Input[sphereIdx + 1], scene->Input[sphereIdx + 2]};
-    float sphereRadius = scene->Input[sphereIdx + 3];
+// Soft shadow of a light disk of radius light[5] at about the cost of one shadow ray.
+// Spheres occlude analytically, boards, boxes and meshes cast hard shadows along the cone axis.
+float GetConeShadow(Scene* scene, SCENE_SPACE float* light, vec3 point) {
+    vec3 dirToLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+    float lightDistance = vec3_len(dirToLight);
+    Cone cone;
+    vec3_scale(cone.Dir, dirToLight, 1.0f / lightDistance);
+    vec3_scale(cone.Apex, cone.Dir, 0.5f);
+    vec3_add(cone.Apex, point, cone.Apex);
+    cone.Length = lightDistance - 0.5f;
+    cone.Slope = light[5] / lightDistance;
+    cone.Angle = atan(cone.Slope);
 
-    vec3 k;
-    vec3_sub(k, ray.From, spherePos);
+    Ray ray;
+    vec3_set(ray.From, cone.Apex);
+    vec3_set(ray.Dir, cone.Dir);
+    vec3 invDir = {1.0f / ray.Dir[0], 1.0f / ray.Dir[1], 1.0f / ray.Dir[2]};
+    float bestDistance = cone.Length;
+    int primitiveIdx = -1;
+    int meshIdx = -1;
+    IntersectShapes(scene, ray, &bestDistance, &primitiveIdx);
+    IntersectMeshes(scene, ray, invDir, &bestDistance, &primitiveIdx, &meshIdx);
+    if (primitiveIdx >= 0) {
+        return 0.0f;
+    }
 
-    float b = vec3_mul_inner(k, ray.Dir);
-    float kLen = vec3_len(k);
-    float c = kLen * kLen - sphereRadius * sphereRadius;
-    float d = b*b - c;
+    float visibility = 1.0f;
+    if (scene->TreeWidth == GRID) {
+        OccludeGrid(scene, scene->StaticTree, &cone, invDir, &visibility);
+        OccludeGrid(scene, scene->DynamicTree, &cone, invDir, &visibility);
+    } else if (scene->TreeWidth == 4) {
+        OccludeWideTree(scene, scene->StaticTree, &cone, invDir, &visibility);
+        OccludeWideTree(scene, scene->DynamicTree, &cone, invDir, &visibility);
+    } else {
+        OccludeTree(scene, scene->StaticTree, &cone, invDir, &visibility);
+        OccludeTree(scene, scene->DynamicTree, &cone, invDir, &visibility);
+    }
+    return max(0.0f, visibility);
+}
 
-    if (d < 0) {
-        return -1.0f;
+// Light power left at the given distance, local lights fade out smoothly to zero at their radius
+float GetLightPower(SCENE_SPACE float* light, float distance) {
+    if (light[4] <= 0.0f) {
+        return light[3];
     }
+    float x = distance / light[4];
+    float window = max(0.0f, 1.0f - x * x);
+    return light[3] * window * window;
+}
 
-    float sqrtfd = sqrt(d);
-    float t1 = -b + sqrtfd;
-    float t2 = -b - sqrtfd;
+// Diffuse and specular part of one light, nothing when the light is hidden
+void AddLight(Scene* scene, SCENE_SPACE float* light, vec3 point, vec3 normal, vec3 dirToCam, Color* color) {
+    vec3 dirToLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+    float lightDistance = vec3_len(dirToLight);
 
-    float min_t  = min(t1,t2);
-    float max_t = max(t1,t2);
+    vec3 dirToLightNorm;
+    vec3_scale(dirToLightNorm, dirToLight, 1.0f / lightDistance);
 
-    float dist = (min_t >= 0) ? min_t : max_t;
-    if (dist <= 0) {
-        return -1.0f;
+    float lightPower = GetLightPower(light, lightDistance);
+    if (lightPower <= 0.0f) {
+        return;
     }
 
-    vec3 dirToPoint;
-    vec3_scale(dirToPoint, ray.Dir, dist);
+    if (GET_SHADOW_MODE(scene) == SHADOW_CONES) {
+        lightPower *= GetConeShadow(scene, light, point);
+        if (lightPower <= 0.0f) {
+            return;
+        }
+    } else {
+        Ray rayToLight;
+        vec3_scale(rayToLight.From, dirToLightNorm, 0.001f);
+        vec3_add(rayToLight.From, point, rayToLight.From);
+        vec3_set(rayToLight.Dir, dirToLightNorm);
 
-    vec3 point;
-    vec3_add(point, ray.From, dirToPoint);
+        if (IntersectAnything(scene, rayToLight, lightDistance - 0.001f)) {
+            return;
+        }
+    }
 
-    vec3 normDir;
-    vec3_sub(normDir, point, spherePos);
+    float dp = 0;
+    dp = vec3_mul_inner(dirToLightNorm, normal);
 
-    vec3_norm(normal, normDir);
+    float diffuseCF = 0.7f;
+    if (dp > 0) {
+        color->R += dp * diffuseCF * 0.6f * lightPower;
+        color->G += dp * diffuseCF * 0.6f * lightPower;
+        color->B += dp * diffuseCF * 1.0f * lightPower;
+    }
 
-    return dist;
+    vec3 refl;
+    vec3_reflect2(refl, dirToLightNorm, normal);
+
+    dp = vec3_mul_inner(refl, dirToCam);
+
+    float albedoCF1 = 30.0f;
+    float albedoCF2 = 1.2f;
+
+    if (dp > 0) {
+        dp = pow(dp, albedoCF1);
+        color->R += dp * lightPower * albedoCF2;
+        color->G += dp * lightPower * albedoCF2;
+        color->B += dp * lightPower * albedoCF2;
+    }
 }
 
-void Intersect(Scene* scene, Ray ray, float* distance, float* material, vec3 normal) {
-    float bestDistance = -1.0f;
-    vec3 bestNormal;
-    bestNormal[0] = 0;
-    bestNormal[1] = 0;
-    bestNormal[2] = 0;
-    vec3 currNormal;
-    for (int i = 0; i < scene->SpheresNumber; ++i) {
-        int sphereIdx = scene->SpheresIdx + i * SPHERES_SIZE;
-        float currDist = IntersectSphere(scene, sphereIdx, ray, 0, currNormal);
-        if (currDist <= 0.0f) {
+// All global lights, then the local lights found in the light tree whose influence sphere holds the point
+void AddLights(Scene* scene, vec3 point, vec3 normal, vec3 dirToCam, Color* color) {
+    for (int i = 0; i < scene->GlobalLightsNumber; ++i) {
+        AddLight(scene, scene->Input + scene->LightsIdx + i * LIGHT_SIZE, point, normal, dirToCam, color);
+    }
+    if (scene->LocalLightsNumber == 0) {
+        return;
+    }
+
+    SCENE_SPACE float* localLights = scene->Input + scene->LightsIdx + scene->GlobalLightsNumber * LIGHT_SIZE;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        SCENE_SPACE float* node = scene->Input + scene->LightNodesIdx + stack[--stackSize] * NODE_SIZE;
+        if (point[0] < node[0] || point[1] < node[1] || point[2] < node[2] ||
+            point[0] > node[3] || point[1] > node[4] || point[2] > node[5]) {
             continue;
         }
-        if (bestDistance < 0.0f || currDist < bestDistance) {
-            bestDistance = currDist;
-            vec3_set(bestNormal, currNormal);
+        int leftOrFirst = as_int(node[6]);
+        int count = as_int(node[7]);
+        if (count == 0) {
+            stack[stackSize++] = leftOrFirst + 1;
+            stack[stackSize++] = leftOrFirst;
+            continue;
+        }
+        for (int i = leftOrFirst; i < leftOrFirst + count; ++i) {
+            SCENE_SPACE float* light = localLights + i * LIGHT_SIZE;
+            vec3 toLight = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+            if (vec3_mul_inner(toLight, toLight) < light[4] * light[4]) {
+                AddLight(scene, light, point, normal, dirToCam, color);
+            }
         }
     }
-    *distance = bestDistance;
-    vec3_set(normal, bestNormal);
-}
-
-bool IntersectAnything(Scene* scene, Ray ray) {
-    float distance;
-    vec3 normal;
-    Intersect(scene, ray, &distance, 0, normal);
-    return distance > 0;
 }
 
-Color GetColor(Scene* scene, Ray ray, float distance, float* material, vec3 normal, int depth) {
+Color GetColor(Scene* scene, Ray ray, float distance, SCENE_SPACE float* material, vec3 normal, int depth) {
     vec3 dirToCam;
     vec3_scale(dirToCam, ray.Dir, -1.0f);
 
@@ -687,21 +1071,6 @@ Color GetColor(Scene* scene, Ray ray, float distance, float* material, vec3 norm
     color.G = 0;
     color.B = 0;
 
-    vec3 dirToLight;
-    vec3_sub(dirToLight, scene->LightPos, point);
-
-    vec3 dirToLightNorm;
-    vec3_norm(dirToLightNorm, dirToLight);
-
-    Ray rayToLight;
-    vec3_scale(rayToLight.From, dirToLightNorm, 0.001f);
-    vec3_add(rayToLight.From, point, rayToLight.From);
-    vec3_set(rayToLight.Dir, dirToLightNorm);
-
-    if (IntersectAnything(scene, rayToLight)) {
-        return color;
-    }
-
     if (depth > 0) {
         vec3 reflDir;
         vec3_reflect2(reflDir, dirToCam, normal);
@@ -738,31 +1107,7 @@ Color GetColor(Scene* scene, Ray ray, float distance, float* material, vec3 norm
 //            }
 
 
-    float dp = 0;
-    dp = vec3_mul_inner(dirToLightNorm, normal);
-
-    float diffuseCF = 0.7f;
-    if (dp > 0) {
-        color.R += dp * diffuseCF * 0.6f;
-        color.G += dp * diffuseCF * 0.6f;
-        color.B += dp * diffuseCF * 1.0f;
-    }
-
-    vec3 refl;
-    vec3_reflect2(refl, dirToLightNorm, normal);
-
-    dp = vec3_mul_inner(refl, dirToCam);
-
-    float lightPower = 0.9f;
-    float albedoCF1 = 30.0f;
-    float albedoCF2 = 1.2f;
-
-    if (dp > 0) {
-        dp = pow(dp, albedoCF1);
-        color.R += dp * lightPower * albedoCF2;
-        color.G += dp * lightPower * albedoCF2;
-        color.B += dp * lightPower * albedoCF2;
-    }
+    AddLights(scene, point, normal, dirToCam, &color);
 
     return color;
 }
@@ -771,7 +1116,8 @@ Color GetColor(Scene* scene, Ray ray, float distance, float* material, vec3 norm
 Color TraceColored(Scene* scene, Ray ray, int depth) {
     float dist = -1.0f;
     vec3 normal = {0, 0, 0};
-    Intersect(scene, ray, &dist, 0, normal);
+    SCENE_SPACE float* material = 0;
+    Intersect(scene, ray, &dist, &material, normal);
     Color color;
     if (dist < 0) {
         color.R = 1.0f;
@@ -779,24 +1125,58 @@ Color TraceColored(Scene* scene, Ray ray, int depth) {
         color.B = 1.0f;
         return color;
     }
-    return GetColor(scene, ray, dist, 0, normal, depth);
+    return GetColor(scene, ray, dist, material, normal, depth);
 }
 
 
 
 
 
-// -----------------------------------------------------------------------------------------------------
+// PCG hash, decorrelates the random streams of neighbouring pixels and frames
+uint Hash(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float NextRandom(uint* state) {
+    *state = Hash(*state);
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Thin lens: the ray starts at a random point of the lens disk and goes through the
+// point the pinhole ray meets on the focus plane
+void ApplyLens(SCENE_SPACE float* input, uint seed, Ray* ray) {
+    float radius = sqrt(NextRandom(&seed));
+    float angle = 2.0f * M_PI_F * NextRandom(&seed);
+    float lensX = radius * cos(angle);
+    float lensY = radius * sin(angle);
+    vec3 forward = {input[23], input[24], input[25]};
+    float focus = input[38] / vec3_mul_inner(ray->Dir, forward);
+
+    vec3 dir;
+    for (int k = 0; k < 3; ++k) {
+        float from = ray->From[k] + input[32 + k] * lensX + input[35 + k] * lensY;
+        dir[k] = ray->From[k] + ray->Dir[k] * focus - from;
+        ray->From[k] = from;
+    }
+    vec3_norm(ray->Dir, dir);
+}
 
-__kernel void processRaytrace(__global float* input, __global float* output, const unsigned int count) {
-    float SCALE = 0.01;
+// -----------------------------------------------------------------------------------------------------
 
-    int i = get_global_id(0);
+// One work-item per pixel over a 2D range, padded to whole work-groups.
+// previous is the image of the last frame, blended into when the camera accumulates.
+// The range may start at a row offset, rows from rowsEnd on are left to another renderer.
+__kernel void processRaytrace(SCENE_SPACE float* input, __global float* output, const unsigned int count,
+                              __global const float* previous, const int rowsEnd) {
+    int ci = get_global_id(0);
+    int cj = get_global_id(1);
 
-    int width = (int)input[0];
-    int height = (int)input[1];
+    int width = as_int(input[0]);
+    int height = as_int(input[1]);
 
-    int tmp = (int)input[0];
+    int tmp = as_int(input[0]);
 
     Scene scene;
     scene.Input = input;
@@ -804,27 +1184,60 @@ __kernel void processRaytrace(__global float* input, __global float* output, con
     scene.CameraPos[1] = input[3];
     scene.CameraPos[2] = input[4];
 
-    scene.LightPos[0] = input[5];
-    scene.LightPos[1] = input[6];
-    scene.LightPos[2] = input[7];
-
-    scene.SpheresNumber = (int)input[8];
-    scene.SpheresIdx = 9;
+    scene.LightsIdx = as_int(input[5]);
+    scene.GlobalLightsNumber = as_int(input[6]);
+    scene.LocalLightsNumber = as_int(input[7]);
+    scene.LightNodesIdx = as_int(input[21]);
+
+    scene.SpheresNumber = as_int(input[8]);
+    scene.StaticTree.NodesIdx = as_int(input[9]);
+    scene.StaticTree.NodesNumber = as_int(input[10]);
+    scene.StaticTree.SpheresIdx = as_int(input[11]);
+    scene.DynamicTree.NodesIdx = as_int(input[12]);
+    scene.DynamicTree.NodesNumber = as_int(input[13]);
+    scene.DynamicTree.SpheresIdx = as_int(input[14]);
+    scene.TreeWidth = as_int(input[15]);
+    scene.ShapesIdx = as_int(input[16]);
+    scene.ShapesNumber = as_int(input[17]);
+    scene.MeshesIdx = as_int(input[18]);
+    scene.MeshesNumber = as_int(input[19]);
+    scene.MeshNodesIdx = as_int(input[20]);
+    scene.ShadowMode = as_int(input[22]);
+
+#ifdef LOCAL_SPHERES
+    // the static spheres end where the dynamic tree starts. Items past the image help with
+    // the copy too, the barrier needs the whole work-group.
+    __local float spheres[LOCAL_SPHERES * 4];
+    int staticNumber = (scene.DynamicTree.NodesIdx - scene.StaticTree.SpheresIdx) / SPHERES_SIZE;
+    int groupSize = get_local_size(0) * get_local_size(1);
+    scene.LocalNumber = min(scene.SpheresNumber, LOCAL_SPHERES);
+    for (int k = get_local_id(1) * get_local_size(0) + get_local_id(0); k < scene.LocalNumber; k += groupSize) {
+        int sphereIdx = k < staticNumber ? scene.StaticTree.SpheresIdx + k * SPHERES_SIZE
+                                         : scene.DynamicTree.SpheresIdx + (k - staticNumber) * SPHERES_SIZE;
+        for (int c = 0; c < 4; ++c) {
+            spheres[k * 4 + c] = input[sphereIdx + c];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scene.Spheres = spheres;
+    scene.StaticTree.LocalFirst = 0;
+    scene.DynamicTree.LocalFirst = staticNumber;
+#endif
 
-    if (i >= width * height) {
+    if (ci >= width || cj >= rowsEnd) {
         return;
     }
 
-    int ci = i / height;
-    int cj = i % height;
-
+    int i = ci * height + cj;
     int pos = (cj * width + ci) * 3;
 
-    output[pos] = 1;
-    output[pos + 1] = 1;
-    output[pos + 2] = 1;
-
-    vec3 dir = {(ci - 0.5f * width) * SCALE, (cj - 0.5f * height) * SCALE, 20.0f};
+    // camera basis from the header, right and up are one pixel long
+    float x = ci - 0.5f * width;
+    float y = cj - 0.5f * height;
+    vec3 dir;
+    for (int k = 0; k < 3; ++k) {
+        dir[k] = input[23 + k] + input[26 + k] * x + input[29 + k] * y;
+    }
 
     vec3 dirNorm;
     vec3_norm(dirNorm, dir);
@@ -833,7 +1246,19 @@ __kernel void processRaytrace(__global float* input, __global float* output, con
     vec3_set(ray.From, scene.CameraPos);
     vec3_set(ray.Dir, dirNorm);
 
+    // a lens camera takes one sample per frame and blends it into the previous frames,
+    // except on the first frame after a move. The lens vectors are zero for a pinhole.
+    float blend = input[39];
+    if (input[32] != 0.0f || input[33] != 0.0f || input[34] != 0.0f) {
+        ApplyLens(input, Hash(i ^ Hash(as_uint(input[40]) ^ 0x6a09e667u)), &ray);
+    }
+
     Color color = TraceColored(&scene, ray, 2);
+    if (blend < 1.0f) {
+        color.R = previous[pos] + (color.R - previous[pos]) * blend;
+        color.G = previous[pos + 1] + (color.G - previous[pos + 1]) * blend;
+        color.B = previous[pos + 2] + (color.B - previous[pos + 2]) * blend;
+    }
     output[pos] = color.R;
     output[pos + 1] = color.G;
     output[pos + 2] = color.B;
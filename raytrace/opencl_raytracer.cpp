@@ -2,14 +2,27 @@
 #include "utils.hpp"
 
 
-#include <OpenCL/opencl.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 
 #include "entities.hpp"
 
-int DEVICE_NUM = 1;
-int DATA_SIZE = 1024;
+const size_t MIN_INPUT_CAPACITY = 1 << 16;     // floats
+const int MIN_LOCAL_SPHERES = 64;
+const char* BUILD_OPTIONS = "";
+const char* TUNING_FILE = "opencl_tuning.txt";
+const int TUNING_RUNS = 2;
 
 
 void dumpDevices() {
@@ -81,130 +94,551 @@ void dumpDevices() {
 }
 
 
-OCLRaytracer::OCLRaytracer(entt::registry& registry, int width, int height)
-    : Registry(registry)
-{
-    //dumpDevices();
+static std::string GetDeviceString(cl_device_id device, cl_device_info param) {
+    size_t size = 0;
+    clGetDeviceInfo(device, param, 0, NULL, &size);
+    std::string value(size, '\0');
+    clGetDeviceInfo(device, param, size, &value[0], NULL);
+    return value.c_str();
+}
 
-    Width = width;
-    Height = height;
+static std::string GetPlatformString(cl_platform_id platform, cl_platform_info param) {
+    size_t size = 0;
+    clGetPlatformInfo(platform, param, 0, NULL, &size);
+    std::string value(size, '\0');
+    clGetPlatformInfo(platform, param, size, &value[0], NULL);
+    return value.c_str();
+}
 
-    OutputData.resize(width * height * 3);
+static std::string ToLower(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return std::tolower(c); });
+    return value;
+}
 
-    KernelSource = LoadFile("opencl_kernel.c");
-    if (KernelSource.empty()) {
-        throw std::runtime_error("failed to load opencl kernel");
+// Lower is better: GPUs, then accelerators, then CPUs
+static int GetDeviceRank(cl_device_type type) {
+    if (type & CL_DEVICE_TYPE_GPU) {
+        return 0;
     }
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+        return 1;
+    }
+    if (type & CL_DEVICE_TYPE_CPU) {
+        return 2;
+    }
+    return 3;
+}
 
-    int err;
-    clGetDeviceIDs(NULL, CL_DEVICE_TYPE_GPU, 2, &DeviceID[0], NULL);
-    Context = clCreateContext(0, 1, &DeviceID[DEVICE_NUM], NULL, NULL, &err);
+// Walks the devices of every platform, so that a CPU only implementation like POCL is found too
+static cl_device_id SelectDevice(const std::string& selector, cl_platform_id* platform) {
+    cl_uint platformsNumber = 0;
+    clGetPlatformIDs(0, NULL, &platformsNumber);
+    std::vector<cl_platform_id> platforms(platformsNumber);
+    if (platformsNumber == 0 || clGetPlatformIDs(platformsNumber, &platforms[0], NULL) != CL_SUCCESS) {
+        throw std::runtime_error("no opencl platforms");
+    }
 
-    std::cout << "err1: " << err << "\n";
+    std::string query = ToLower(selector);
+    cl_device_type queryType = 0;
+    if (query == "gpu") {
+        queryType = CL_DEVICE_TYPE_GPU;
+    } else if (query == "cpu") {
+        queryType = CL_DEVICE_TYPE_CPU;
+    } else if (query == "accelerator") {
+        queryType = CL_DEVICE_TYPE_ACCELERATOR;
+    }
 
-    Commands = clCreateCommandQueue(Context, DeviceID[DEVICE_NUM], 0, &err);
+    cl_device_id best = NULL;
+    cl_device_id fallback = NULL;
+    int bestRank = 4;
+    for (cl_platform_id currPlatform: platforms) {
+        cl_uint devicesNumber = 0;
+        clGetDeviceIDs(currPlatform, CL_DEVICE_TYPE_ALL, 0, NULL, &devicesNumber);
+        std::vector<cl_device_id> devices(devicesNumber);
+        if (devicesNumber == 0 || clGetDeviceIDs(currPlatform, CL_DEVICE_TYPE_ALL, devicesNumber, &devices[0], NULL) != CL_SUCCESS) {
+            continue;
+        }
+        std::string platformName = ToLower(GetPlatformString(currPlatform, CL_PLATFORM_NAME));
+        for (cl_device_id device: devices) {
+            cl_device_type type = 0;
+            clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+            if (!fallback && (type & CL_DEVICE_TYPE_CPU)) {
+                fallback = device;
+            }
+
+            bool matches = queryType ? (type & queryType) != 0
+                : query.empty() || ToLower(GetDeviceString(device, CL_DEVICE_NAME)).find(query) != std::string::npos
+                    || platformName.find(query) != std::string::npos;
+            int rank = GetDeviceRank(type);
+            if (matches && rank < bestRank) {
+                best = device;
+                bestRank = rank;
+            }
+        }
+    }
 
-    std::cout << "err2: " << err << "\n";
+    if (!best) {
+        std::cout << "no opencl device matches \"" << selector << "\", falling back to the cpu\n";
+        best = fallback;
+    }
+    if (!best) {
+        throw std::runtime_error("no opencl devices");
+    }
+    clGetDeviceInfo(best, CL_DEVICE_PLATFORM, sizeof(*platform), platform, NULL);
+    return best;
+}
 
-    std::vector<char*> ptrs;
-    ptrs.push_back(&KernelSource[0]);
-    cl_program program = clCreateProgramWithSource(Context, 1, (const char **)(&ptrs[0]), NULL, &err);
-//    cl_program program = clCreateProgramWithSource(Context, 1, (const char **) & KernelSourceData, NULL, &err);
+static void PrintBuildLog(cl_program program, cl_device_id device) {
+    size_t size = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+    std::string log(size, '\0');
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, &log[0], NULL);
+    std::cout << log << "\n";
+}
 
-    std::cout << "err3: " << err << "\n";
+// Everything a compiled kernel depends on: source, options, device and driver
+static uint64_t GetProgramKey(cl_device_id device, const std::string& source, const std::string& options) {
+    uint64_t key = HashData(source);
+    key = HashData(options, key);
+    key = HashData(GetDeviceString(device, CL_DEVICE_NAME), key);
+    return HashData(GetDeviceString(device, CL_DRIVER_VERSION), key);
+}
 
-    clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+// Compiling from source takes seconds on CPU implementations, so the device binary is kept
+// in a file named after the program key. A binary the driver refuses is rebuilt from source
+// and overwritten.
+static cl_program BuildProgram(cl_context context, cl_device_id device, const std::string& source, const std::string& options) {
+    uint64_t key = GetProgramKey(device, source, options);
+    char cacheFile[64];
+    snprintf(cacheFile, sizeof(cacheFile), "opencl_cache_%016llx.bin", (unsigned long long)key);
 
-    Kernel = clCreateKernel(program, "processRaytrace", &err);
-    std::cout << "errB: " << err << "\n";
+    int err;
+    std::string binary = LoadFile(cacheFile);
+    if (!binary.empty()) {
+        size_t size = binary.size();
+        const unsigned char* data = (const unsigned char*)binary.data();
+        cl_int status = CL_SUCCESS;
+        cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, &data, &status, &err);
+        if (err == CL_SUCCESS && status == CL_SUCCESS && clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL) == CL_SUCCESS) {
+            return program;
+        }
+        if (program) {
+            clReleaseProgram(program);
+        }
+        std::cout << "stale kernel cache " << cacheFile << ", rebuilding\n";
+    }
+
+    const char* sourceData = source.c_str();
+    cl_program program = clCreateProgramWithSource(context, 1, &sourceData, NULL, &err);
+    if (err != CL_SUCCESS || clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS) {
+        PrintBuildLog(program, device);
+        throw std::runtime_error("failed to build opencl kernel");
+    }
 
-    if (err != 0) {
-        // Determine the size of the log
-        size_t log_size;
-        clGetProgramBuildInfo(program, DeviceID[DEVICE_NUM], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    size_t size = 0;
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+    binary.assign(size, '\0');
+    unsigned char* data = (unsigned char*)&binary[0];
+    if (size > 0 && clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(data), &data, NULL) == CL_SUCCESS) {
+        SaveFile(cacheFile, binary);
+    }
+    return program;
+}
+
+// Tuning file lines are "<program key> <local x> <local y>", 0 0 leaves the choice to the driver
+static bool LoadTuning(uint64_t key, size_t* localSize) {
+    std::istringstream lines(LoadFile(TUNING_FILE));
+    std::string line;
+    while (std::getline(lines, line)) {
+        unsigned long long lineKey;
+        unsigned long x, y;
+        if (sscanf(line.c_str(), "%llx %lu %lu", &lineKey, &x, &y) == 3 && lineKey == key) {
+            localSize[0] = x;
+            localSize[1] = y;
+            return true;
+        }
+    }
+    return false;
+}
 
-        // Allocate memory for the log
-        char *log = (char *) malloc(log_size);
+static void SaveTuning(uint64_t key, const size_t* localSize) {
+    std::istringstream lines(LoadFile(TUNING_FILE));
+    std::string data;
+    std::string line;
+    while (std::getline(lines, line)) {
+        unsigned long long lineKey;
+        if (sscanf(line.c_str(), "%llx", &lineKey) == 1 && lineKey != key) {
+            data += line + "\n";
+        }
+    }
+    char entry[80];
+    snprintf(entry, sizeof(entry), "%016llx %lu %lu\n", (unsigned long long)key,
+             (unsigned long)localSize[0], (unsigned long)localSize[1]);
+    SaveFile(TUNING_FILE, data + entry);
+}
 
-        // Get the log
-        clGetProgramBuildInfo(program, DeviceID[DEVICE_NUM], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+OCLRaytracer::OCLRaytracer(entt::registry& registry, int width, int height, int treeWidth, const std::string& device,
+                           std::shared_ptr<SceneEncoder> encoder)
+    : Registry(registry)
+    , Encoder(encoder ? encoder : std::make_shared<SceneEncoder>(registry, width, height, treeWidth))
+{
+    //dumpDevices();
+
+    Width = width;
+    Height = height;
+    LastRow = height;
+
+    KernelSource = LoadFile("opencl_kernel.c");
+    if (KernelSource.empty()) {
+        throw std::runtime_error("failed to load opencl kernel");
+    }
+
+    const char* envDevice = getenv("RAYTRACE_OPENCL_DEVICE");
+    cl_platform_id platform;
+    Device = SelectDevice(device.empty() && envDevice ? envDevice : device, &platform);
+
+    cl_device_type type = 0;
+    clGetDeviceInfo(Device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceInfo(Device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(Info.ComputeUnits), &Info.ComputeUnits, NULL);
+    clGetDeviceInfo(Device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(Info.MaxWorkGroupSize), &Info.MaxWorkGroupSize, NULL);
+    clGetDeviceInfo(Device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(Info.FloatVectorWidth), &Info.FloatVectorWidth, NULL);
+    Info.Name = GetDeviceString(Device, CL_DEVICE_NAME);
+    Info.Platform = GetPlatformString(platform, CL_PLATFORM_NAME);
+    Info.IsCPU = (type & CL_DEVICE_TYPE_CPU) != 0;
+    cl_device_local_mem_type localType = CL_GLOBAL;
+    clGetDeviceInfo(Device, CL_DEVICE_LOCAL_MEM_TYPE, sizeof(localType), &localType, NULL);
+    if (localType == CL_LOCAL) {
+        clGetDeviceInfo(Device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(Info.LocalMemSize), &Info.LocalMemSize, NULL);
+    }
+    clGetDeviceInfo(Device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(Info.MaxConstantSize), &Info.MaxConstantSize, NULL);
+    std::cout << "opencl device: " << Info.Name << " (" << Info.Platform << ")"
+              << (Info.IsCPU ? ", cpu" : "")
+              << ", compute units: " << Info.ComputeUnits
+              << ", max work-group size: " << Info.MaxWorkGroupSize
+              << ", float vector width: " << Info.FloatVectorWidth << "\n";
+
+    int err;
+    cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+    Context = clCreateContext(properties, 1, &Device, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("failed to create opencl context");
+    }
 
-        // Print the log
-        printf("%s\n", log);
+    cl_command_queue* queues[] = {&Uploads, &Commands, &Readbacks};
+    for (cl_command_queue* queue: queues) {
+        *queue = clCreateCommandQueue(Context, Device, CL_QUEUE_PROFILING_ENABLE, &err);
+        if (err != CL_SUCCESS) {
+            throw std::runtime_error("failed to create opencl command queue");
+        }
     }
 
+    MemoryFlags = Info.IsCPU ? CL_MEM_ALLOC_HOST_PTR : 0;
+    for (Slot& slot: Slots) {
+        slot.OutputData.resize(width * height * 3);
+        slot.Output = clCreateBuffer(Context, CL_MEM_READ_WRITE | MemoryFlags, sizeof(float) * slot.OutputData.size(), NULL, &err);
+        if (err != CL_SUCCESS) {
+            throw std::runtime_error("failed to allocate opencl output buffer");
+        }
+    }
+}
 
-    Input = clCreateBuffer(Context,  CL_MEM_READ_ONLY,  sizeof(float) * DATA_SIZE, NULL, NULL);
-    Output = clCreateBuffer(Context, CL_MEM_WRITE_ONLY, sizeof(float) * OutputData.size(), NULL, NULL);
+// Build options of the kernel variant that suits the scene in a slot:
+//  - float3 arithmetic when SetNativeVectors() asked for it
+//  - the shadow mode of the scene's feature mask, see SceneEncoder::GetFeatures(). The kernel
+//    has no reflected or refracted rays, so the other features do not change it.
+//  - the scene goes to constant memory when it fits there, ResizeInput() keeps its buffer
+//    within the limit then
+//  - a tile of the first sphere centers and radii is copied to local memory per work-group
+//    when the device has dedicated local memory. The tile is a power of two, so that a growing
+//    scene rarely needs a new variant, and grows up to all the spheres or half of the local
+//    memory. Devices without room for the smallest tile use the scene buffer alone.
+std::string OCLRaytracer::GetOptions(size_t inputSize, int spheresNumber) const {
+    std::string options = BUILD_OPTIONS;
+    if (NativeVectors) {
+        options += " -DNATIVE_VECTORS";
+    }
+    bool cones = (Encoder->GetFeatures() & SceneEncoder::FEATURE_SHADOW_CONES) != 0;
+    options += " -DSHADOW_MODE=" + std::to_string(cones ? SceneEncoder::SHADOW_CONES : SceneEncoder::SHADOW_RAYS);
+    if (sizeof(float) * inputSize <= Info.MaxConstantSize) {
+        options += " -DSCENE_SPACE=__constant";
+    }
+    const cl_ulong localBudget = Info.LocalMemSize / 2;
+    int capacity = MIN_LOCAL_SPHERES;
+    while (capacity < spheresNumber && sizeof(float) * 4 * capacity * 2 <= localBudget) {
+        capacity *= 2;
+    }
+    if (spheresNumber > 0 && sizeof(float) * 4 * capacity <= localBudget) {
+        options += " -DLOCAL_SPHERES=" + std::to_string(capacity);
+    }
+    return options;
 }
 
+// Variants are built on first use and kept, their binaries and work-group shapes are
+// cached on disk as well
+OCLRaytracer::KernelVariant& OCLRaytracer::GetVariant(const std::string& options) {
+    auto it = Variants.find(options);
+    if (it != Variants.end()) {
+        return it->second;
+    }
 
-void OCLRaytracer::Update() {
+    KernelVariant variant;
+    cl_program program = BuildProgram(Context, Device, KernelSource, options);
+    int err;
+    variant.Kernel = clCreateKernel(program, "processRaytrace", &err);
+    if (err != CL_SUCCESS) {
+        PrintBuildLog(program, Device);
+        throw std::runtime_error("failed to create opencl kernel");
+    }
+    variant.Key = GetProgramKey(Device, KernelSource, options);
+    variant.Tuned = LoadTuning(variant.Key, variant.LocalSize);
+    std::cout << "opencl kernel variant:" << (options.empty() ? " default" : options) << "\n";
+    return Variants[options] = variant;
+}
 
-    std::vector<float> inputData;
-    inputData.push_back(Width);
-    inputData.push_back(Height);
+// One work-item per pixel on a width by height grid, rounded up to whole work-groups.
+// The kernel skips the items past the image.
+cl_int OCLRaytracer::EnqueueKernel(const size_t* localSize, const std::vector<cl_event>& waitList, cl_event* event) {
+    size_t offset[2] = {0, (size_t)FirstRow};
+    size_t global[2] = {(size_t)Width, (size_t)(LastRow - FirstRow)};
+    if (localSize[0] > 0) {
+        for (int axis = 0; axis < 2; ++axis) {
+            global[axis] = (global[axis] + localSize[axis] - 1) / localSize[axis] * localSize[axis];
+        }
+    }
+    return clEnqueueNDRangeKernel(Commands, Variant->Kernel, 2, offset, global, localSize[0] > 0 ? localSize : NULL,
+                                  waitList.size(), waitList.empty() ? NULL : &waitList[0], event);
+}
 
-    {
-        auto view = Registry.view<Camera, Transform>();
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
-            break;
+// Renders the first frame of a variant with every work-group shape the kernel allows, and the driver's
+// own choice, and keeps the fastest for this program key. Each shape runs TUNING_RUNS
+// times so that the first launch overhead does not count.
+void OCLRaytracer::Tune() {
+    size_t kernelSize = 0;
+    clGetKernelWorkGroupInfo(Variant->Kernel, Device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelSize), &kernelSize, NULL);
+    size_t maxSize = std::min(kernelSize, Info.MaxWorkGroupSize);
+    size_t itemSizes[3] = {0, 0, 0};
+    clGetDeviceInfo(Device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(itemSizes), itemSizes, NULL);
+
+    std::vector<std::array<size_t, 2>> candidates = {{0, 0}};
+    for (size_t total = 32; total <= 256 && total <= maxSize; total *= 2) {
+        for (size_t x = 4; x <= 64 && x <= total; x *= 2) {
+            size_t y = total / x;
+            if (x <= itemSizes[0] && y <= itemSizes[1]) {
+                candidates.push_back({x, y});
+            }
         }
     }
 
-    {
-        auto view = Registry.view<LightSource, Transform>();
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
-            break;
+    double bestTime = std::numeric_limits<double>::max();
+    for (const std::array<size_t, 2>& candidate: candidates) {
+        double time = std::numeric_limits<double>::max();
+        for (int run = 0; run < TUNING_RUNS; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            if (EnqueueKernel(candidate.data()) != CL_SUCCESS || clFinish(Commands) != CL_SUCCESS) {
+                time = std::numeric_limits<double>::max();
+                break;
+            }
+            std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+            time = std::min(time, duration.count());
+        }
+        if (time < bestTime) {
+            bestTime = time;
+            Variant->LocalSize[0] = candidate[0];
+            Variant->LocalSize[1] = candidate[1];
         }
     }
 
-    {
-        auto view = Registry.view<SphereRenderer, Transform>();
-        inputData.push_back(view.size());
-        for(auto entity: view) {
-            Transform& transform = view.get<Transform>(entity);
-            inputData.push_back(transform.Position.X);
-            inputData.push_back(transform.Position.Y);
-            inputData.push_back(transform.Position.Z);
+    std::cout << "opencl work-group: " << Variant->LocalSize[0] << "x" << Variant->LocalSize[1]
+              << (Variant->LocalSize[0] == 0 ? " (driver)" : "") << ", " << bestTime << " ms\n";
+    SaveTuning(Variant->Key, Variant->LocalSize);
+}
 
-            SphereRenderer& sphere = view.get<SphereRenderer>(entity);
-            inputData.push_back(sphere.Radius);
+OCLRaytracer::~OCLRaytracer() {
+    cl_command_queue queues[] = {Uploads, Commands, Readbacks};
+    for (cl_command_queue queue: queues) {
+        clFinish(queue);
+    }
+    for (Slot& slot: Slots) {
+        ReleaseEvents(slot);
+        if (slot.Input) {
+            clReleaseMemObject(slot.Input);
         }
+        clReleaseMemObject(slot.Output);
+    }
+    for (auto& variant: Variants) {
+        cl_program program;
+        clGetKernelInfo(variant.second.Kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, NULL);
+        clReleaseKernel(variant.second.Kernel);
+        clReleaseProgram(program);
     }
+    for (cl_command_queue queue: queues) {
+        clReleaseCommandQueue(queue);
+    }
+    clReleaseContext(Context);
+}
 
+std::vector<std::string> OCLRaytracer::ListDevices() {
+    std::vector<std::string> names;
+    cl_uint platformsNumber = 0;
+    if (clGetPlatformIDs(0, NULL, &platformsNumber) != CL_SUCCESS || platformsNumber == 0) {
+        return names;
+    }
+    std::vector<cl_platform_id> platforms(platformsNumber);
+    clGetPlatformIDs(platformsNumber, &platforms[0], NULL);
+    for (cl_platform_id platform: platforms) {
+        cl_uint devicesNumber = 0;
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &devicesNumber);
+        std::vector<cl_device_id> devices(devicesNumber);
+        if (devicesNumber == 0 || clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, devicesNumber, &devices[0], NULL) != CL_SUCCESS) {
+            continue;
+        }
+        for (cl_device_id device: devices) {
+            names.push_back(GetDeviceString(device, CL_DEVICE_NAME));
+        }
+    }
+    return names;
+}
+
+// The scene buffer follows the size of the scene, see GetCapacity(). A scene that fits
+// constant memory gets a buffer that fits too, MIN_INPUT_CAPACITY is above the 64 KB
+// many devices allow.
+void OCLRaytracer::ResizeInput(Slot& slot, size_t size) {
+    size_t capacity = GetCapacity(slot.InputCapacity, size, MIN_INPUT_CAPACITY);
+    size_t constantCapacity = Info.MaxConstantSize / sizeof(float);
+    if (size <= constantCapacity) {
+        capacity = std::min(capacity, constantCapacity);
+    }
+    if (capacity == slot.InputCapacity) {
+        return;
+    }
+    if (slot.Input) {
+        clReleaseMemObject(slot.Input);
+    }
     int err;
-    err = clEnqueueWriteBuffer(Commands, Input, CL_TRUE, 0, sizeof(float) * inputData.size(), &inputData[0], 0, NULL, NULL);
+    slot.Input = clCreateBuffer(Context, CL_MEM_READ_ONLY | MemoryFlags, sizeof(float) * capacity, NULL, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("failed to allocate opencl scene buffer");
+    }
+    slot.InputCapacity = capacity;
+    slot.Dirty = SceneEncoder::HEADER_SIZE;
+}
 
-    //std::cout << "err4: " << err << "\n";
+// CPU devices see the mapped memory directly, others get an asynchronous copy from the
+// slot's staging vector, which stays untouched until the slot comes round again
+void OCLRaytracer::WriteInput(Slot& slot, const std::vector<float>& data, size_t from, size_t to) {
+    if (from >= to) {
+        return;
+    }
+    size_t offset = sizeof(float) * from;
+    size_t size = sizeof(float) * (to - from);
+    cl_event event;
+    if (!(MemoryFlags & CL_MEM_ALLOC_HOST_PTR)) {
+        slot.Staging.resize(data.size());
+        memcpy(&slot.Staging[from], &data[from], size);
+        clEnqueueWriteBuffer(Uploads, slot.Input, CL_FALSE, offset, size, &slot.Staging[from], 0, NULL, &event);
+        slot.Uploads.push_back(event);
+        return;
+    }
+    int err;
+    void* mapped = clEnqueueMapBuffer(Uploads, slot.Input, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, offset, size, 0, NULL, &event, &err);
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error("failed to map opencl scene buffer");
+    }
+    slot.Uploads.push_back(event);
+    memcpy(mapped, &data[from], size);
+    clEnqueueUnmapMemObject(Uploads, slot.Input, mapped, 0, NULL, &event);
+    slot.Uploads.push_back(event);
+}
 
-    clSetKernelArg(Kernel, 0, sizeof(cl_mem), &Input);
-    clSetKernelArg(Kernel, 1, sizeof(cl_mem), &Output);
-    unsigned int count = DATA_SIZE;
+void OCLRaytracer::ReleaseEvents(Slot& slot) {
+    for (cl_event event: slot.Uploads) {
+        clReleaseEvent(event);
+    }
+    slot.Uploads.clear();
+    if (slot.Kernel) {
+        clReleaseEvent(slot.Kernel);
+        slot.Kernel = NULL;
+    }
+    if (slot.Readback) {
+        clReleaseEvent(slot.Readback);
+        slot.Readback = NULL;
+    }
+}
+
+// Milliseconds from the start of the first command to the end of the last one
+static double GetDuration(cl_event first, cl_event last) {
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    return end > start ? (end - start) * 1e-6 : 0.0;
+}
 
-    clSetKernelArg(Kernel, 2, sizeof(unsigned int), &count);
-    size_t local;
 
-    size_t groupSize = CL_KERNEL_WORK_GROUP_SIZE;
+void OCLRaytracer::Update() {
+    int previous = Last;
+    Enqueue();
+    // waiting for the previous frame also frees its slot for the next Update()
+    Show(previous < 0 ? Last : previous);
+}
+
+void OCLRaytracer::Enqueue() {
+    Enqueue(Encoder->Encode());
+}
 
-    clGetKernelWorkGroupInfo(Kernel, DeviceID[DEVICE_NUM], CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
+void OCLRaytracer::Enqueue(const std::vector<float>& inputData) {
 
-    size_t global = Width * Height;
-    clEnqueueNDRangeKernel(Commands, Kernel, 1, NULL, &global, &local, 0, NULL, NULL);
-    clFinish(Commands);
+    // the frame of this slot is complete, the previous Update() or Finish() waited for it
+    Slot& slot = Slots[Current];
+    Slot& previous = Slots[1 - Current];
+    ReleaseEvents(slot);
+
+    // the static part of the scene stays on the device until it changes or the buffer is reallocated,
+    // a slot catches up with the changes made while the other one was in use
+    for (Slot& other: Slots) {
+        other.Dirty = std::min(other.Dirty, Encoder->FirstChanged());
+    }
+    ResizeInput(slot, inputData.size());
+    WriteInput(slot, inputData, 0, SceneEncoder::HEADER_SIZE);
+    WriteInput(slot, inputData, slot.Dirty, inputData.size());
+    slot.Dirty = inputData.size();
+
+    Variant = &GetVariant(GetOptions(inputData.size(), UnpackInt(inputData[8])));
+    cl_kernel kernel = Variant->Kernel;
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &slot.Input);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &slot.Output);
+    unsigned int count = inputData.size();
+    clSetKernelArg(kernel, 2, sizeof(unsigned int), &count);
+    clSetKernelArg(kernel, 3, sizeof(cl_mem), &previous.Output);
+    clSetKernelArg(kernel, 4, sizeof(int), &LastRow);
+
+    if (!Variant->Tuned) {
+        clWaitForEvents(slot.Uploads.size(), &slot.Uploads[0]);
+        Tune();
+        Variant->Tuned = true;
+    }
+    // the kernel of the previous frame, whose image this one blends into, is ahead in the same queue
+    EnqueueKernel(Variant->LocalSize, slot.Uploads, &slot.Kernel);
+    size_t rowSize = sizeof(float) * Width * 3;
+    clEnqueueReadBuffer(Readbacks, slot.Output, CL_FALSE, rowSize * FirstRow, rowSize * (LastRow - FirstRow),
+                        &slot.OutputData[Width * 3 * FirstRow], 1, &slot.Kernel, &slot.Readback);
+    clFlush(Uploads);
+    clFlush(Commands);
+    clFlush(Readbacks);
+
+    Last = Current;
+    Current = 1 - Current;
+}
+
+void OCLRaytracer::Finish() {
+    Show(Last);
+}
 
-    clEnqueueReadBuffer(Commands, Output, CL_TRUE, 0, sizeof(float) * OutputData.size(), &OutputData[0], 0, NULL, NULL);
-    clFinish(Commands);
-//    for (int i = 0; i < 15; ++i) {
-//        std::cout << OutputData[i] << " ";
-//    }
-//    std::cout << "\n";
+void OCLRaytracer::Show(int slot) {
+    Shown = slot;
+    Slot& shown = Slots[Shown];
+    clWaitForEvents(1, &shown.Readback);
+    Timing.Upload = GetDuration(shown.Uploads.front(), shown.Uploads.back());
+    Timing.Kernel = GetDuration(shown.Kernel, shown.Kernel);
+    Timing.Readback = GetDuration(shown.Readback, shown.Readback);
 }
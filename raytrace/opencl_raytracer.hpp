@@ -1,27 +1,139 @@
+#pragma once
+
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <string>
 #include <vector>
-#include <OpenCL/opencl.h>
 #include <entt/entt.hpp>
 
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+
 #include "linmath.hpp"
+#include "raytracer.hpp"
+#include "scene_encoder.hpp"
 
-class OCLRaytracer {
+class OCLRaytracer : public Raytracer {
 public:
-    OCLRaytracer(entt::registry& registry, int width, int height);
-    void Update();
-    void* RawData() {
-        return &OutputData[0];
+    struct DeviceInfo {
+        std::string Name;
+        std::string Platform;
+        bool IsCPU = false;
+        cl_uint ComputeUnits = 0;
+        size_t MaxWorkGroupSize = 0;
+        cl_uint FloatVectorWidth = 0;    // preferred by the device, CPUs vectorize work-items by it
+        cl_ulong LocalMemSize = 0;       // dedicated local memory, 0 where it is emulated in global memory
+        cl_ulong MaxConstantSize = 0;
+    };
+
+    // Device time of the commands of a frame, in milliseconds
+    struct FrameTiming {
+        double Upload = 0.0;
+        double Kernel = 0.0;
+        double Readback = 0.0;
+    };
+
+    // treeWidth is 2, 4 or SceneEncoder::GRID, the layouts the kernel can traverse.
+    // device is "gpu", "cpu", "accelerator" or part of a device or platform name,
+    // empty takes $RAYTRACE_OPENCL_DEVICE or else prefers GPUs. Without a match the
+    // first CPU device is used.
+    // encoder, when given, is shared with another backend and encodes the scene for both,
+    // see Enqueue()
+    OCLRaytracer(entt::registry& registry, int width, int height, int treeWidth = 4, const std::string& device = "",
+                 std::shared_ptr<SceneEncoder> encoder = nullptr);
+    ~OCLRaytracer() override;
+    // Names of the devices of all platforms, empty without an OpenCL runtime
+    static std::vector<std::string> ListDevices();
+    void SetShadowMode(int shadowMode) override {
+        Encoder->SetShadowMode(shadowMode);
+    }
+    // Builds the kernel with float3 arithmetic and vector builtins instead of the scalar
+    // vec3 loops, see NATIVE_VECTORS in opencl_kernel.c
+    void SetNativeVectors(bool nativeVectors) {
+        NativeVectors = nativeVectors;
     }
+    // Renders only rows [firstRow, lastRow), the rest of RawData() keeps older frames
+    void SetRows(int firstRow, int lastRow) {
+        FirstRow = firstRow;
+        LastRow = lastRow;
+    }
+    // Starts rendering a frame and returns once the previous one is read back, so that
+    // uploads, rendering and readback of consecutive frames overlap on the device.
+    // RawData() lags one frame behind the scene, the very first frame is waited for.
+    void Update() override;
+    // Update() in two halves for work done next to the device: Enqueue() encodes and starts
+    // a frame, Finish() waits for it and RawData() shows that very frame. Enqueue(inputData)
+    // starts a frame of the last Encode() of the encoder given to the constructor.
+    void Enqueue();
+    void Enqueue(const std::vector<float>& inputData);
+    void Finish();
+    void* RawData() override {
+        return &Slots[Shown].OutputData[0];
+    }
+    const DeviceInfo& GetDeviceInfo() const {
+        return Info;
+    }
+    // Of the frame RawData() shows
+    const FrameTiming& GetFrameTiming() const {
+        return Timing;
+    }
+private:
+    // Buffers of one frame in flight, two frames alternate
+    struct Slot {
+        cl_mem Input = NULL;
+        size_t InputCapacity = 0;       // floats
+        size_t Dirty = SceneEncoder::HEADER_SIZE;  // scene floats from here on changed since the last upload
+        std::vector<float> Staging;     // host copy the asynchronous upload reads from
+        cl_mem Output = NULL;
+        std::vector<float> OutputData;
+        std::vector<cl_event> Uploads;
+        cl_event Kernel = NULL;
+        cl_event Readback = NULL;
+    };
+
+    // Kernel compiled with one set of build options
+    struct KernelVariant {
+        cl_kernel Kernel;
+        uint64_t Key;                   // of the program, see GetProgramKey()
+        size_t LocalSize[2] = {0, 0};   // work-group shape, 0 leaves it to the driver
+        bool Tuned;                     // LocalSize was measured on this device, or loaded from TUNING_FILE
+    };
+
+    std::string GetOptions(size_t inputSize, int spheresNumber) const;
+    KernelVariant& GetVariant(const std::string& options);
+    void ResizeInput(Slot& slot, size_t size);
+    void WriteInput(Slot& slot, const std::vector<float>& data, size_t from, size_t to);
+    cl_int EnqueueKernel(const size_t* localSize, const std::vector<cl_event>& waitList = {}, cl_event* event = NULL);
+    void Tune();
+    void Show(int slot);
+    static void ReleaseEvents(Slot& slot);
 private:
     entt::registry& Registry;
+    std::shared_ptr<SceneEncoder> Encoder;
     int Width;
     int Height;
     std::string KernelSource;
-    std::vector<float> OutputData;
-    cl_kernel Kernel;
-    cl_device_id DeviceID[2];
+    std::map<std::string, KernelVariant> Variants;     // by build options
+    KernelVariant* Variant = nullptr;                   // of the current frame
+    cl_device_id Device;
+    DeviceInfo Info;
     cl_context Context;
-    cl_mem Input;
-    cl_mem Output;
-    cl_command_queue Commands;
+    bool NativeVectors = false;
+    cl_mem_flags MemoryFlags;   // host visible memory on CPU devices, read and written in place
+    Slot Slots[2];
+    int Current = 0;            // slot of the frame being started
+    int Last = -1;              // slot of the frame started last, -1 before the first one
+    int Shown = 0;              // slot of the frame read back last
+    int FirstRow = 0;
+    int LastRow;
+    FrameTiming Timing;
+    cl_command_queue Uploads;   // three in-order queues chained by events, so that transfers
+    cl_command_queue Commands;  // of one frame run next to the kernel of another
+    cl_command_queue Readbacks;
 };
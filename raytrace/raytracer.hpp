@@ -0,0 +1,11 @@
+#pragma once
+
+// Common interface of the backends. RawData() points at width * height RGB floats of
+// the last finished frame, owned by the raytracer and valid until the next Update().
+class Raytracer {
+public:
+    virtual ~Raytracer() = default;
+    virtual void SetShadowMode(int shadowMode) = 0;
+    virtual void Update() = 0;
+    virtual void* RawData() = 0;
+};
@@ -0,0 +1,110 @@
+#include "raytracer_factory.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include "cpu_raytracer.hpp"
+#include "denoiser.hpp"
+#include "hybrid_raytracer.hpp"
+#include "opencl_raytracer.hpp"
+#ifdef __APPLE__
+#include "metal_raytracer.hpp"
+#endif
+
+const int CALIBRATION_WARMUP = 2;      // frames, the first ones build kernels and trees
+const int CALIBRATION_FRAMES = 3;
+
+std::vector<RaytracerBackend> ListBackends(entt::registry& registry, int width, int height) {
+    std::vector<RaytracerBackend> backends;
+    backends.push_back({"cpu", [&registry, width, height]() {
+        return std::unique_ptr<Raytracer>(new CPURaytracer(registry, width, height));
+    }});
+#ifdef __APPLE__
+    backends.push_back({"metal", [&registry, width, height]() {
+        return std::unique_ptr<Raytracer>(new MetalRaytracer(registry, width, height));
+    }});
+#endif
+    for (const std::string& device: OCLRaytracer::ListDevices()) {
+        backends.push_back({"opencl:" + device, [&registry, width, height, device]() {
+            return std::unique_ptr<Raytracer>(new OCLRaytracer(registry, width, height, 4, device));
+        }});
+        backends.push_back({"hybrid:" + device, [&registry, width, height, device]() {
+            return std::unique_ptr<Raytracer>(new HybridRaytracer(registry, width, height, 4, device));
+        }});
+    }
+    return backends;
+}
+
+// Best frame time after the warmup, in milliseconds
+static double Calibrate(Raytracer& raytracer) {
+    for (int i = 0; i < CALIBRATION_WARMUP; ++i) {
+        raytracer.Update();
+    }
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < CALIBRATION_FRAMES; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        raytracer.Update();
+        std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+        best = std::min(best, duration.count());
+    }
+    return best;
+}
+
+std::unique_ptr<Raytracer> CreateRaytracer(entt::registry& registry, int width, int height, const std::string& backend) {
+    const char* envBackend = getenv("RAYTRACE_BACKEND");
+    std::string choice = backend.empty() && envBackend ? envBackend : backend;
+
+    if (choice == "cpu") {
+        return std::unique_ptr<Raytracer>(new CPURaytracer(registry, width, height));
+    }
+    if (choice == "cpu-denoised") {
+        return std::unique_ptr<Raytracer>(new DenoisedCPURaytracer(registry, width, height));
+    }
+    if (choice == "cpu-cached") {
+        std::unique_ptr<CPURaytracer> raytracer(new CPURaytracer(registry, width, height));
+        raytracer->SetShadingCache(true);
+        return raytracer;
+    }
+#ifdef __APPLE__
+    if (choice == "metal") {
+        return std::unique_ptr<Raytracer>(new MetalRaytracer(registry, width, height));
+    }
+#endif
+    if (choice == "opencl" || choice.compare(0, 7, "opencl:") == 0) {
+        std::string device = choice.size() > 7 ? choice.substr(7) : "";
+        return std::unique_ptr<Raytracer>(new OCLRaytracer(registry, width, height, 4, device));
+    }
+    if (choice == "hybrid" || choice.compare(0, 7, "hybrid:") == 0) {
+        std::string device = choice.size() > 7 ? choice.substr(7) : "";
+        return std::unique_ptr<Raytracer>(new HybridRaytracer(registry, width, height, 4, device));
+    }
+    if (!choice.empty() && choice != "auto") {
+        throw std::runtime_error("unknown raytracer backend " + choice);
+    }
+
+    std::unique_ptr<Raytracer> best;
+    std::string bestName;
+    double bestTime = std::numeric_limits<double>::max();
+    for (const RaytracerBackend& candidate: ListBackends(registry, width, height)) {
+        try {
+            std::unique_ptr<Raytracer> raytracer = candidate.Create();
+            double time = Calibrate(*raytracer);
+            std::cout << "backend " << candidate.Name << ": " << time << " ms\n";
+            if (time < bestTime) {
+                best = std::move(raytracer);
+                bestName = candidate.Name;
+                bestTime = time;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "backend " << candidate.Name << " failed: " << e.what() << "\n";
+        }
+    }
+    if (!best) {
+        throw std::runtime_error("no raytracer backend works");
+    }
+    std::cout << "using backend " << bestName << "\n";
+    return best;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <entt/entt.hpp>
+
+#include "raytracer.hpp"
+
+struct RaytracerBackend {
+    std::string Name;   // "cpu", "metal", "opencl:<device name>" or "hybrid:<device name>"
+    std::function<std::unique_ptr<Raytracer>()> Create;
+};
+
+// Every backend this build and machine can run, one per OpenCL device
+std::vector<RaytracerBackend> ListBackends(entt::registry& registry, int width, int height);
+
+// backend is "cpu", "metal", "opencl" for the preferred OpenCL device or "opencl:<part of a
+// device name>", "hybrid" and "hybrid:<...>" share the frames of that device with the CPU.
+// "cpu-denoised" trades the soft shadow rays for the Denoiser, "cpu-cached" reuses the
+// shading of the previous frame, see CPURaytracer::SetShadingCache(). Both are only taken by name.
+// Empty takes $RAYTRACE_BACKEND, and without it, or with "auto", every backend renders
+// a few frames of the scene already in the registry and the fastest wins.
+std::unique_ptr<Raytracer> CreateRaytracer(entt::registry& registry, int width, int height, const std::string& backend = "");
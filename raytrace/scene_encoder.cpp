@@ -0,0 +1,500 @@
+#include "scene_encoder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "entities.hpp"
+
+// Integer fields (offsets, counts, indices, node links and the enums) are stored
+// bit-cast with PackInt(): as float values they would only be exact up to 2^24,
+// about 1.3M spheres.
+//
+// Header layout, mirrored in opencl_kernel.c and metal_kernel.c:
+//  0, 1      width, height
+//  2..4      camera position
+//  5..7      lights offset, global lights number, local lights number
+//  8         spheres number
+//  9..11     static tree: nodes offset, nodes number, spheres offset
+//  12..14    dynamic tree: nodes offset, nodes number, spheres offset
+//  15        tree width: 2 for binary nodes, 4 or 8 for quantized wide nodes,
+//            1 for a uniform grid, then nodes are the grid and nodes number is its cells number
+//  16, 17    shapes offset, shapes number
+//  18, 19    mesh instances offset, mesh instances number
+//  20        instance tree nodes offset
+//  21        light tree nodes offset
+//  22        SHADOW_RAYS or SHADOW_CONES
+//  23..31    camera forward, right and up, right and up span one pixel:
+//            the ray of pixel (i, j) points along forward + right * (i - width / 2) + up * (j - height / 2)
+//  32..37    lens right and up, scaled by the aperture, zero for a pinhole camera
+//  38        focus distance
+//  39        weight of the new frame in the accumulated one, 1 to replace it
+//  40        frame number, seeds the lens samples
+//
+// Shape layout, SHAPE_SIZE floats:
+//  0         SHAPE_BOARD or SHAPE_BOX
+//  1..3      position
+//  4..6      board: size x, size z, tile size; box: size
+//  7..15     material, same as the sphere material
+//  16..24    material of the second board tiles, a copy of the first one for boxes
+//
+// Mesh instance layout, MESH_SIZE floats:
+//  0..2      mesh nodes offset, mesh nodes number, packets offset
+//  3..5      position
+//  6         scale
+//  7..15     rotation matrix rows, object to world
+//  16..24    material
+//
+// Light layout, LIGHT_SIZE floats:
+//  0..2      position
+//  3         power
+//  4         influence radius, 0 for global lights
+//  5         size, the radius of the emitting disk
+//
+// Global lights come first, then local lights in the leaf order of the light tree,
+// a binary tree over their influence spheres.
+//
+// Mesh nodes are binary nodes whose leaves address packets instead of spheres, see Mesh.
+// The instance tree is made of binary nodes in world space whose leaves address instances,
+// which are stored in leaf order.
+const int STATIC_TREE_IDX = 9;
+const int DYNAMIC_TREE_IDX = 12;
+const int MAX_ACCUMULATED_FRAMES = 32;      // bounds the trails of objects moving under a still camera
+
+SceneEncoder::SceneEncoder(entt::registry& registry, int width, int height, int treeWidth)
+    : Registry(registry)
+    , Width(width)
+    , Height(height)
+    , TreeWidth(treeWidth)
+{
+    Registry.on_construct<SphereRenderer>().connect<&SceneEncoder::OnSphereChanged>(*this);
+    Registry.on_destroy<SphereRenderer>().connect<&SceneEncoder::OnSphereChanged>(*this);
+    Registry.on_construct<RigidBody>().connect<&SceneEncoder::OnRigidBodyChanged>(*this);
+    Registry.on_destroy<RigidBody>().connect<&SceneEncoder::OnRigidBodyChanged>(*this);
+    Registry.on_construct<MeshRenderer>().connect<&SceneEncoder::OnMeshChanged>(*this);
+    Registry.on_destroy<MeshRenderer>().connect<&SceneEncoder::OnMeshChanged>(*this);
+}
+
+SceneEncoder::~SceneEncoder() {
+    Registry.on_construct<SphereRenderer>().disconnect<&SceneEncoder::OnSphereChanged>(*this);
+    Registry.on_destroy<SphereRenderer>().disconnect<&SceneEncoder::OnSphereChanged>(*this);
+    Registry.on_construct<RigidBody>().disconnect<&SceneEncoder::OnRigidBodyChanged>(*this);
+    Registry.on_destroy<RigidBody>().disconnect<&SceneEncoder::OnRigidBodyChanged>(*this);
+    Registry.on_construct<MeshRenderer>().disconnect<&SceneEncoder::OnMeshChanged>(*this);
+    Registry.on_destroy<MeshRenderer>().disconnect<&SceneEncoder::OnMeshChanged>(*this);
+}
+
+// Rotation around X, then Y, then Z
+static void RotationMatrix(const Vector3& angles, float m[9]) {
+    float cx = std::cos(angles.X), sx = std::sin(angles.X);
+    float cy = std::cos(angles.Y), sy = std::sin(angles.Y);
+    float cz = std::cos(angles.Z), sz = std::sin(angles.Z);
+    m[0] = cz * cy;     m[1] = cz * sy * sx - sz * cx;  m[2] = cz * sy * cx + sz * sx;
+    m[3] = sz * cy;     m[4] = sz * sy * sx + cz * cx;  m[5] = sz * sy * cx - cz * sx;
+    m[6] = -sy;         m[7] = cy * sx;                 m[8] = cy * cx;
+}
+
+// A traversal pops a node and pushes its children, leaving up to width - 1 of them
+// behind for every level it descends. Deeper trees would overflow the fixed stacks.
+static void CheckStack(int depth, int width) {
+    if (depth * (width - 1) + 1 > SceneEncoder::STACK_SIZE) {
+        throw std::runtime_error("scene tree too deep for the traversal stack");
+    }
+}
+
+void SceneEncoder::OnSphereChanged(entt::entity entity, entt::registry& registry) {
+    if (!registry.has<RigidBody>(entity)) {
+        StaticDirty = true;
+    }
+}
+
+void SceneEncoder::OnRigidBodyChanged(entt::entity entity, entt::registry& registry) {
+    if (registry.has<SphereRenderer>(entity)) {
+        StaticDirty = true;
+    }
+}
+
+void SceneEncoder::OnMeshChanged() {
+    StaticDirty = true;
+}
+
+const std::vector<float>& SceneEncoder::Encode() {
+    if (StaticDirty) {
+        Data.assign(HEADER_SIZE, 0.0f);
+        Features = 0;
+        EncodeMeshes();
+
+        Entities.clear();
+        auto view = Registry.view<SphereRenderer, Transform, Material>(entt::exclude<RigidBody>);
+        for (auto entity: view) {
+            Entities.push_back(entity);
+        }
+        if (TreeWidth == GRID) {
+            EncodeGrid(Entities, STATIC_TREE_IDX);
+        } else {
+            EncodeTree(Entities, StaticTree, BVH::BuildMode::BinnedSAH, STATIC_TREE_IDX);
+        }
+
+        StaticSpheresNumber = Entities.size();
+        StaticEnd = Data.size();
+        StaticFeatures = Features;
+        ChangedFrom = HEADER_SIZE;
+        StaticDirty = false;
+        ++StaticBuilds;
+    } else {
+        Data.resize(StaticEnd);
+        Features = StaticFeatures;
+        ChangedFrom = StaticEnd;
+    }
+
+    {
+        Entities.clear();
+        auto view = Registry.view<SphereRenderer, Transform, Material, RigidBody>();
+        for (auto entity: view) {
+            Entities.push_back(entity);
+        }
+        if (TreeWidth == GRID) {
+            EncodeGrid(Entities, DYNAMIC_TREE_IDX);
+        } else {
+            EncodeTree(Entities, DynamicTree, BVH::BuildMode::LBVH, DYNAMIC_TREE_IDX);
+        }
+        DynamicSpheres.clear();
+        for (int idx: TreeWidth == GRID ? Order : DynamicTree.Indices) {
+            DynamicSpheres.push_back(Entities[idx]);
+        }
+    }
+    size_t dynamicSpheresNumber = Entities.size();
+
+    EncodeShapes();
+    EncodeMeshInstances();
+    EncodeLights();
+
+    Data[0] = PackInt(Width);
+    Data[1] = PackInt(Height);
+    Data[15] = PackInt(TreeWidth);
+    Data[22] = PackInt(ShadowMode);
+    EncodeCamera();
+
+    Data[8] = PackInt(StaticSpheresNumber + dynamicSpheresNumber);
+    if (ShadowMode == SHADOW_CONES) {
+        Features |= FEATURE_SHADOW_CONES;
+    }
+
+    return Data;
+}
+
+void SceneEncoder::CollectPrimitives(const std::vector<entt::entity>& entities) {
+    Primitives.clear();
+    for (auto entity: entities) {
+        BVHPrimitive primitive;
+        primitive.Center = Registry.get<Transform>(entity).Position;
+        float radius = Registry.get<SphereRenderer>(entity).Radius;
+        primitive.Extent = Vector3(radius, radius, radius);
+        Primitives.push_back(primitive);
+    }
+}
+
+void SceneEncoder::EncodeTree(const std::vector<entt::entity>& entities, BVH& tree, BVH::BuildMode mode, int headerIdx) {
+    CollectPrimitives(entities);
+    tree.Build(Primitives, mode);
+
+    Data[headerIdx] = PackInt(Data.size());
+    if (TreeWidth > 2) {
+        WideTree.Build(tree, TreeWidth);
+        CheckStack(WideTree.Depth, TreeWidth);
+        Data[headerIdx + 1] = PackInt(WideTree.NodesNumber);
+        Data.insert(Data.end(), WideTree.Data.begin(), WideTree.Data.end());
+    } else {
+        CheckStack(BVH::GetDepth(tree.Nodes), 2);
+        Data[headerIdx + 1] = PackInt(tree.Nodes.size());
+        EncodeNodes(tree.Nodes);
+    }
+
+    // spheres are stored in leaf order, so a leaf addresses a contiguous range
+    Data[headerIdx + 2] = PackInt(Data.size());
+    EncodeSpheres(entities, tree.Indices);
+}
+
+void SceneEncoder::EncodeGrid(const std::vector<entt::entity>& entities, int headerIdx) {
+    CollectPrimitives(entities);
+    Grid.Build(Primitives);
+
+    Data[headerIdx] = PackInt(Data.size());
+    Data[headerIdx + 1] = PackInt(Grid.CellsNumber());
+    Data.insert(Data.end(), Grid.Min, Grid.Min + 3);
+    Data.insert(Data.end(), Grid.CellSize, Grid.CellSize + 3);
+    EncodeInts(Grid.Dims, Grid.Dims + 3);
+    EncodeInts(Grid.CellStarts.data(), Grid.CellStarts.data() + Grid.CellStarts.size());
+    EncodeInts(Grid.Indices.data(), Grid.Indices.data() + Grid.Indices.size());
+
+    Data[headerIdx + 2] = PackInt(Data.size());
+    Order.resize(entities.size());
+    for (size_t i = 0; i < Order.size(); ++i) {
+        Order[i] = i;
+    }
+    EncodeSpheres(entities, Order);
+}
+
+void SceneEncoder::EncodeSpheres(const std::vector<entt::entity>& entities, const std::vector<int>& order) {
+    for (int idx: order) {
+        auto entity = entities[idx];
+        Transform& transform = Registry.get<Transform>(entity);
+        Data.push_back(transform.Position.X);
+        Data.push_back(transform.Position.Y);
+        Data.push_back(transform.Position.Z);
+
+        SphereRenderer& sphere = Registry.get<SphereRenderer>(entity);
+        Data.push_back(sphere.Radius);
+
+        Material& material = Registry.get<Material>(entity);
+        EncodeMaterial(material, material.Color);
+    }
+}
+
+void SceneEncoder::EncodeShapes() {
+    Data[16] = PackInt(Data.size());
+    int shapesNumber = 0;
+
+    {
+        auto view = Registry.view<ChessBoardRenderer, Transform, Material>();
+        for (auto entity: view) {
+            Transform& transform = view.get<Transform>(entity);
+            ChessBoardRenderer& board = view.get<ChessBoardRenderer>(entity);
+            Material& material = view.get<Material>(entity);
+            Data.push_back(PackInt(SHAPE_BOARD));
+            Data.push_back(transform.Position.X);
+            Data.push_back(transform.Position.Y);
+            Data.push_back(transform.Position.Z);
+            Data.push_back(board.Size.X);
+            Data.push_back(board.Size.Y);
+            Data.push_back(board.TileSize);
+            EncodeMaterial(material, material.Color);
+            EncodeMaterial(material, board.SecondColor);
+            ++shapesNumber;
+        }
+    }
+
+    {
+        auto view = Registry.view<BoxRenderer, Transform, Material>();
+        for (auto entity: view) {
+            Transform& transform = view.get<Transform>(entity);
+            BoxRenderer& box = view.get<BoxRenderer>(entity);
+            Material& material = view.get<Material>(entity);
+            Data.push_back(PackInt(SHAPE_BOX));
+            Data.push_back(transform.Position.X);
+            Data.push_back(transform.Position.Y);
+            Data.push_back(transform.Position.Z);
+            Data.push_back(box.Size.X);
+            Data.push_back(box.Size.Y);
+            Data.push_back(box.Size.Z);
+            EncodeMaterial(material, material.Color);
+            EncodeMaterial(material, material.Color);
+            ++shapesNumber;
+        }
+    }
+
+    Data[17] = PackInt(shapesNumber);
+}
+
+void SceneEncoder::EncodeMeshes() {
+    MeshOffsets.clear();
+    auto view = Registry.view<MeshRenderer>();
+    for (auto entity: view) {
+        const Mesh* mesh = view.get(entity).Mesh.get();
+        if (!mesh || MeshOffsets.count(mesh)) {
+            continue;
+        }
+        CheckStack(BVH::GetDepth(mesh->Nodes), 2);
+        MeshOffsets[mesh] = Data.size();
+        EncodeNodes(mesh->Nodes);
+        Data.insert(Data.end(), mesh->Packets.begin(), mesh->Packets.end());
+    }
+}
+
+// Instances are few but move freely, so their tree is rebuilt every frame over the
+// world boxes of the mesh roots. Geometry is only referenced, never copied.
+void SceneEncoder::EncodeMeshInstances() {
+    Instances.clear();
+    Primitives.clear();
+    auto view = Registry.view<MeshRenderer, Transform, Material>();
+    for (auto entity: view) {
+        const Mesh* mesh = view.get<MeshRenderer>(entity).Mesh.get();
+        if (!MeshOffsets.count(mesh) || mesh->Nodes.empty()) {
+            continue;
+        }
+        Transform& transform = view.get<Transform>(entity);
+        float rotation[9];
+        RotationMatrix(transform.Rotation, rotation);
+
+        const BVHNode& root = mesh->Nodes[0];
+        float center[3];
+        float extent[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            center[axis] = 0.5f * (root.Min[axis] + root.Max[axis]);
+            extent[axis] = 0.5f * (root.Max[axis] - root.Min[axis]);
+        }
+        float worldCenter[3];
+        float worldExtent[3];
+        for (int row = 0; row < 3; ++row) {
+            const float* r = rotation + 3 * row;
+            worldCenter[row] = transform.Scale * (r[0] * center[0] + r[1] * center[1] + r[2] * center[2]);
+            worldExtent[row] = transform.Scale * (std::abs(r[0]) * extent[0] + std::abs(r[1]) * extent[1] + std::abs(r[2]) * extent[2]);
+        }
+
+        BVHPrimitive primitive;
+        primitive.Center = transform.Position + Vector3(worldCenter[0], worldCenter[1], worldCenter[2]);
+        primitive.Extent = Vector3(worldExtent[0], worldExtent[1], worldExtent[2]);
+        Primitives.push_back(primitive);
+        Instances.push_back(entity);
+    }
+
+    InstanceTree.Build(Primitives, BVH::BuildMode::BinnedSAH, 1);
+
+    Data[18] = PackInt(Data.size());
+    Data[19] = PackInt(Instances.size());
+    InstanceRecords.clear();
+    for (int idx: InstanceTree.Indices) {
+        auto entity = Instances[idx];
+        InstanceRecords.push_back(entity);
+        const Mesh* mesh = Registry.get<MeshRenderer>(entity).Mesh.get();
+        size_t meshIdx = MeshOffsets[mesh];
+        Transform& transform = Registry.get<Transform>(entity);
+        Data.push_back(PackInt(meshIdx));
+        Data.push_back(PackInt(mesh->Nodes.size()));
+        Data.push_back(PackInt(meshIdx + mesh->Nodes.size() * NODE_SIZE));
+        Data.push_back(transform.Position.X);
+        Data.push_back(transform.Position.Y);
+        Data.push_back(transform.Position.Z);
+        Data.push_back(transform.Scale);
+        float rotation[9];
+        RotationMatrix(transform.Rotation, rotation);
+        Data.insert(Data.end(), rotation, rotation + 9);
+        Material& material = Registry.get<Material>(entity);
+        EncodeMaterial(material, material.Color);
+    }
+
+    CheckStack(BVH::GetDepth(InstanceTree.Nodes), 2);
+    Data[20] = PackInt(Data.size());
+    EncodeNodes(InstanceTree.Nodes);
+}
+
+// Only global lights are evaluated everywhere, local ones are culled by the
+// shading point through their tree, rebuilt every frame as lights may move
+void SceneEncoder::EncodeLights() {
+    Data[5] = PackInt(Data.size());
+    Lights.clear();
+    Primitives.clear();
+
+    int globalLightsNumber = 0;
+    auto view = Registry.view<LightSource, Transform>();
+    for (auto entity: view) {
+        LightSource& light = view.get<LightSource>(entity);
+        if (light.Radius > 0.0f) {
+            BVHPrimitive primitive;
+            primitive.Center = view.get<Transform>(entity).Position;
+            primitive.Extent = Vector3(light.Radius, light.Radius, light.Radius);
+            Primitives.push_back(primitive);
+            Lights.push_back(entity);
+            continue;
+        }
+        EncodeLight(entity);
+        ++globalLightsNumber;
+    }
+
+    LightTree.Build(Primitives, BVH::BuildMode::LBVH, 1);
+    for (int idx: LightTree.Indices) {
+        EncodeLight(Lights[idx]);
+    }
+
+    Data[6] = PackInt(globalLightsNumber);
+    Data[7] = PackInt(Lights.size());
+    CheckStack(BVH::GetDepth(LightTree.Nodes), 2);
+    Data[21] = PackInt(Data.size());
+    EncodeNodes(LightTree.Nodes);
+}
+
+void SceneEncoder::EncodeLight(entt::entity entity) {
+    Transform& transform = Registry.get<Transform>(entity);
+    LightSource& light = Registry.get<LightSource>(entity);
+    Data.push_back(transform.Position.X);
+    Data.push_back(transform.Position.Y);
+    Data.push_back(transform.Position.Z);
+    Data.push_back(light.Power);
+    Data.push_back(std::max(0.0f, light.Radius));
+    Data.push_back(std::max(0.0f, light.Size));
+}
+
+// The basis is built once per frame so that the kernels only scale and add it per pixel
+void SceneEncoder::EncodeCamera() {
+    Vector3 position;
+    Camera camera = Camera();
+    auto view = Registry.view<Camera, Transform>();
+    for (auto entity: view) {
+        position = view.get<Transform>(entity).Position;
+        camera = view.get<Camera>(entity);
+        break;
+    }
+
+    Vector3 forward = camera.Direction.SqrMagnitude() > 0.0f ? camera.Direction.Normalized() : Vector3(0.0f, 0.0f, 1.0f);
+    Vector3 worldUp = std::abs(forward.Y) < 0.999f ? Vector3(0.0f, 1.0f, 0.0f) : Vector3(0.0f, 0.0f, 1.0f);
+    Vector3 right = worldUp.Cross(forward).Normalized();
+    Vector3 up = forward.Cross(right);
+    float aperture = camera.FocusDistance > 0.0f ? std::max(0.0f, camera.Aperture) : 0.0f;
+    Vector3 lensRight = right * aperture;
+    Vector3 lensUp = up * aperture;
+    float pixelSize = 2.0f * tanf(0.5f * camera.FieldOfView) / Height;
+    right *= pixelSize;
+    up *= pixelSize;
+
+    const Vector3* vectors[] = {&position, &forward, &right, &up, &lensRight, &lensUp};
+    const int offsets[] = {2, 23, 26, 29, 32, 35};
+    for (int i = 0; i < 6; ++i) {
+        Data[offsets[i]] = vectors[i]->X;
+        Data[offsets[i] + 1] = vectors[i]->Y;
+        Data[offsets[i] + 2] = vectors[i]->Z;
+    }
+    Data[38] = camera.FocusDistance;
+
+    // the history restarts when the camera moves or the static scene is rebuilt
+    std::vector<float> state(Data.begin() + 2, Data.begin() + 5);
+    state.insert(state.end(), Data.begin() + 23, Data.begin() + 39);
+    bool still = state == LastCamera && ChangedFrom > HEADER_SIZE;
+    AccumulatedFrames = still ? std::min(AccumulatedFrames + 1, MAX_ACCUMULATED_FRAMES) : 1;
+    LastCamera.swap(state);
+    Data[39] = aperture > 0.0f ? 1.0f / AccumulatedFrames : 1.0f;
+    Data[40] = PackInt(Frame);
+    ++Frame;
+}
+
+void SceneEncoder::EncodeNodes(const std::vector<BVHNode>& nodes) {
+    for (const BVHNode& node: nodes) {
+        Data.insert(Data.end(), node.Min, node.Min + 3);
+        Data.insert(Data.end(), node.Max, node.Max + 3);
+        Data.push_back(PackInt(node.LeftOrFirst));
+        Data.push_back(PackInt(node.Count));
+    }
+}
+
+void SceneEncoder::EncodeInts(const int* begin, const int* end) {
+    for (const int* value = begin; value != end; ++value) {
+        Data.push_back(PackInt(*value));
+    }
+}
+
+void SceneEncoder::EncodeMaterial(const Material& material, const ::Color& color) {
+    Data.push_back(color.R);
+    Data.push_back(color.G);
+    Data.push_back(color.B);
+    Data.push_back(material.DiffuseCF);
+    Data.push_back(material.AlbedoCF.X);
+    Data.push_back(material.AlbedoCF.Y);
+    Data.push_back(material.AlbedoCF.Z);
+    Data.push_back(material.RefractCF.X);
+    Data.push_back(material.RefractCF.Y);
+    if (material.AlbedoCF.Z > 0.0f) {
+        Features |= FEATURE_REFLECTIONS;
+    }
+    if (material.RefractCF.X > 0.0f) {
+        Features |= FEATURE_REFRACTIONS;
+    }
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <entt/entt.hpp>
+
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "structs.hpp"
+#include "uniform_grid.hpp"
+#include "wide_bvh.hpp"
+
+struct Material;
+
+// Packs the registry into the float buffer read by the kernels:
+//
+//   header | meshes | static nodes | static spheres | dynamic nodes | dynamic spheres | shapes | mesh instances | lights
+//
+// Spheres without a RigidBody never move, so their tree is built once and
+// stays in place until a static sphere is added or removed. Only the header
+// and the dynamic part are rewritten every frame.
+//
+// Trees are stored as binary nodes (treeWidth 2, NODE_SIZE floats each) or
+// as quantized wide nodes (treeWidth 4 or 8, see WideBVH). treeWidth GRID
+// stores a UniformGrid in place of the nodes instead, which suits scenes of
+// many similarly sized spheres spread over a box.
+//
+// Chess boards and boxes are few and large, so they are kept out of the
+// trees as a plain list of SHAPE_SIZE records tested before traversal.
+//
+// Every distinct Mesh is stored once with its own tree and triangle packets
+// and rebuilt along with the static spheres. MeshRenderer entities are
+// MESH_SIZE instance records that point at it, found through a top level
+// tree over the instances, so memory grows with unique meshes only.
+//
+// Lights with an influence radius are culled per shading point through a
+// tree over their spheres, the others light the whole scene.
+//
+// SHADOW_CONES shades with one analytic cone per light, occluded by the
+// spheres it crosses; SHADOW_RAYS traces a grid of jittered shadow rays.
+//
+// GetFeatures() tells which of the FEATURE_ paths the encoded scene needs, so
+// that the backends can run code specialized for it.
+class SceneEncoder {
+public:
+    static const int HEADER_SIZE = 41;
+    static const int SPHERE_SIZE = 13;
+    static const int SHAPE_SIZE = 25;
+    static const int SHAPE_BOARD = 1;
+    static const int SHAPE_BOX = 2;
+    static const int MESH_SIZE = 25;
+    static const int LIGHT_SIZE = 6;
+    static const int NODE_SIZE = 8;
+    static const int STACK_SIZE = 64;           // entries of the traversal stacks, BVH_STACK_SIZE in the kernels
+    static const int GRID = 1;
+    static const int SHADOW_RAYS = 0;
+    static const int SHADOW_CONES = 1;
+    static const int FEATURE_REFLECTIONS = 1;   // some material mirrors, AlbedoCF.Z > 0
+    static const int FEATURE_REFRACTIONS = 2;   // some material is transparent, RefractCF.X > 0
+    static const int FEATURE_SHADOW_CONES = 4;  // the shadow mode is SHADOW_CONES
+    static const int FEATURES_NUMBER = 8;       // of distinct masks
+
+    SceneEncoder(entt::registry& registry, int width, int height, int treeWidth = 2);
+    ~SceneEncoder();
+    const std::vector<float>& Encode();
+
+    void SetShadowMode(int shadowMode) {
+        ShadowMode = shadowMode;
+    }
+    // Forces a static rebuild, e.g. after moving a static entity by hand
+    void InvalidateStatic() {
+        StaticDirty = true;
+    }
+    // Everything in [HEADER_SIZE, FirstChanged()) is the same as after the previous Encode()
+    size_t FirstChanged() const {
+        return ChangedFrom;
+    }
+    // Counts the static rebuilds, offsets of static records hold until it changes
+    int GetStaticBuilds() const {
+        return StaticBuilds;
+    }
+    // FEATURE_ mask of the last Encode()
+    int GetFeatures() const {
+        return Features;
+    }
+    // Entities of the dynamic sphere records of the last Encode(), in buffer order,
+    // which follows the tree and changes as the spheres move
+    const std::vector<entt::entity>& GetDynamicSpheres() const {
+        return DynamicSpheres;
+    }
+    // Entities of the mesh instance records of the last Encode(), in buffer order
+    const std::vector<entt::entity>& GetInstances() const {
+        return InstanceRecords;
+    }
+private:
+    void OnSphereChanged(entt::entity entity, entt::registry& registry);
+    void OnRigidBodyChanged(entt::entity entity, entt::registry& registry);
+    void OnMeshChanged();
+    void CollectPrimitives(const std::vector<entt::entity>& entities);
+    void EncodeTree(const std::vector<entt::entity>& entities, BVH& tree, BVH::BuildMode mode, int headerIdx);
+    void EncodeGrid(const std::vector<entt::entity>& entities, int headerIdx);
+    void EncodeSpheres(const std::vector<entt::entity>& entities, const std::vector<int>& order);
+    void EncodeShapes();
+    void EncodeMeshes();
+    void EncodeMeshInstances();
+    void EncodeLights();
+    void EncodeLight(entt::entity entity);
+    void EncodeCamera();
+    void EncodeNodes(const std::vector<BVHNode>& nodes);
+    void EncodeInts(const int* begin, const int* end);
+    void EncodeMaterial(const Material& material, const ::Color& color);
+private:
+    entt::registry& Registry;
+    int Width;
+    int Height;
+    int TreeWidth;
+    int ShadowMode = SHADOW_CONES;
+    std::vector<float> Data;
+    std::vector<entt::entity> Entities;
+    std::vector<entt::entity> Instances;
+    std::vector<entt::entity> DynamicSpheres;     // in buffer order
+    std::vector<entt::entity> InstanceRecords;    // in buffer order
+    std::vector<entt::entity> Lights;
+    std::vector<BVHPrimitive> Primitives;
+    BVH StaticTree;
+    BVH DynamicTree;
+    BVH InstanceTree;
+    BVH LightTree;
+    WideBVH WideTree;
+    UniformGrid Grid;
+    std::vector<int> Order;
+    std::unordered_map<const Mesh*, size_t> MeshOffsets;
+    bool StaticDirty = true;
+    size_t StaticEnd = HEADER_SIZE;
+    size_t StaticSpheresNumber = 0;
+    size_t ChangedFrom = HEADER_SIZE;
+    int StaticBuilds = 0;
+    int Features = 0;
+    int StaticFeatures = 0;     // of the materials in the static part
+    std::vector<float> LastCamera;
+    int AccumulatedFrames = 0;
+    uint32_t Frame = 0;
+};
@@ -1,3 +1,4 @@
+#pragma once
 
 struct Color {
     Color(float r = 0.0f, float g = 0.0f, float b = 0.0f)
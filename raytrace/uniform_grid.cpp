@@ -0,0 +1,91 @@
+#include "uniform_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+const int MAX_DIM = 512;
+
+void UniformGrid::Clear() {
+    Dims[0] = Dims[1] = Dims[2] = 0;
+    CellStarts.clear();
+    Indices.clear();
+}
+
+void UniformGrid::Build(const std::vector<BVHPrimitive>& primitives, float density) {
+    Clear();
+    if (primitives.empty()) {
+        return;
+    }
+
+    float max[3];
+    float size = 0.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        Min[axis] = std::numeric_limits<float>::max();
+        max[axis] = -std::numeric_limits<float>::max();
+    }
+    for (const BVHPrimitive& primitive: primitives) {
+        const float center[3] = {primitive.Center.X, primitive.Center.Y, primitive.Center.Z};
+        const float extent[3] = {primitive.Extent.X, primitive.Extent.Y, primitive.Extent.Z};
+        for (int axis = 0; axis < 3; ++axis) {
+            Min[axis] = std::min(Min[axis], center[axis] - extent[axis]);
+            max[axis] = std::max(max[axis], center[axis] + extent[axis]);
+            size += 2.0f * extent[axis] / 3.0f;
+        }
+    }
+    size /= primitives.size();
+
+    // cube cells sized so that the grid has about density cells per primitive,
+    // flat scenes are measured as if they were one primitive thick
+    float side[3];
+    float volume = 1.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        side[axis] = std::max(max[axis] - Min[axis], size);
+        volume *= side[axis];
+    }
+    float cellsPerUnit = std::cbrt(density * primitives.size() / volume);
+    for (int axis = 0; axis < 3; ++axis) {
+        Dims[axis] = std::max(1, std::min(MAX_DIM, (int)std::ceil(side[axis] * cellsPerUnit)));
+        CellSize[axis] = side[axis] / Dims[axis];
+    }
+
+    auto cellRange = [&](const BVHPrimitive& primitive, int lo[3], int hi[3]) {
+        const float center[3] = {primitive.Center.X, primitive.Center.Y, primitive.Center.Z};
+        const float extent[3] = {primitive.Extent.X, primitive.Extent.Y, primitive.Extent.Z};
+        for (int axis = 0; axis < 3; ++axis) {
+            lo[axis] = std::max(0, std::min(Dims[axis] - 1, (int)((center[axis] - extent[axis] - Min[axis]) / CellSize[axis])));
+            hi[axis] = std::max(0, std::min(Dims[axis] - 1, (int)((center[axis] + extent[axis] - Min[axis]) / CellSize[axis])));
+        }
+    };
+
+    // counting sort of the sphere references by cell
+    CellStarts.assign(CellsNumber() + 1, 0);
+    int lo[3];
+    int hi[3];
+    for (const BVHPrimitive& primitive: primitives) {
+        cellRange(primitive, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+            for (int y = lo[1]; y <= hi[1]; ++y) {
+                for (int x = lo[0]; x <= hi[0]; ++x) {
+                    ++CellStarts[(z * Dims[1] + y) * Dims[0] + x + 1];
+                }
+            }
+        }
+    }
+    for (size_t i = 1; i < CellStarts.size(); ++i) {
+        CellStarts[i] += CellStarts[i - 1];
+    }
+
+    Indices.resize(CellStarts.back());
+    std::vector<int> fill(CellStarts.begin(), CellStarts.end() - 1);
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        cellRange(primitives[i], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+            for (int y = lo[1]; y <= hi[1]; ++y) {
+                for (int x = lo[0]; x <= hi[0]; ++x) {
+                    Indices[fill[(z * Dims[1] + y) * Dims[0] + x]++] = i;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.hpp"
+
+// Regular grid over the sphere bounds, rebuilt from scratch in O(N).
+// Every cell lists the spheres whose boxes overlap it, so a sphere that
+// spans several cells is referenced from each of them.
+//
+// Layout in floats, as written by SceneEncoder in place of tree nodes, integers bit-cast:
+//  0..2                min corner of the grid
+//  3..5                cell size
+//  6..8                cells number along x, y, z
+//  next cells + 1      first reference of each cell, the last one is the references number
+//  next references     sphere indices
+class UniformGrid {
+public:
+    static const int HEADER_SIZE = 9;
+
+    // density is the target number of cells per sphere
+    void Build(const std::vector<BVHPrimitive>& primitives, float density = 2.0f);
+    void Clear();
+    int CellsNumber() const {
+        return Dims[0] * Dims[1] * Dims[2];
+    }
+public:
+    float Min[3] = {0.0f, 0.0f, 0.0f};
+    float CellSize[3] = {1.0f, 1.0f, 1.0f};
+    int Dims[3] = {0, 0, 0};
+    std::vector<int> CellStarts;
+    std::vector<int> Indices;
+};
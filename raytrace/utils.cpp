@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <memory>
 
@@ -16,3 +17,25 @@ void SaveFile(const std::string& fileName, const std::string& data) {
     ofs.open(fileName, std::fstream::binary | std::fstream::out);
     ofs.write(data.c_str(), data.size());
 }
+
+uint64_t HashData(const std::string& data, uint64_t hash) {
+    for (unsigned char c: data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    // the length separates chained strings, "ab" + "c" from "a" + "bc"
+    hash ^= data.size();
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+size_t GetCapacity(size_t capacity, size_t size, size_t minCapacity) {
+    capacity = std::max(capacity, minCapacity);
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    while (capacity / 2 >= minCapacity && size < capacity / 4) {
+        capacity /= 2;
+    }
+    return capacity;
+}
@@ -1,5 +1,15 @@
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 std::string LoadFile(const std::string& fileName);
 void SaveFile(const std::string& fileName, const std::string& data);
 
+// Capacity of a buffer that has to hold size elements: doubles when they no longer fit,
+// halves once they take less than a quarter of it and stays put in between, so a scene
+// growing or shrinking a little does not reallocate every frame
+size_t GetCapacity(size_t capacity, size_t size, size_t minCapacity);
+
+// 64-bit FNV-1a, chain calls through hash to cover several strings
+uint64_t HashData(const std::string& data, uint64_t hash = 14695981039346656037ull);
+
@@ -0,0 +1,116 @@
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+static float Area(const BVHNode& node) {
+    float dx = node.Max[0] - node.Min[0];
+    float dy = node.Max[1] - node.Min[1];
+    float dz = node.Max[2] - node.Min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static void PackBytes(const uint8_t* bytes, int count, float* out) {
+    for (int i = 0; i < count; i += 4) {
+        memcpy(&out[i / 4], &bytes[i], 4);
+    }
+}
+
+void WideBVH::Build(const BVH& bvh, int width) {
+    Width = width;
+    NodesNumber = 0;
+    Depth = 0;
+    Data.clear();
+    if (bvh.Nodes.empty()) {
+        return;
+    }
+    Data.reserve(bvh.Nodes.size() / (Width - 1) * NodeSize(Width) + NodeSize(Width));
+    Collapse(bvh, 0, 1);
+}
+
+int WideBVH::Collapse(const BVH& bvh, int binaryIdx, int depth) {
+    Depth = std::max(Depth, depth);
+
+    // open the inner slot with the largest surface until the node is full
+    std::vector<int> slots;
+    const BVHNode& root = bvh.Nodes[binaryIdx];
+    if (root.Count > 0) {
+        slots.push_back(binaryIdx);
+    } else {
+        slots.push_back(root.LeftOrFirst);
+        slots.push_back(root.LeftOrFirst + 1);
+    }
+    while ((int)slots.size() < Width) {
+        int best = -1;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            const BVHNode& node = bvh.Nodes[slots[i]];
+            if (node.Count == 0 && (best < 0 || Area(node) > Area(bvh.Nodes[slots[best]]))) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        int left = bvh.Nodes[slots[best]].LeftOrFirst;
+        slots[best] = left;
+        slots.push_back(left + 1);
+    }
+
+    int nodeIdx = NodesNumber++;
+    size_t offset = nodeIdx * NodeSize(Width);
+    Data.resize(offset + NodeSize(Width), 0.0f);
+
+    float origin[3];
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = root.Min[axis];
+        float hi = root.Max[axis];
+        origin[axis] = lo;
+        scale[axis] = std::max((hi - lo) / 255.0f, 1e-20f);
+        Data[offset + axis] = origin[axis];
+        Data[offset + 3 + axis] = scale[axis];
+    }
+
+    uint8_t quantized[6][8];
+    uint8_t counts[8];
+    memset(quantized, 0, sizeof(quantized));
+    memset(counts, 0, sizeof(counts));
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        const BVHNode& node = bvh.Nodes[slots[i]];
+        for (int axis = 0; axis < 3; ++axis) {
+            // round outwards, then fix up float error so the decoded box always contains the child
+            int lo = std::floor((node.Min[axis] - origin[axis]) / scale[axis]);
+            int hi = std::ceil((node.Max[axis] - origin[axis]) / scale[axis]);
+            lo = std::max(0, std::min(255, lo));
+            hi = std::max(0, std::min(255, hi));
+            while (lo > 0 && origin[axis] + lo * scale[axis] > node.Min[axis]) {
+                --lo;
+            }
+            while (hi < 255 && origin[axis] + hi * scale[axis] < node.Max[axis]) {
+                ++hi;
+            }
+            quantized[axis][i] = lo;
+            quantized[3 + axis][i] = hi;
+        }
+        if (node.Count > 0) {
+            Data[offset + ChildIdx(Width) + i] = PackInt(-(node.LeftOrFirst + 1));
+            counts[i] = node.Count;
+        }
+    }
+
+    for (int q = 0; q < 6; ++q) {
+        PackBytes(quantized[q], Width, &Data[offset + 6 + q * Width / 4]);
+    }
+    PackBytes(counts, Width, &Data[offset + CountIdx(Width)]);
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (bvh.Nodes[slots[i]].Count == 0) {
+            int child = Collapse(bvh, slots[i], depth + 1);
+            Data[nodeIdx * NodeSize(Width) + ChildIdx(Width) + i] = PackInt(child);
+        }
+    }
+    return nodeIdx;
+}
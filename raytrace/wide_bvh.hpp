@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.hpp"
+
+// BVH with 4 or 8 children per node, collapsed from a binary BVH.
+// Child boxes are stored as 8-bit offsets from the node box, so a child
+// costs about 3.5 floats instead of the 8 floats of a binary node.
+//
+// Node layout in floats, W = width:
+//  0..2                origin, the min corner of the node box
+//  3..5                scale, a child bound is origin + q * scale
+//  6..6+1.5W           quantized min x, y, z then max x, y, z, W bytes each, packed 4 per float
+//  next W              child: inner node index, or -(first + 1) for a leaf, bit-cast ints
+//  next W/4            primitives count per child, W bytes packed 4 per float, 0 for inner and empty children
+//
+// Empty children have child 0 and count 0: the root is never anyone's child.
+class WideBVH {
+public:
+    static int NodeSize(int width) {
+        return 6 + 6 * width / 4 + width + width / 4;
+    }
+    static int ChildIdx(int width) {
+        return 6 + 6 * width / 4;
+    }
+    static int CountIdx(int width) {
+        return 6 + 6 * width / 4 + width;
+    }
+
+    void Build(const BVH& bvh, int width);
+public:
+    int Width = 4;
+    int NodesNumber = 0;
+    int Depth = 0;      // inner nodes on the longest path from the root to a leaf
+    std::vector<float> Data;
+private:
+    int Collapse(const BVH& bvh, int binaryIdx, int depth);
+};